@@ -41,6 +41,18 @@ get_svec_array_elms(ArrayType *inArrayType, Datum **outSvecArr, int *outLen)
                   outLen);                   /* nelemsp */
 }
 
+static
+inline
+KMeansMetric
+get_metric(int inMetric)
+{
+    if (inMetric < L1NORM || inMetric > TANIMOTO)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid metric")));
+    return (KMeansMetric) inMetric;
+}
+
 static
 inline
 PGFunction
@@ -53,11 +65,7 @@ get_metric_fn(KMeansMetric inMetric)
             svec_svec_tanimoto_distance
         };
     
-    if (inMetric < 1 || inMetric > sizeof(metrics)/sizeof(PGFunction))
-        ereport(ERROR,
-                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                 errmsg("invalid metric")));
-    return metrics[inMetric - 1];
+    return metrics[get_metric(inMetric) - 1];
 }
 
 static
@@ -102,37 +110,204 @@ setup_mem_context_for_functional_calls() {
     return ctxt;
 }
 
+/*
+ * An array of centroids, decoded for the distance kernels below. The
+ * per-point functions get the same array for every row of a scan, so it is
+ * only decoded (and detoasted) when it changes, and kept in fn_extra. The
+ * raw argument identifies it: if it was toasted, this is just the short
+ * TOAST pointer.
+ */
+typedef struct {
+    MemoryContext   mem_context;
+    struct varlena *raw;
+    int             num_centroids;
+    int             lbound;
+    SvecType      **svecs;
+    SparseData     *sdata;
+    float8         *norms;
+} KMeansCentroids;
+
+/* The arguments of a function that hold cached centroids */
+#define KMEANS_CACHED_ARGS 6
+
+typedef struct {
+    KMeansCentroids *args[KMEANS_CACHED_ARGS];
+} KMeansFnCache;
+
+/* A point, decoded once for its distances to all centroids */
+typedef struct {
+    SvecType       *svec;
+    SparseData      sdata;
+    float8          norm;
+} KMeansPoint;
+
+static
+KMeansFnCache *
+get_fn_cache(FunctionCallInfo fcinfo)
+{
+    if (fcinfo->flinfo->fn_extra == NULL)
+        fcinfo->flinfo->fn_extra = MemoryContextAllocZero(
+            fcinfo->flinfo->fn_mcxt, sizeof(KMeansFnCache));
+    return (KMeansFnCache *) fcinfo->flinfo->fn_extra;
+}
+
+/*
+ * Returns the centroids in argument inArgNo, decoding them only if they
+ * differ from those of the previous call.
+ */
+static
+KMeansCentroids *
+get_cached_centroids(FunctionCallInfo fcinfo, int inArgNo)
+{
+    KMeansFnCache  *cache = get_fn_cache(fcinfo);
+    KMeansCentroids *centroids = cache->args[inArgNo];
+    struct varlena *raw = PG_GETARG_RAW_VARLENA_P(verify_arg_nonnull(fcinfo,
+                            inArgNo));
+    ArrayType      *arr;
+    Datum          *elems;
+    MemoryContext   mem_context, old_context;
+
+    if (centroids && VARSIZE_ANY(raw) == VARSIZE_ANY(centroids->raw)
+        && memcmp(raw, centroids->raw, VARSIZE_ANY(raw)) == 0)
+        return centroids;
+
+    if (centroids)
+        MemoryContextDelete(centroids->mem_context);
+    mem_context = AllocSetContextCreate(fcinfo->flinfo->fn_mcxt,
+        "kMeansCentroids",
+        ALLOCSET_DEFAULT_MINSIZE,
+        ALLOCSET_DEFAULT_INITSIZE,
+        ALLOCSET_DEFAULT_MAXSIZE);
+    old_context = MemoryContextSwitchTo(mem_context);
+
+    centroids = (KMeansCentroids *) palloc0(sizeof(KMeansCentroids));
+    centroids->mem_context = mem_context;
+    centroids->raw = (struct varlena *) palloc(VARSIZE_ANY(raw));
+    memcpy(centroids->raw, raw, VARSIZE_ANY(raw));
+
+    /* sdata_from_svec() writes into the svecs, so they must be our own */
+    arr = DatumGetArrayTypePCopy(PointerGetDatum(raw));
+    get_svec_array_elms(arr, &elems, &centroids->num_centroids);
+    centroids->lbound = ARR_NDIM(arr) > 0 ? ARR_LBOUND(arr)[0] : 1;
+    centroids->svecs = (SvecType **) palloc(
+        sizeof(SvecType *) * Max(centroids->num_centroids, 1));
+    centroids->sdata = (SparseData *) palloc(
+        sizeof(SparseData) * Max(centroids->num_centroids, 1));
+    centroids->norms = (float8 *) palloc(
+        sizeof(float8) * Max(centroids->num_centroids, 1));
+    for (int i = 0; i < centroids->num_centroids; i++) {
+        centroids->svecs[i] = DatumGetSvecTypeP(elems[i]);
+        centroids->sdata[i] = sdata_from_svec(centroids->svecs[i]);
+        centroids->norms[i] = l2norm_sdata_values_double(centroids->sdata[i]);
+    }
+
+    MemoryContextSwitchTo(old_context);
+    cache->args[inArgNo] = centroids;
+    return centroids;
+}
+
+static
+inline
+void
+get_point(FunctionCallInfo fcinfo, int inArgNo, KMeansMetric inMetric,
+    KMeansPoint *outPoint)
+{
+    outPoint->svec = PG_GETARG_SVECTYPE_P(verify_arg_nonnull(fcinfo, inArgNo));
+    outPoint->sdata = sdata_from_svec(outPoint->svec);
+    outPoint->norm = (inMetric == COSINE || inMetric == TANIMOTO)
+        ? l2norm_sdata_values_double(outPoint->sdata) : 0.;
+}
+
+/*
+ * The distance between a point and a cached centroid: the same as the
+ * metric's SQL function, but without calling it through fmgr, and with the
+ * centroid already decoded and its norm computed.
+ */
+static
+float8
+centroid_distance(KMeansMetric inMetric, KMeansPoint *inPoint,
+    KMeansCentroids *inCentroids, int inPos)
+{
+    SvecType       *centroid = inCentroids->svecs[inPos];
+    SparseData      csdata = inCentroids->sdata[inPos];
+    float8          m1 = inPoint->norm, m2 = inCentroids->norms[inPos];
+    float8          dot, result;
+
+    switch (inMetric) {
+        case L1NORM:
+            check_dimension(inPoint->svec, centroid, "l1norm");
+            result = l1dist_sdata_values_double(inPoint->sdata, csdata);
+            break;
+        case L2NORM:
+            check_dimension(inPoint->svec, centroid, "l2norm");
+            result = l2dist_sdata_values_double(inPoint->sdata, csdata);
+            break;
+        case COSINE:
+            check_dimension(inPoint->svec, centroid, "svec_svec_dot_product");
+            dot = dot_sdata_values_double(inPoint->sdata, csdata);
+            if (IS_NVP(dot) || IS_NVP(m1) || IS_NVP(m2)) {
+                result = NVP;
+                break;
+            }
+            result = dot / (m1 * m2);
+            if (result > 1.)
+                result = 1.;
+            else if (result < -1.)
+                result = -1.;
+            result = acos(result);
+            break;
+        case TANIMOTO:
+            check_dimension(inPoint->svec, centroid, "svec_svec_dot_product");
+            dot = dot_sdata_values_double(inPoint->sdata, csdata);
+            if (IS_NVP(dot) || IS_NVP(m1) || IS_NVP(m2)) {
+                result = NVP;
+                break;
+            }
+            result = dot / (m1 * m1 + m2 * m2 - dot);
+            if (result > 1.)
+                result = 1.;
+            else if (result < 0.)
+                result = 0.;
+            result = 1. - result;
+            break;
+        default:
+            ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid metric")));
+    }
+    if (IS_NVP(result))
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("k-means distance is not defined for NULL coordinates")));
+    return result;
+}
+
 PG_FUNCTION_INFO_V1(internal_get_array_of_close_canopies);
 Datum
 internal_get_array_of_close_canopies(PG_FUNCTION_ARGS)
 {
-    SvecType       *svec;
-    Datum          *all_canopies;
-    int             num_all_canopies;
+    KMeansPoint     point;
+    KMeansCentroids *all_canopies;
     float8          threshold;
-    PGFunction      metric_fn;
+    KMeansMetric    metric;
     
     ArrayType      *close_canopies_arr;
     int4           *close_canopies;
     int             num_close_canopies;
     size_t          bytes;
-    MemoryContext   mem_context_for_function_calls;
     
-    svec = PG_GETARG_SVECTYPE_P(verify_arg_nonnull(fcinfo, 0));
-    get_svec_array_elms(PG_GETARG_ARRAYTYPE_P(verify_arg_nonnull(fcinfo, 1)),
-        &all_canopies, &num_all_canopies);
+    all_canopies = get_cached_centroids(fcinfo, 1);
     threshold = PG_GETARG_FLOAT8(verify_arg_nonnull(fcinfo, 2));
-    metric_fn = get_metric_fn(PG_GETARG_INT32(verify_arg_nonnull(fcinfo, 3)));
+    metric = get_metric(PG_GETARG_INT32(verify_arg_nonnull(fcinfo, 3)));
+    get_point(fcinfo, 0, metric, &point);
     
-    mem_context_for_function_calls = setup_mem_context_for_functional_calls();
-    close_canopies = (int4 *) palloc(sizeof(int4) * num_all_canopies);
+    close_canopies = (int4 *) palloc(sizeof(int4)
+        * Max(all_canopies->num_centroids, 1));
     num_close_canopies = 0;
-    for (int i = 0; i < num_all_canopies; i++) {
-        if (compute_metric(metric_fn, mem_context_for_function_calls,
-                PointerGetDatum(svec), all_canopies[i]) < threshold)
+    for (int i = 0; i < all_canopies->num_centroids; i++) {
+        if (centroid_distance(metric, &point, all_canopies, i) < threshold)
             close_canopies[num_close_canopies++] = i + 1 /* lower bound */;
     }
-    MemoryContextDelete(mem_context_for_function_calls);
 
     /* If we cannot find any close canopy, return NULL. Note that the result
      * we return will be passed to internal_kmeans_closest_centroid() and if the
@@ -154,28 +329,52 @@ internal_get_array_of_close_canopies(PG_FUNCTION_ARGS)
     PG_RETURN_ARRAYTYPE_P(close_canopies_arr);
 }
 
+/*
+ * Returns the zero-based position of the centroid closest to inPoint. If
+ * inCanopyIds is not NULL, only the centroids at the (lbound-based)
+ * positions it lists are considered.
+ */
+static
+int
+closest_centroid(KMeansPoint *inPoint, KMeansCentroids *inCentroids,
+    int4 *inCanopyIds, int inNumCanopyIds, int inCanopyLbound,
+    KMeansMetric inMetric)
+{
+    float8          distance, min_distance = INFINITY;
+    int             closest = 0;
+    int             cid;
+    int             num = inCanopyIds ? inNumCanopyIds
+                                      : inCentroids->num_centroids;
+
+    for (int i = 0; i < num; i++) {
+        cid = inCanopyIds ? inCanopyIds[i] - inCanopyLbound : i;
+        if (cid < 0 || cid >= inCentroids->num_centroids)
+            ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("internal error: close canopy %d out of range", cid)));
+        distance = centroid_distance(inMetric, inPoint, inCentroids, cid);
+        if (distance < min_distance) {
+            closest = cid;
+            min_distance = distance;
+        }
+    }
+    return closest;
+}
+
 PG_FUNCTION_INFO_V1(internal_kmeans_closest_centroid);
 Datum
 internal_kmeans_closest_centroid(PG_FUNCTION_ARGS) {
-    SvecType       *svec;
+    KMeansPoint     point;
     ArrayType      *canopy_ids_arr = NULL;
     int4           *canopy_ids = NULL;
-    ArrayType      *centroids_arr;
-    Datum          *centroids;
-    int             num_centroids;
-    PGFunction      metric_fn;
+    int             num_canopy_ids = 0;
+    int             canopy_lbound = 0;
+    KMeansCentroids *centroids;
+    KMeansMetric    metric;
 
-    bool            indirect;
-    float8          distance, min_distance = INFINITY;
-    int             closest_centroid = 0;
-    int             cid;
-    MemoryContext   mem_context_for_function_calls;
+    int             closest;
 
-    svec = PG_GETARG_SVECTYPE_P(verify_arg_nonnull(fcinfo, 0));
-    if (PG_ARGISNULL(1)) {
-        indirect = false;
-    } else {
-        indirect = true;
+    if (!PG_ARGISNULL(1)) {
         canopy_ids_arr = PG_GETARG_ARRAYTYPE_P(1);
         /* There should always be a close canopy, but let's be on the safe side. */
         if (ARR_NDIM(canopy_ids_arr) == 0)
@@ -183,26 +382,17 @@ internal_kmeans_closest_centroid(PG_FUNCTION_ARGS) {
                 (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                  errmsg("internal error: array of close canopies cannot be empty")));
         canopy_ids = (int4*) ARR_DATA_PTR(canopy_ids_arr);
+        num_canopy_ids = ARR_DIMS(canopy_ids_arr)[0];
+        canopy_lbound = ARR_LBOUND(canopy_ids_arr)[0];
     }
-    centroids_arr = PG_GETARG_ARRAYTYPE_P(verify_arg_nonnull(fcinfo, 2));
-    get_svec_array_elms(centroids_arr, &centroids, &num_centroids);
-    if (!PG_ARGISNULL(1))
-        num_centroids = ARR_DIMS(canopy_ids_arr)[0];
-    metric_fn = get_metric_fn(PG_GETARG_INT32(verify_arg_nonnull(fcinfo, 3)));
+    centroids = get_cached_centroids(fcinfo, 2);
+    metric = get_metric(PG_GETARG_INT32(verify_arg_nonnull(fcinfo, 3)));
+    get_point(fcinfo, 0, metric, &point);
 
-    mem_context_for_function_calls = setup_mem_context_for_functional_calls();
-    for (int i = 0; i < num_centroids; i++) {
-        cid = indirect ? canopy_ids[i] - ARR_LBOUND(canopy_ids_arr)[0] : i;
-        distance = compute_metric(metric_fn, mem_context_for_function_calls,
-            PointerGetDatum(svec), centroids[cid]);
-        if (distance < min_distance) {
-            closest_centroid = cid;
-            min_distance = distance;
-        }
-    }
-    MemoryContextDelete(mem_context_for_function_calls);
+    closest = closest_centroid(&point, centroids, canopy_ids, num_canopy_ids,
+        canopy_lbound, metric);
     
-    PG_RETURN_INT32(closest_centroid + ARR_LBOUND(centroids_arr)[0]);
+    PG_RETURN_INT32(closest + centroids->lbound);
 }
 
 PG_FUNCTION_INFO_V1(internal_kmeans_canopy_transition);
@@ -295,3 +485,250 @@ internal_remove_close_canopies(PG_FUNCTION_ARGS) {
             'd') /* elmalign */
         );
 }
+
+/*
+ * Compares two svecs element by element; their bytes cannot be compared
+ * directly, since sdata_from_svec() stores pointers inside them.
+ */
+static
+inline
+bool
+svec_datum_eq(Datum inVec1, Datum inVec2)
+{
+    return sparsedata_eq(sdata_from_svec(DatumGetSvecTypeP(inVec1)),
+        sdata_from_svec(DatumGetSvecTypeP(inVec2)));
+}
+
+static
+float8 *
+get_float8_array_elms(ArrayType *inArrayType, int inLen)
+{
+    if (ARR_ELEMTYPE(inArrayType) != FLOAT8OID || ARR_NDIM(inArrayType) != 1
+        || ARR_HASNULL(inArrayType) || ARR_DIMS(inArrayType)[0] != inLen)
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("internal error: expected a float8[] of %d elements",
+                inLen)));
+    return (float8 *) ARR_DATA_PTR(inArrayType);
+}
+
+PG_FUNCTION_INFO_V1(internal_kmeans_move_centroid);
+/*
+ * Returns the centroid moved to the weighted mean of its old position, with
+ * the given weight, and the points closest to it, given by their sum and
+ * count. Without weight, this is the mean of the points. As in mini-batch
+ * k-means (D. Sculley, "Web-scale k-means clustering", WWW 2010), a
+ * centroid that already stands for w points thus moves to
+ * (w * c + sum) / (w + count): every point has a learning rate of one over
+ * the number of points its centroid has seen, and a centroid stays the
+ * mean of all points ever assigned to it. The sum is kept sparse.
+ */
+Datum
+internal_kmeans_move_centroid(PG_FUNCTION_ARGS) {
+    SvecType       *centroid = PG_GETARG_SVECTYPE_P(0);
+    float8          weight = PG_GETARG_FLOAT8(1);
+    SvecType       *sum = PG_GETARG_SVECTYPE_P(2);
+    int64           count = PG_GETARG_INT64(3);
+    SparseData      sdata = sdata_from_svec(sum);
+    SparseData      result;
+    float8          total;
+
+    if (!(weight >= 0.) || count < 0)
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("k-means centroid weights must not be negative")));
+    if (count == 0)
+        PG_RETURN_SVECTYPE_P(centroid);
+    check_dimension(centroid, sum, "internal_kmeans_move_centroid");
+
+    if (weight > 0.) {
+        result = op_sdata_by_scalar_copy(multiply, (char *) &weight,
+            sdata_from_svec(centroid), true);
+        result = op_sdata_by_sdata(add, result, sdata);
+    } else
+        result = makeSparseDataCopy(sdata);
+    total = weight + count;
+    op_sdata_by_scalar_inplace(divide, (char *) &total, result, true);
+
+    PG_RETURN_SVECTYPE_P(svec_from_sparsedata(result, true));
+}
+
+/*
+ * Accelerated assignment, after G. Hamerly, "Making k-means even faster",
+ * SDM 2010. Every point keeps its centroid, an upper bound on the distance
+ * to it, and a lower bound on the distance to every other centroid. After
+ * the centroids move, the bounds are loosened by how far they moved; the
+ * distances are only computed again if the bounds no longer prove that the
+ * centroid is still the closest one. This relies on the triangle
+ * inequality, which holds for the l1, l2 and angle metrics, but not for
+ * the Tanimoto distance.
+ *
+ * The bounds of a point are a float8[] of its (one-based) centroid, the
+ * upper bound, the lower bound, and 1 if the centroid changed, else 0.
+ */
+#define KMEANS_BOUNDS_LEN 4
+
+static
+void
+check_bounded_metric(int inMetric)
+{
+    if (inMetric != L1NORM && inMetric != L2NORM && inMetric != COSINE)
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("bounded k-means assignment requires a metric that "
+                "satisfies the triangle inequality")));
+}
+
+PG_FUNCTION_INFO_V1(internal_kmeans_bounded_assign);
+/*
+ * Assigns a point to its closest centroid, given its bounds from the
+ * previous iteration (or NULL), how far each centroid moved since then,
+ * and half the distance from each centroid to the closest other one.
+ */
+Datum
+internal_kmeans_bounded_assign(PG_FUNCTION_ARGS) {
+    KMeansPoint     point;
+    float8         *prev_bounds = NULL;
+    KMeansCentroids *centroids;
+    int             num_centroids;
+    float8         *drift = NULL;
+    float8         *separation;
+    KMeansMetric    metric;
+
+    float8          bounds[KMEANS_BOUNDS_LEN];
+    float8          upper, lower, distance;
+    int             closest = -1, prev_closest = -1;
+
+    centroids = get_cached_centroids(fcinfo, 2);
+    num_centroids = centroids->num_centroids;
+    if (num_centroids == 0)
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("internal error: array of centroids cannot be empty")));
+    if (!PG_ARGISNULL(1))
+        prev_bounds = get_float8_array_elms(PG_GETARG_ARRAYTYPE_P(1),
+            KMEANS_BOUNDS_LEN);
+    if (!PG_ARGISNULL(3))
+        drift = get_float8_array_elms(PG_GETARG_ARRAYTYPE_P(3), num_centroids);
+    separation = get_float8_array_elms(
+        PG_GETARG_ARRAYTYPE_P(verify_arg_nonnull(fcinfo, 4)), num_centroids);
+    check_bounded_metric(PG_GETARG_INT32(verify_arg_nonnull(fcinfo, 5)));
+    metric = get_metric(PG_GETARG_INT32(5));
+    get_point(fcinfo, 0, metric, &point);
+
+    if (prev_bounds) {
+        prev_closest = (int) prev_bounds[0] - 1;
+        if (prev_closest < 0 || prev_closest >= num_centroids)
+            ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("internal error: k-means bounds refer to centroid %d of %d",
+                    prev_closest + 1, num_centroids)));
+    }
+    if (prev_bounds && drift) {
+        float8  max_drift = 0., bound;
+
+        for (int i = 0; i < num_centroids; i++)
+            if (i != prev_closest && drift[i] > max_drift)
+                max_drift = drift[i];
+        upper = prev_bounds[1] + drift[prev_closest];
+        lower = prev_bounds[2] - max_drift;
+        bound = Max(separation[prev_closest], lower);
+        if (upper >= bound) {
+            /* Tighten the upper bound before giving up */
+            upper = centroid_distance(metric, &point, centroids, prev_closest);
+        }
+        if (upper < bound)
+            closest = prev_closest;
+    }
+    if (closest < 0) {
+        /* Compute the distance to every centroid */
+        upper = lower = INFINITY;
+        closest = 0;
+        for (int i = 0; i < num_centroids; i++) {
+            distance = centroid_distance(metric, &point, centroids, i);
+            if (distance < upper) {
+                lower = upper;
+                upper = distance;
+                closest = i;
+            } else if (distance < lower)
+                lower = distance;
+        }
+    }
+
+    bounds[0] = closest + 1;
+    bounds[1] = upper;
+    bounds[2] = lower;
+    bounds[3] = closest != prev_closest;
+    PG_RETURN_ARRAYTYPE_P(construct_array((Datum *) bounds, KMEANS_BOUNDS_LEN,
+        FLOAT8OID, sizeof(float8), true, 'd'));
+}
+
+PG_FUNCTION_INFO_V1(internal_kmeans_centroid_drift);
+/*
+ * Returns the distance each centroid moved.
+ */
+Datum
+internal_kmeans_centroid_drift(PG_FUNCTION_ARGS) {
+    Datum          *prev_centroids, *centroids;
+    int             num_prev_centroids, num_centroids;
+    float8         *drift;
+    PGFunction      metric_fn;
+    MemoryContext   mem_context_for_function_calls;
+
+    get_svec_array_elms(PG_GETARG_ARRAYTYPE_P(0), &prev_centroids,
+        &num_prev_centroids);
+    get_svec_array_elms(PG_GETARG_ARRAYTYPE_P(1), &centroids, &num_centroids);
+    check_bounded_metric(PG_GETARG_INT32(2));
+    metric_fn = get_metric_fn(PG_GETARG_INT32(2));
+    if (num_prev_centroids != num_centroids)
+        ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("internal error: the number of centroids changed")));
+
+    mem_context_for_function_calls = setup_mem_context_for_functional_calls();
+    drift = (float8 *) palloc(sizeof(float8) * Max(num_centroids, 1));
+    for (int i = 0; i < num_centroids; i++)
+        drift[i] = svec_datum_eq(prev_centroids[i], centroids[i])
+            ? 0.
+            : compute_metric(metric_fn, mem_context_for_function_calls,
+                prev_centroids[i], centroids[i]);
+    MemoryContextDelete(mem_context_for_function_calls);
+
+    PG_RETURN_ARRAYTYPE_P(construct_array((Datum *) drift, num_centroids,
+        FLOAT8OID, sizeof(float8), true, 'd'));
+}
+
+PG_FUNCTION_INFO_V1(internal_kmeans_centroid_separation);
+/*
+ * Returns half the distance from each centroid to the closest other one.
+ * A point closer than that to a centroid is closer to it than to any other.
+ */
+Datum
+internal_kmeans_centroid_separation(PG_FUNCTION_ARGS) {
+    Datum          *centroids;
+    int             num_centroids;
+    float8         *separation;
+    float8          distance;
+    PGFunction      metric_fn;
+    MemoryContext   mem_context_for_function_calls;
+
+    get_svec_array_elms(PG_GETARG_ARRAYTYPE_P(0), &centroids, &num_centroids);
+    check_bounded_metric(PG_GETARG_INT32(1));
+    metric_fn = get_metric_fn(PG_GETARG_INT32(1));
+
+    mem_context_for_function_calls = setup_mem_context_for_functional_calls();
+    separation = (float8 *) palloc(sizeof(float8) * Max(num_centroids, 1));
+    for (int i = 0; i < num_centroids; i++)
+        separation[i] = INFINITY;
+    for (int i = 0; i < num_centroids; i++)
+        for (int j = i + 1; j < num_centroids; j++) {
+            distance = compute_metric(metric_fn,
+                mem_context_for_function_calls, centroids[i], centroids[j]) / 2;
+            separation[i] = Min(separation[i], distance);
+            separation[j] = Min(separation[j], distance);
+        }
+    MemoryContextDelete(mem_context_for_function_calls);
+
+    PG_RETURN_ARRAYTYPE_P(construct_array((Datum *) separation, num_centroids,
+        FLOAT8OID, sizeof(float8), true, 'd'));
+}
@@ -34,6 +34,7 @@
 #include "nodes/execnodes.h"
 #include "fmgr.h"
 #include "sketch_support.h"
+#include "sketch_hash.h"
 #include "catalog/pg_type.h"
 #include "countmin.h"
 
@@ -67,6 +68,7 @@ Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS)
     /* get the provided element, being careful in case it's NULL */
     if (!PG_ARGISNULL(1)) {
         transblob = cmsketch_check_transval(fcinfo, true);
+        transblob = cmsketch_reserve(transblob, 1);
         transval = (cmtransval *)(VARDATA(transblob));
 
         /* the following line modifies the contents of transval, and hence transblob */
@@ -76,6 +78,77 @@ Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS)
     else PG_RETURN_DATUM(PointerGetDatum(PG_GETARG_BYTEA_P(0)));
 }
 
+PG_FUNCTION_INFO_V1(__cmsketch_int8_param_trans);
+
+/*!
+ * UDF interface for sketches whose dimensions are derived from accuracy
+ * parameters.  Arguments are (transval, value, epsilon, delta) with an
+ * optional (lo, hi) range of the values to be sketched.
+ *
+ * Counts are overestimated by at most epsilon times the number of values,
+ * with probability at least 1 - delta.  That takes e/epsilon counters for
+ * each of ln(1/delta) hash functions.  A declared range needs only
+ * enough dyadic levels to cover hi - lo, rather than RANGES.
+ */
+Datum __cmsketch_int8_param_trans(PG_FUNCTION_ARGS)
+{
+    bytea *     transblob = PG_GETARG_BYTEA_P(0);
+    cmtransval *transval;
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (!CM_TRANSVAL_INITIALIZED(transblob)) {
+        float8 epsilon, delta, width, depth;
+        int64  lo = MIN_INT64;
+        int64  hi = MAX_INT64;
+
+        if (PG_ARGISNULL(2) || PG_ARGISNULL(3))
+            elog(ERROR, "NULL epsilon or delta passed to cmsketch");
+        epsilon = PG_GETARG_FLOAT8(2);
+        delta = PG_GETARG_FLOAT8(3);
+        if (!(epsilon > 0 && epsilon < 1))
+            elog(ERROR, "cmsketch epsilon must be in (0, 1), got %g", epsilon);
+        if (!(delta > 0 && delta < 1))
+            elog(ERROR, "cmsketch delta must be in (0, 1), got %g", delta);
+        width = ceil(M_E / epsilon);
+        depth = ceil(log(1.0 / delta));
+        if (width > CM_MAX_WIDTH)
+            elog(ERROR, "cmsketch epsilon %g needs more than %d counters per hash function",
+                 epsilon, CM_MAX_WIDTH);
+        if (depth > CM_MAX_DEPTH)
+            elog(ERROR, "cmsketch delta %g needs more than %d hash functions",
+                 delta, CM_MAX_DEPTH);
+
+        if (PG_NARGS() > 5) {
+            if (PG_ARGISNULL(4) || PG_ARGISNULL(5))
+                elog(ERROR, "NULL range passed to cmsketch");
+            lo = PG_GETARG_INT64(4);
+            hi = PG_GETARG_INT64(5);
+            if (lo > hi)
+                elog(ERROR, "cmsketch range is empty: lo " INT64_FORMAT
+                     " > hi " INT64_FORMAT, lo, hi);
+        }
+        transblob = cmsketch_init_transval(sketch_get_typinfo(fcinfo, 1),
+                                           (uint32)width, (uint16)Max(depth, 1),
+                                           lo, hi);
+        ((cmtransval *)VARDATA(transblob))->nargs = 0;
+    }
+
+    if (!PG_ARGISNULL(1)) {
+        transblob = cmsketch_reserve(transblob, 1);
+        transval = (cmtransval *)(VARDATA(transblob));
+        countmin_dyadic_trans_c(transval, PG_GETARG_DATUM(1));
+    }
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
 /*!
  * check if the transblob is not initialized, and do so if not
  * \param transblob a cmsketch transval packed in a bytea
@@ -84,7 +157,6 @@ bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
 {
     bytea *     transblob = PG_GETARG_BYTEA_P(0);
     cmtransval *transval;
-    Oid         element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
 
     /*
      * an uninitialized transval should be a datum smaller than sizeof(cmtransval).
@@ -92,7 +164,10 @@ bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
      */
     if (!CM_TRANSVAL_INITIALIZED(transblob)) {
         /* XXX would be nice to pfree the existing transblob, but pfree complains. */
-        transblob = cmsketch_init_transval(element_type);
+        transblob = cmsketch_init_transval(sketch_get_typinfo(fcinfo, 1),
+                                           CM_DEFAULT_WIDTH,
+                                           CM_DEFAULT_DEPTH,
+                                           MIN_INT64, MAX_INT64);
         transval = (cmtransval *)VARDATA(transblob);
 
         if (initargs) {
@@ -118,66 +193,214 @@ bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
     return(transblob);
 }
 
-bytea *cmsketch_init_transval(Oid typOid)
+/*!
+ * allocate an empty sketch.  Counters start out 32 bits wide and are
+ * widened by cmsketch_reserve once they could overflow.
+ * \param ti the type being sketched
+ * \param width counters per hash function
+ * \param depth number of hash functions
+ * \param lo smallest value to be sketched
+ * \param hi largest value to be sketched
+ */
+bytea *cmsketch_init_transval(const sketch_typinfo *ti, uint32 width,
+                              uint16 depth, int64 lo, int64 hi)
 {
-    bool        typIsVarlena;
     cmtransval *transval;
+    cmheader    hdr;
+    bytea *     transblob;
+    size_t      sz;
+    /* bits needed for the widest offset from lo; computed unsigned to avoid overflow */
+    uint64      span = (uint64)hi - (uint64)lo;
+    int         spanbits = 0;
+
+    if (width < 1 || width > CM_MAX_WIDTH || depth < 1 || depth > CM_MAX_DEPTH)
+        elog(ERROR, "illegal cmsketch dimensions %u x %u", width, depth);
+
+    while (spanbits < (int)RANGES && (span >> spanbits) != 0)
+        spanbits++;
+
+    memset(&hdr, 0, sizeof(cmheader));
+    hdr.magic = CM_SKETCH_MAGIC;
+    hdr.version = CM_SKETCH_VERSION;
+    hdr.hashfn = SKETCH_HASH_DEFAULT;
+    hdr.seed = SKETCH_HASH_SEED;
+    hdr.width = width;
+    hdr.depth = depth;
+    hdr.counterbits = 32;
+    if (spanbits + 1 < (int)RANGES) {
+        /* level k counts (value - lo) >> k; level spanbits covers the whole range */
+        hdr.levels = spanbits + 1;
+        hdr.lo = lo;
+        hdr.hi = hi;
+    }
+    else {
+        hdr.levels = RANGES;
+        hdr.lo = MIN_INT64;
+        hdr.hi = MAX_INT64;
+    }
 
     /* allocate and zero out a transval via palloc0 */
-    bytea *     transblob = (bytea *)palloc0(CM_TRANSVAL_SZ);
-    SET_VARSIZE(transblob, CM_TRANSVAL_SZ);
+    sz = CM_TRANSVAL_SZ + CM_COUNTERS_SZ(&hdr);
+    transblob = (bytea *)palloc0(sz);
+    SET_VARSIZE(transblob, sz);
 
     transval = (cmtransval *)VARDATA(transblob);
-    transval->typOid = typOid;
-    getTypeOutputInfo(transval->typOid,
-                      &(transval->outFuncOid),
-                      &typIsVarlena);
+    transval->typOid = ti->typOid;
+    transval->outFuncOid = ti->outFuncOid;
+    memcpy(&transval->hdr, &hdr, sizeof(cmheader));
     return(transblob);
 }
 
 /*!
- * perform multiple sketch insertions, one for each dyadic range (from 0 up to RANGES-1).
+ * make sure n more values can be sketched without any counter overflowing.
+ * No counter can exceed the total number of values, so we only need to look
+ * at the total: 32-bit counters are widened to 64 bits once it passes
+ * MAX_UINT32.
+ * \param transblob a cmsketch transval packed in a bytea
+ * \param n the number of values about to be added
+ * \returns transblob, or a widened copy of it
+ */
+bytea *cmsketch_reserve(bytea *transblob, uint64 n)
+{
+    cmheader *hdr = &((cmtransval *)VARDATA(transblob))->hdr;
+
+    if (hdr->total > (uint64)MAX_INT64 - n)
+        elog(ERROR, "maximum count exceeded in sketch");
+    if (hdr->counterbits == 32 && hdr->total + n > MAX_UINT32)
+        transblob = cmsketch_widen(transblob);
+    return transblob;
+}
+
+/*!
+ * copy a sketch with 32-bit counters into one with 64-bit counters
+ * \param transblob a cmsketch transval packed in a bytea
+ */
+bytea *cmsketch_widen(bytea *transblob)
+{
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    cmtransval *newval;
+    bytea *     newblob;
+    uint32 *    narrow = (uint32 *)transval->counters;
+    uint64 *    wide;
+    size_t      n = CM_NUMCOUNTERS(&transval->hdr);
+    size_t      i;
+
+    if (transval->hdr.counterbits == 64)
+        return transblob;
+
+    newblob = (bytea *)palloc(CM_TRANSVAL_SZ + n*sizeof(uint64));
+    SET_VARSIZE(newblob, CM_TRANSVAL_SZ + n*sizeof(uint64));
+    newval = (cmtransval *)VARDATA(newblob);
+    memcpy(newval, transval, sizeof(cmtransval));
+    newval->hdr.counterbits = 64;
+    wide = (uint64 *)newval->counters;
+    for (i = 0; i < n; i++)
+        wide[i] = narrow[i];
+    return newblob;
+}
+
+/*!
+ * read a counter of either width
+ * \param hdr the sketch header
+ * \param counters the counters described by hdr
+ * \param idx the index of the counter, as computed by CM_COUNTER_INDEX
+ */
+uint64 cmsketch_get_counter(cmheader *hdr, char *counters, size_t idx)
+{
+    if (hdr->counterbits == 32)
+        return ((uint32 *)counters)[idx];
+    else
+        return ((uint64 *)counters)[idx];
+}
+
+/*!
+ * compute the counters a value is counted in: one per hash function at each
+ * dyadic level, laid out as [levels][depth].  All of them are distinct.
+ * Shifting eventually leaves 0 or -1, which shifts to itself, so from then on
+ * the hash of the level below is reused rather than recomputed.
+ * \param hdr the sketch header
+ * \param val the value (or offset from hdr->lo) at level 0
+ * \param idx out: hdr->levels * hdr->depth counter indexes
+ */
+static void cmsketch_dyadic_indexes(cmheader *hdr, int64 val, size_t *idx)
+{
+    uint32 j, i;
+    uint32 col[CM_MAX_DEPTH];
+    int64  prev = 0;
+    /* declared as uint16 so the 16-bit slices are aligned */
+    uint16 hash[SKETCH_HASHLEN/2];
+
+    for (j = 0; j < hdr->levels; j++, val >>= 1) {
+        if (j == 0 || val != prev) {
+            prev = val;
+            sketch_hash_bytes(&val, sizeof(int64), hdr->hashfn, hdr->seed,
+                              (uint8 *)hash);
+            for (i = 0; i < hdr->depth; i++)
+                col[i] = hash[i] % hdr->width;
+        }
+        for (i = 0; i < hdr->depth; i++)
+            *idx++ = CM_COUNTER_INDEX(hdr, j, i, col[i]);
+    }
+}
+
+/*!
+ * perform multiple sketch insertions, one for each dyadic level.
+ * All the counter positions are computed first, and then incremented in one
+ * loop per counter width, without any per-counter checks: the caller must
+ * have made room for the value with cmsketch_reserve.
  * * \param transval the cmsketch transval
  * * \param inputi the value to be inserted
  */
 void countmin_dyadic_trans_c(cmtransval *transval, Datum input)
 {
-    uint32 j;
-    
+    cmheader *hdr = &transval->hdr;
+    int64     val = DatumGetInt64(input);
+    size_t    idx[RANGES*CM_MAX_DEPTH];
+    size_t    k, n = (size_t)hdr->levels * hdr->depth;
+
     if (transval->typOid != INT8OID)
         elog(ERROR, "cmsketch can only compute ranges for int64");
 
-    for (j = 0; j < RANGES; j++) {
-        countmin_trans_c(transval->sketches[j], input, 
-                         transval->outFuncOid, transval->typOid);
-        /* now divide by 2 for the next dyadic range */
-        input = Int64GetDatum(DatumGetInt64(input) >> 1);
+    if (hdr->levels < RANGES) {
+        if (val < hdr->lo || val > hdr->hi)
+            elog(ERROR, "value " INT64_FORMAT " outside the cmsketch range ["
+                 INT64_FORMAT ", " INT64_FORMAT "]", val, hdr->lo, hdr->hi);
+        /* fits: hi - lo < 2^(RANGES-2) */
+        val = (int64)((uint64)val - (uint64)hdr->lo);
     }
+
+    cmsketch_dyadic_indexes(hdr, val, idx);
+    if (hdr->counterbits == 32) {
+        uint32 *counters = (uint32 *)transval->counters;
+
+        for (k = 0; k < n; k++)
+            counters[idx[k]]++;
+    }
+    else {
+        uint64 *counters = (uint64 *)transval->counters;
+
+        for (k = 0; k < n; k++)
+            counters[idx[k]]++;
+    }
+    hdr->total++;
 }
 
 /*!
  * Main loop of Cormode and Muthukrishnan's sketching algorithm, for setting counters in
- * sketches at a single "dyadic range". For each call, we want to use DEPTH independent
- * hash functions.  We do this by using a single md5 hash function, and taking
+ * a sketch of the fixed countmin layout, as embedded in MFV sketches.
+ * For each call, we want to use DEPTH independent
+ * hash functions.  We do this by using a single 128-bit hash function, and taking
  * successive 16-bit runs of the result as independent hash outputs.
  * \param sketch the current countmin sketch
- * \param dat the datum to be inserted
- * \param outFuncOid Oid of the PostgreSQL function to convert dat to a string
- * \param typOid Oid of the Postgres type for dat
+ * \param hash the SKETCH_HASHLEN hashed bytes of the datum to be inserted
  */
-Datum countmin_trans_c(countmin sketch, Datum dat, Oid outFuncOid, Oid typOid)
+void countmin_trans_c(countmin sketch, const uint8 *hash)
 {
-	(void) outFuncOid; /* avoid warning about unused parameter */
-    bytea *nhash;
-
-    nhash = sketch_md5_bytea(dat, typOid);
-
     /*
      * iterate through all sketches, incrementing the counters indicated by the hash
      * we don't care about return value here, so 3rd (initialization) argument is arbitrary.
      */
-    (void)hash_counters_iterate(nhash, sketch, 0, &increment_counter);
-    return(PointerGetDatum(nhash));
+    (void)hash_counters_iterate(hash, sketch, 0, &increment_counter);
 }
 
 /*
@@ -185,17 +408,30 @@ Datum countmin_trans_c(countmin sketch, Datum dat, Oid outFuncOid, Oid typOid)
  */
 
 /*!
- * return the array of sketch counters as a bytea
+ * return the sketch header followed by the counters as a bytea
  */
 PG_FUNCTION_INFO_V1(__cmsketch_final);
 Datum __cmsketch_final(PG_FUNCTION_ARGS)
 {
     bytea *     blob = PG_GETARG_BYTEA_P(0);
-    cmtransval *sketch = (cmtransval *)VARDATA(blob);
-    int         len = RANGES*sizeof(countmin) + VARHDRSZ;
-    bytea *out = palloc0(len);    
-    
-    memcpy((uint8 *)VARDATA(out), sketch->sketches, len - VARHDRSZ);
+    cmtransval *transval;
+    size_t      len;
+    bytea *     out;
+
+    if (!CM_TRANSVAL_INITIALIZED(blob)) {
+        /* nothing was aggregated: emit an empty sketch of the default shape */
+        sketch_typinfo ti;
+
+        sketch_lookup_typinfo(INT8OID, &ti);
+        blob = cmsketch_init_transval(&ti, CM_DEFAULT_WIDTH,
+                                      CM_DEFAULT_DEPTH, MIN_INT64, MAX_INT64);
+    }
+    transval = (cmtransval *)VARDATA(blob);
+    len = VARHDRSZ + sizeof(cmheader) + CM_COUNTERS_SZ(&transval->hdr);
+    out = palloc(len);
+    memcpy(VARDATA(out), &transval->hdr, sizeof(cmheader));
+    memcpy(VARDATA(out) + sizeof(cmheader), transval->counters,
+           CM_COUNTERS_SZ(&transval->hdr));
     SET_VARSIZE(out, len);
     
     PG_RETURN_BYTEA_P(out);
@@ -212,11 +448,9 @@ Datum __cmsketch_merge(PG_FUNCTION_ARGS)
     cmtransval *transval1 = (cmtransval *)VARDATA(counterblob1);
     cmtransval *transval2 = (cmtransval *)VARDATA(counterblob2);
     cmtransval *newtrans;
-    countmin *  sketches2 = (countmin *)
-                            ((cmtransval *)(VARDATA(counterblob2)))->sketches;
+    cmheader *  h1, *h2;
     bytea *     newblob;
-    countmin *  newsketches;
-    uint32      i, j, k;
+    size_t      i, n;
     int         sz;
 
     /* make sure they're initialized! */
@@ -224,27 +458,44 @@ Datum __cmsketch_merge(PG_FUNCTION_ARGS)
         && !CM_TRANSVAL_INITIALIZED(counterblob2))
         /* if both are empty can return one of them */
         PG_RETURN_DATUM(PointerGetDatum(counterblob1));
-    else if (!CM_TRANSVAL_INITIALIZED(counterblob1)) {
-        counterblob1 = cmsketch_init_transval(transval2->typOid);
-        transval1 = (cmtransval *)VARDATA(counterblob1);
-    }
-    else if (!CM_TRANSVAL_INITIALIZED(counterblob2)) {
-        counterblob2 = cmsketch_init_transval(transval1->typOid);
-        transval2 = (cmtransval *)VARDATA(counterblob2);
-    }
+    else if (!CM_TRANSVAL_INITIALIZED(counterblob1))
+        PG_RETURN_DATUM(PointerGetDatum(counterblob2));
+    else if (!CM_TRANSVAL_INITIALIZED(counterblob2))
+        PG_RETURN_DATUM(PointerGetDatum(counterblob1));
 
-    sz = VARSIZE(counterblob1);
-    /* allocate a new transval as a copy of counterblob1 */
-    newblob = (bytea *)palloc(sz);
-    memcpy(newblob, counterblob1, sz);
+    h1 = &transval1->hdr;
+    h2 = &transval2->hdr;
+    if (h1->hashfn != h2->hashfn || h1->seed != h2->seed
+        || h1->width != h2->width || h1->depth != h2->depth
+        || h1->levels != h2->levels || h1->lo != h2->lo || h1->hi != h2->hi)
+        elog(ERROR, "cannot merge countmin sketches with different parameters");
+
+    /* allocate a new transval as a copy of counterblob1, wide enough for the sum */
+    newblob = cmsketch_reserve(counterblob1, h2->total);
+    if (newblob == counterblob1) {
+        sz = VARSIZE(counterblob1);
+        newblob = (bytea *)palloc(sz);
+        memcpy(newblob, counterblob1, sz);
+    }
     newtrans = (cmtransval *)(VARDATA(newblob));
-    newsketches = (countmin *)(newtrans)->sketches;
+    n = CM_NUMCOUNTERS(&newtrans->hdr);
 
     /* add in values from counterblob2 */
-    for (i = 0; i < RANGES; i++)
-        for (j = 0; j < DEPTH; j++)
-            for (k = 0; k < NUMCOUNTERS; k++)
-                newsketches[i][j][k] += sketches2[i][j][k];
+    if (newtrans->hdr.counterbits == 32) {
+        /* the totals fit in 32 bits, so both inputs are narrow too */
+        uint32 *sum = (uint32 *)newtrans->counters;
+        uint32 *add = (uint32 *)transval2->counters;
+
+        for (i = 0; i < n; i++)
+            sum[i] += add[i];
+    }
+    else {
+        uint64 *sum = (uint64 *)newtrans->counters;
+
+        for (i = 0; i < n; i++)
+            sum[i] += cmsketch_get_counter(h2, transval2->counters, i);
+    }
+    newtrans->hdr.total += h2->total;
 
     if (newtrans->nargs == -1) {
         /* transfer in the args from the other input */
@@ -266,26 +517,203 @@ Datum __cmsketch_merge(PG_FUNCTION_ARGS)
  * get the approximate count of objects with value arg
  * \param sketch a countmin sketch
  * \param arg the Datum we want to find the count of
- * \param funcOid the Postgres function that converts arg to a string
+ * \param typLen the Postgres type length of arg
+ * \param typByVal whether arg is passed by value
  */
-int64 cmsketch_count_c(countmin sketch, Datum arg, Oid funcOid, Oid typOid)
+int64 cmsketch_count_c(countmin sketch, Datum arg, int16 typLen, bool typByVal)
 {
-    bytea *nhash;
+    uint8 hash[SKETCH_HASHLEN];
 
-    /* get the md5 hash of the argument. */
-    nhash = sketch_md5_bytea(arg, typOid);
-    return(cmsketch_count_md5_datum(sketch, nhash, funcOid));
+    /* get the hash of the argument. */
+    sketch_hash_datum(arg, typLen, typByVal, hash);
+    return(cmsketch_count_hashed(sketch, hash));
 }
 
-int64 cmsketch_count_md5_datum(countmin sketch, bytea *md5_bytea, Oid funcOid)
+/*!
+ * get the approximate count of the value whose hash is given
+ * \param sketch a countmin sketch
+ * \param hash the SKETCH_HASHLEN hashed bytes of the value
+ */
+int64 cmsketch_count_hashed(countmin sketch, const uint8 *hash)
 {
-	(void) funcOid; /* avoid warning about unused parameter */
     /* iterate through the sketches, finding the min counter associated with this hash */
-    return(hash_counters_iterate(md5_bytea, sketch, INT64_MAX,
+    return(hash_counters_iterate(hash, sketch, INT64_MAX,
                                           &min_counter));
 }
 
 
+/*!
+ * interpret a sketch as emitted by __cmsketch_final, in any of its formats.
+ * Older sketches have no header (or only the start of one), so we fill in
+ * the fixed dimensions they were built with.
+ * \param blob the sketch
+ * \param hdr out: the sketch header
+ * \returns the counters described by hdr
+ */
+char *cmsketch_decode(bytea *blob, cmheader *hdr)
+{
+    char * data = VARDATA(blob);
+    size_t len = VARSIZE(blob) - VARHDRSZ;
+    size_t legacylen = (size_t)RANGES*DEPTH*NUMCOUNTERS*sizeof(uint64);
+    char * counters;
+
+    memset(hdr, 0, sizeof(cmheader));
+    hdr->hashfn = SKETCH_HASH_MD5;
+    hdr->lo = MIN_INT64;
+    hdr->hi = MAX_INT64;
+    hdr->width = NUMCOUNTERS;
+    hdr->depth = DEPTH;
+    hdr->levels = RANGES;
+    hdr->counterbits = 64;
+    if (len == legacylen)
+        return data;
+
+    /* version 1 carries the magic, version, hash function and seed */
+    if (len < offsetof(cmheader, lo))
+        elog(ERROR, "not a countmin sketch");
+    memcpy(hdr, data, offsetof(cmheader, lo));
+    if (hdr->magic != CM_SKETCH_MAGIC)
+        elog(ERROR, "not a countmin sketch");
+    if (hdr->version == 1)
+        counters = data + offsetof(cmheader, lo);
+    else if (hdr->version == CM_SKETCH_VERSION && len >= sizeof(cmheader)) {
+        memcpy(hdr, data, sizeof(cmheader));
+        counters = data + sizeof(cmheader);
+    }
+    else
+        elog(ERROR, "unknown countmin sketch version %d", (int)hdr->version);
+    if (hdr->width < 1 || hdr->width > CM_MAX_WIDTH || hdr->depth < 1
+        || hdr->depth > CM_MAX_DEPTH || hdr->levels < 1 || hdr->levels > RANGES
+        || (hdr->counterbits != 32 && hdr->counterbits != 64)
+        || (size_t)(counters - data) + CM_COUNTERS_SZ(hdr) != len)
+        elog(ERROR, "corrupt countmin sketch");
+    return counters;
+}
+
+/*!
+ * cover [bot, top] with the fewest aligned dyadic ranges of at most
+ * 2^maxlevel values each, in increasing order.  Values are compared as
+ * signed, so we walk them in the order-preserving unsigned encoding where
+ * the sign bit is flipped; flipping it does not change alignment.
+ * \param bot the bottom of the range (inclusive)
+ * \param top the top of the range (inclusive)
+ * \param maxlevel the highest dyadic level of the sketch
+ * \param r out: the ranges
+ */
+void cmsketch_dyadic_cover(int64 bot, int64 top, uint32 maxlevel, rangelist *r)
+{
+    const uint64 signbit = UINT64CONST(1) << (RANGES - 1);
+    uint64       lo = (uint64)bot ^ signbit;
+    uint64       hi = (uint64)top ^ signbit;
+
+    r->emptyoffset = 0;
+    for (;;) {
+        uint32 d = 0;
+        uint64 width;
+
+        /* grow the range while it stays aligned and within [lo, hi] */
+        while (d < maxlevel
+               && (lo & ((UINT64CONST(1) << (d + 1)) - 1)) == 0
+               && hi - lo >= (UINT64CONST(1) << (d + 1)) - 1)
+            d++;
+        width = UINT64CONST(1) << d;
+        r->spans[r->emptyoffset][0] = (int64)(lo ^ signbit);
+        r->spans[r->emptyoffset][1] = (int64)((lo + width - 1) ^ signbit);
+        ADVANCE_OFFSET(*r);
+        if (hi - lo == width - 1)
+            break;
+        lo += width;
+    }
+}
+
+/*!
+ * approximate number of values in [bot, top], as the sum of the CountMin
+ * estimates of the ranges covering it.  The counters of all the ranges are
+ * located first; the minimum over the hash functions is then taken in one
+ * loop per counter width.
+ * \param hdr the sketch header
+ * \param counters the counters described by hdr
+ * \param bot the bottom of the range (inclusive)
+ * \param top the top of the range (inclusive)
+ */
+int64 cmsketch_rangecount_c(cmheader *hdr, char *counters, int64 bot, int64 top)
+{
+    rangelist r;
+    size_t    idx[2*RANGES*CM_MAX_DEPTH];
+    uint16    hash[SKETCH_HASHLEN/2];
+    uint32    s, i, depth = hdr->depth;
+    uint64    sum = 0;
+
+    if (bot > top)
+        return 0;
+    /* a range covering every value the sketch accepts is the exact total */
+    if (hdr->version == CM_SKETCH_VERSION && bot <= hdr->lo && top >= hdr->hi)
+        return (int64)hdr->total;
+    if (hdr->levels < RANGES) {
+        /* the sketch holds offsets from lo of values in [lo, hi] */
+        bot = Max(bot, hdr->lo);
+        top = Min(top, hdr->hi);
+        if (bot > top)
+            return 0;
+        bot = (int64)((uint64)bot - (uint64)hdr->lo);
+        top = (int64)((uint64)top - (uint64)hdr->lo);
+    }
+
+    cmsketch_dyadic_cover(bot, top, hdr->levels - 1, &r);
+    for (s = 0; s < r.emptyoffset; s++) {
+        uint64 width = (uint64)r.spans[s][1] - (uint64)r.spans[s][0] + 1;
+        uint32 level = 63 - ui64_leading_zeros(width);
+        int64  key = r.spans[s][0] >> level;
+
+        sketch_hash_bytes(&key, sizeof(int64), hdr->hashfn, hdr->seed,
+                          (uint8 *)hash);
+        for (i = 0; i < depth; i++)
+            idx[s*depth + i] = CM_COUNTER_INDEX(hdr, level, i,
+                                                hash[i] % hdr->width);
+    }
+
+    if (hdr->counterbits == 32) {
+        uint32 *c = (uint32 *)counters;
+
+        for (s = 0; s < r.emptyoffset; s++) {
+            uint32 m = c[idx[s*depth]];
+
+            for (i = 1; i < depth; i++)
+                m = Min(m, c[idx[s*depth + i]]);
+            sum += m;
+        }
+    }
+    else {
+        uint64 *c = (uint64 *)counters;
+
+        for (s = 0; s < r.emptyoffset; s++) {
+            uint64 m = c[idx[s*depth]];
+
+            for (i = 1; i < depth; i++)
+                m = Min(m, c[idx[s*depth + i]]);
+            sum += m;
+        }
+    }
+    return (int64)Min(sum, (uint64)MAX_INT64);
+}
+
+PG_FUNCTION_INFO_V1(__cmsketch_rangecount);
+
+/*!
+ * UDF returning the approximate number of values in [bot, top] in a sketch
+ * as emitted by __cmsketch_final
+ */
+Datum __cmsketch_rangecount(PG_FUNCTION_ARGS)
+{
+    bytea *  blob = PG_GETARG_BYTEA_P(0);
+    cmheader hdr;
+    char *   counters = cmsketch_decode(blob, &hdr);
+
+    PG_RETURN_INT64(cmsketch_rangecount_c(&hdr, counters, PG_GETARG_INT64(1),
+                                          PG_GETARG_INT64(2)));
+}
+
+
 /****** SUPPORT ROUTINES *******/
 PG_FUNCTION_INFO_V1(cmsketch_dump);
 
@@ -294,18 +722,21 @@ PG_FUNCTION_INFO_V1(cmsketch_dump);
  */
 Datum cmsketch_dump(PG_FUNCTION_ARGS)
 {
-    bytea *   transblob = (bytea *)PG_GETARG_BYTEA_P(0);
-    countmin *sketches;
-    char *    newblob = (char *)palloc(10240);
-    uint32    i, j, k, c;
-
-    sketches = ((cmtransval *)VARDATA(transblob))->sketches;
-    for (i=0, c=0; i < RANGES; i++)
-        for (j=0; j < DEPTH; j++)
-            for(k=0; k < NUMCOUNTERS; k++) {
-                if (sketches[i][j][k] != 0)
-                    c += sprintf(&newblob[c], "[(%d,%d,%d):" INT64_FORMAT
-                                 "], ", i, j, k, sketches[i][j][k]);
+    bytea *     transblob = (bytea *)PG_GETARG_BYTEA_P(0);
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    cmheader *  hdr = &transval->hdr;
+    char *      newblob = (char *)palloc(10240);
+    uint32      i, j, k, c;
+    uint64      cnt;
+
+    for (i=0, c=0; i < hdr->levels; i++)
+        for (j=0; j < hdr->depth; j++)
+            for(k=0; k < hdr->width; k++) {
+                cnt = cmsketch_get_counter(hdr, transval->counters,
+                                           CM_COUNTER_INDEX(hdr, i, j, k));
+                if (cnt != 0)
+                    c += sprintf(&newblob[c], "[(%d,%d,%d):" UINT64_FORMAT
+                                 "], ", i, j, k, cnt);
                 if (c > 10000) break;
             }
     newblob[c] = '\0';
@@ -316,12 +747,12 @@ Datum cmsketch_dump(PG_FUNCTION_ARGS)
 /*!
  * for each row of the sketch, use the 16 bits starting at 2^i mod NUMCOUNTERS,
  * and invoke the lambda on those 16 bits (which may destructively modify counters).
- * \param hashval the MD5 hashed value that we take 16 bits at a time
+ * \param hashval the hashed value that we take 16 bits at a time
  * \param sketch the cmsketch
  * \param initial the initialized return value
  * \param lambdaptr the function to invoke on each 16 bits
  */
-int64 hash_counters_iterate(bytea *hashval,
+int64 hash_counters_iterate(const uint8 *hashval,
                             countmin sketch, /* width is DEPTH*NUMCOUNTERS */
                             int64 initial,
                             int64 (*lambdaptr)(uint32,
@@ -330,7 +761,7 @@ int64 hash_counters_iterate(bytea *hashval,
                                                int64))
 {
     uint32         i, col;
-    char          *c;
+    const uint8   *c;
     unsigned short twobytes;
     int64          retval = initial;
 
@@ -340,10 +771,10 @@ int64 hash_counters_iterate(bytea *hashval,
      * XXX but I was hoping memmove would deal with unaligned access in a portable way.
      * XXX However the deref of 2 bytes seems to work OK.
      */
-    for (i = 0, c = (char *)VARDATA(hashval); 
+    for (i = 0, c = hashval; 
          i < DEPTH; 
          i++, c += 2) {
-        twobytes = *(unsigned short *)c;
+        twobytes = *(const unsigned short *)c;
         col = twobytes % NUMCOUNTERS;
         retval = (*lambdaptr)(i, col, sketch, retval);
     }
@@ -19,6 +19,7 @@
 #define MAX_INT64 (INT64CONST(0x7FFFFFFFFFFFFFFF))
 #define MAX_UINT64 (UINT64CONST(0xFFFFFFFFFFFFFFFF))
 #endif /* INT64_IS_BUSTED */
+#define MAX_UINT32 ((uint32)0xFFFFFFFF)
 
 #define MID_INT64 (0)
 #define MIN_INT64 (~MAX_INT64)
@@ -37,12 +38,67 @@ typedef uint64 countmin[DEPTH][NUMCOUNTERS];
 
 #define MAXARGS 3
 
+/*! identifies the header at the start of a CountMin sketch */
+#define CM_SKETCH_MAGIC   0x434d534b
+/*! version of the CountMin sketch layout */
+#define CM_SKETCH_VERSION 2
+
+/*! each hash function consumes 16 bits of the sketch hash */
+#define CM_MAX_DEPTH  (SKETCH_HASHLEN/2)
+#define CM_MAX_WIDTH  65536
+
+/*! defaults for cmsketch(int8): the dimensions of the original fixed layout */
+#define CM_DEFAULT_WIDTH  NUMCOUNTERS
+#define CM_DEFAULT_DEPTH  DEPTH
+
+/*!
+ * \internal
+ * \brief header describing the layout of a CountMin sketch
+ *
+ * The header is kept at the front of the transition value and is also
+ * emitted by __cmsketch_final in front of the counters, so a sketch can be
+ * interpreted without knowing the parameters it was built with.
+ * The counters that follow form an array
+ * [levels][depth][width] of counterbits-bit unsigned integers.
+ *
+ * A sketch with fewer than RANGES levels was declared for values in [lo, hi],
+ * and sketches the offsets (value - lo) rather than the values.
+ *
+ * Sketches built before the header existed are bare 64-bit counter arrays
+ * of RANGES x DEPTH x NUMCOUNTERS, hashed with MD5; readers recognize them by
+ * their size.  Version 1 sketches carry only the first four fields of the
+ * header and have the same fixed dimensions.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;       /*! CM_SKETCH_MAGIC */
+    uint16 version;     /*! CM_SKETCH_VERSION */
+    uint16 hashfn;      /*! the sketch_hashfn used to place values */
+    uint64 seed;        /*! seed of the hash function */
+    int64  lo;          /*! smallest value the sketch accepts */
+    int64  hi;          /*! largest value the sketch accepts */
+    uint64 total;       /*! number of values sketched so far */
+    uint32 width;       /*! counters per hash function */
+    uint16 depth;       /*! number of hash functions */
+    uint8  levels;      /*! number of dyadic levels */
+    uint8  counterbits; /*! 32 or 64 */
+} cmheader;
+
+/*! number of counters described by a cmheader */
+#define CM_NUMCOUNTERS(h) ((size_t)(h)->levels * (h)->depth * (h)->width)
+/*! bytes taken by the counters described by a cmheader */
+#define CM_COUNTERS_SZ(h) (CM_NUMCOUNTERS(h) * ((h)->counterbits/CHAR_BIT))
+/*! index of a counter in the [levels][depth][width] array */
+#define CM_COUNTER_INDEX(h, level, row, col) \
+    (((size_t)(level) * (h)->depth + (row)) * (h)->width + (col))
+
 /*!
  * \internal
  * \brief the transition value struct for CM sketches
  *
- * Holds the sketch counters
- * and a cache of handy metadata that we'll reuse across calls
+ * Holds the sketch header and counters
+ * and a cache of handy metadata that we'll reuse across calls.
+ * The counters follow the struct, sized according to the header.
  * \endinternal
  */
 typedef struct {
@@ -50,10 +106,11 @@ typedef struct {
     int nargs;            /*! number of args being carried for finalizer */
     Oid typOid;     /*! oid of the data type we are sketching */
     Oid outFuncOid; /*! oid of the OutFunc for that data type */
-    countmin sketches[RANGES];
+    cmheader hdr;   /*! layout of the counters */
+    char counters[];
 } cmtransval;
 
-/*! base size of a cmtransval */
+/*! base size of a cmtransval, without counters */
 #define CM_TRANSVAL_SZ (VARHDRSZ + sizeof(cmtransval))
 
 #define CM_TRANSVAL_INITIALIZED(t) (VARSIZE(t) >= CM_TRANSVAL_SZ)
@@ -92,6 +149,8 @@ typedef struct {
  */
 typedef struct {
     unsigned offset;  /*! memory offset to the value */
+    uint32 hash;      /*! hash of the value, for the index */
+    uint32 heappos;   /*! position of this entry in the count heap */
     uint64 cnt;   /*! counter */
 } offsetcnt;
 
@@ -109,6 +168,12 @@ typedef struct {
  * Each mfv entry contains an offset from the top of the structure where
  * we can find a Postgres text object holding the output format of a
  * frequent value.
+ *
+ * Between the mfvs and the values sit two arrays of uint32 mfv indexes:
+ * a binary min-heap of max_mfvs entries ordered by count, whose root is the
+ * entry to evict, and an open-addressing (linear probing) hash index of
+ * MFV_NBUCKETS(max_mfvs) buckets, each holding an mfv index + 1 or 0 when
+ * empty.  Together they make lookup O(1) and replacement O(log max_mfvs).
  * \endinternal
  */
 typedef struct {
@@ -129,8 +194,19 @@ typedef struct {
     offsetcnt mfvs[];
 } mfvtransval;
 
+/*! number of hash index buckets for i mfvs, keeping the load factor under 1/2 */
+#define MFV_NBUCKETS(i) (2*(i) + 1)
+
 /*! base size of an MFV transval */
-#define MFV_TRANSVAL_SZ(i) (VARHDRSZ + sizeof(mfvtransval) + i*sizeof(offsetcnt))
+#define MFV_TRANSVAL_SZ(i) (VARHDRSZ + sizeof(mfvtransval) \
+                            + (i)*sizeof(offsetcnt) \
+                            + (i)*sizeof(uint32) \
+                            + MFV_NBUCKETS(i)*sizeof(uint32))
+
+/*! the count heap of an MFV transval */
+#define MFV_HEAP(tv) ((uint32 *)&((tv)->mfvs[(tv)->max_mfvs]))
+/*! the hash index of an MFV transval */
+#define MFV_BUCKETS(tv) (MFV_HEAP(tv) + (tv)->max_mfvs)
 
 /*! free space remaining for text values */
 #define MFV_TRANSVAL_CAPACITY(transblob) (VARSIZE(transblob) - VARHDRSZ - \
@@ -138,17 +214,23 @@ typedef struct {
                                           next_offset)
                                           
 /* countmin aggregate protos */
-Datum  countmin_trans_c(countmin, Datum, Oid, Oid);
+void   countmin_trans_c(countmin, const uint8 *);
 bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool);
-bytea *cmsketch_init_transval(Oid);
+bytea *cmsketch_init_transval(const sketch_typinfo *, uint32, uint16, int64, int64);
+bytea *cmsketch_reserve(bytea *, uint64);
+bytea *cmsketch_widen(bytea *);
 void   countmin_dyadic_trans_c(cmtransval *, Datum);
+uint64 cmsketch_get_counter(cmheader *, char *, size_t);
 
 /* countmin scalar function protos */
-int64  cmsketch_count_c(countmin, Datum, Oid, Oid);
-int64  cmsketch_count_md5_datum(countmin, bytea *, Oid);
+int64  cmsketch_count_c(countmin, Datum, int16, bool);
+int64  cmsketch_count_hashed(countmin, const uint8 *);
+char  *cmsketch_decode(bytea *, cmheader *);
+void   cmsketch_dyadic_cover(int64, int64, uint32, rangelist *);
+int64  cmsketch_rangecount_c(cmheader *, char *, int64, int64);
 
 /* hash_counters_iterate and its lambdas */
-int64  hash_counters_iterate(bytea *, countmin, int64, int64 (*lambdaptr)(
+int64  hash_counters_iterate(const uint8 *, countmin, int64, int64 (*lambdaptr)(
                                  uint32,
                                  uint32,
                                  countmin,
@@ -160,17 +242,26 @@ int64  min_counter(uint32, uint32, countmin, int64);
 /* MFV protos */
 bytea *mfv_transval_append(bytea *, Datum);
 int    mfv_find(bytea *, Datum);
+int    mfv_find_hashed(bytea *, Datum, uint32);
+bytea *mfv_transval_insert(bytea *, Datum, uint32, uint64);
+void   mfv_update_count(mfvtransval *, uint32, uint64);
+void   offsetcnt_index_insert(offsetcnt *, uint32 *, uint32, uint32);
+void   offsetcnt_index_delete(offsetcnt *, uint32 *, uint32, uint32);
+void   offsetcnt_heap_sift_up(offsetcnt *, uint32 *, uint32);
+void   offsetcnt_heap_sift_down(offsetcnt *, uint32 *, uint32, uint32);
 bytea *mfv_transval_replace(bytea *, Datum, int);
 bytea *mfv_transval_insert_at(bytea *, Datum, uint32);
 void *mfv_transval_getval(bytea *, uint32);
-bytea *mfv_init_transval(int, Oid);
+bytea *mfv_init_transval(int, const sketch_typinfo *);
 bytea *mfvsketch_merge_c(bytea *, bytea *);
 void   mfv_copy_datum(bytea *, int, Datum);
 int cnt_cmp_desc(const void *i, const void *j);
+int mfv_idx_cmp_desc(const void *i, const void *j, void *arg);
 
 
 /* UDF protos */
 Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS);
+Datum __cmsketch_int8_param_trans(PG_FUNCTION_ARGS);
 Datum cmsketch_width_histogram(PG_FUNCTION_ARGS);
 Datum cmsketch_dhistogram(PG_FUNCTION_ARGS);
 Datum __cmsketch_final(PG_FUNCTION_ARGS);
@@ -178,6 +269,7 @@ Datum __cmsketch_merge(PG_FUNCTION_ARGS);
 Datum cmsketch_dump(PG_FUNCTION_ARGS);
 Datum __cmsketch_count_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_rangecount_final(PG_FUNCTION_ARGS);
+Datum __cmsketch_rangecount(PG_FUNCTION_ARGS);
 Datum __cmsketch_centile_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_median_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_dhist_final(PG_FUNCTION_ARGS);
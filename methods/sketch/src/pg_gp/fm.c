@@ -34,6 +34,8 @@
 #include "nodes/execnodes.h"
 #include "fmgr.h"
 #include "sketch_support.h"
+#include "sketch_hash.h"
+#include "sketch_bitset.h"
 #include "sortasort.h"
 #include <ctype.h>
 
@@ -42,7 +44,7 @@ PG_MODULE_MAGIC;
 #endif
 
 #define NMAP 256
-#define FMSKETCH_SZ (VARHDRSZ + NMAP*(MD5_HASHLEN_BITS)/CHAR_BIT)
+#define FMSKETCH_SZ (VARHDRSZ + NMAP*(SKETCH_HASHLEN_BITS)/CHAR_BIT)
 
 /*!
  * For FM, empirically, estimates seem to fall below 1% error around 12k
@@ -84,7 +86,8 @@ Datum __fmsketch_count_distinct_c(bytea *);
 Datum __fmsketch_trans(PG_FUNCTION_ARGS);
 Datum __fmsketch_count_distinct(PG_FUNCTION_ARGS);
 Datum __fmsketch_merge(PG_FUNCTION_ARGS);
-void big_or(bytea *bitmap1, bytea *bitmap2, bytea *out);
+void big_or_c(bytea *bitmap1, bytea *bitmap2, bytea *out);
+Datum big_or(PG_FUNCTION_ARGS);
 bytea *fmsketch_sortasort_insert(bytea *, Datum, size_t);
 bytea *fm_new(fmtransval *);
 
@@ -95,15 +98,9 @@ Datum __fmsketch_trans(PG_FUNCTION_ARGS)
 {
     bytea *     transblob = (bytea *)PG_GETARG_BYTEA_P(0);
     fmtransval *transval;
-    Oid         element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
-    Oid         funcOid;
-    bool        typIsVarlena;
     Datum       retval;
     Datum       inval;
 
-    if (!OidIsValid(element_type))
-        elog(ERROR, "could not determine data type of input");
-
     /*
      * This is Postgres boilerplate for UDFs that modify the data in their own context.
      * Such UDFs can only be correctly called in an agg context since regular scalar
@@ -131,15 +128,16 @@ Datum __fmsketch_trans(PG_FUNCTION_ARGS)
         if (VARSIZE(transblob) <= VARHDRSZ) {
             size_t blobsz = VARHDRSZ + sizeof(fmtransval) +
                             SORTASORT_INITIAL_STORAGE;
+            sketch_typinfo *ti = sketch_get_typinfo(fcinfo, 1);
 
             transblob = (bytea *)palloc0(blobsz);
             SET_VARSIZE(transblob, blobsz);
             transval = (fmtransval *)VARDATA(transblob);
 
-            transval->typOid = element_type;
-            /* figure out the outfunc for this type */
-            getTypeOutputInfo(element_type, &funcOid, &typIsVarlena);
-            get_typlenbyval(element_type, &(transval->typLen), &(transval->typByVal));
+            transval->typOid = ti->typOid;
+            transval->funcOid = ti->outFuncOid;
+            transval->typLen = ti->typLen;
+            transval->typByVal = ti->typByVal;
             transval->status = SMALL;
             sortasort_init((sortasort *)transval->storage,
                            MINVALS,
@@ -241,7 +239,7 @@ bytea *fm_new(fmtransval *template)
 
 /*!
  * Main logic of Flajolet and Martin's sketching algorithm.
- * For each call, we get an md5 hash of the value passed in.
+ * For each call, we get a 128-bit hash of the value passed in.
  * First we use the hash as a random number to choose one of
  * the NMAP bitmaps at random to update.
  * Then we find the position "rmost" of the rightmost 1 bit in the hashed value.
@@ -254,30 +252,24 @@ Datum __fmsketch_trans_c(bytea *transblob, Datum indat)
     fmtransval * transval = (fmtransval *) VARDATA(transblob);
     bytea *      bitmaps = (bytea *)transval->storage;
     uint64       index;
-    uint8 *      c;
+    uint8        c[SKETCH_HASHLEN];
     int          rmost;
     Datum        result;
-    // char        *hex;
-    bytea       *hashed;
 
-    hashed = sketch_md5_bytea(indat, transval->typOid);
-    c = (uint8 *)VARDATA(hashed);
-    // hex = text_to_cstring((bytea *)DatumGetPointer(DirectFunctionCall2(binary_encode, PointerGetDatum(hashed),
-    //                       CStringGetTextDatum("hex"))));
-    // elog(NOTICE, "md5(%s), len %d: %s", text_to_cstring((bytea *)PointerGetDatum(indat)),
-    //      VARSIZE((bytea *)PointerGetDatum(indat)), hex);
+    sketch_hash_datum(indat, transval->typLen, transval->typByVal, c);
 
     /*
      * During the insertion we insert each element
      * in one bitmap only (a la Flajolet pseudocode, page 16).
      * Choose the bitmap by taking the 64 high-order bits worth of hash value mod NMAP
      */
-    index = (*(uint64 *)c) % NMAP;
+    memcpy(&index, c, sizeof(uint64));
+    index %= NMAP;
 
     /*
      * Find index of the rightmost non-0 bit.  Turn on that bit (from left!) in the sketch.
      */
-    rmost = rightmost_one(c, 1, MD5_HASHLEN_BITS, 0);
+    rmost = rightmost_one(c, 1, SKETCH_HASHLEN_BITS, 0);
 
     /*
      * last argument must be the index of the bit position from the right.
@@ -285,8 +277,8 @@ Datum __fmsketch_trans_c(bytea *transblob, Datum indat)
      * so to set the bit at rmost from the left, we subtract from the total number of bits.
      */
     result =
-        array_set_bit_in_place(bitmaps, NMAP, MD5_HASHLEN_BITS, index,
-                               (MD5_HASHLEN_BITS - 1) - rmost);
+        array_set_bit_in_place(bitmaps, NMAP, SKETCH_HASHLEN_BITS, index,
+                               (SKETCH_HASHLEN_BITS - 1) - rmost);
     return PointerGetDatum(transblob);
 }
 
@@ -321,21 +313,18 @@ Datum __fmsketch_count_distinct(PG_FUNCTION_ARGS)
  */
 Datum __fmsketch_count_distinct_c(bytea *bitmaps)
 {
-/*  int R = 0; // Flajolet/Martin's R is handled by leftmost_zero */
+/*  int R = 0; // Flajolet/Martin's R is handled by bitset_leading_ones */
     uint32        S = 0;
     static double phi = 0.77351;     /*
                                       * the magic constant
-                                      * char out[NMAP*MD5_HASHLEN_BITS];
+                                      * char out[NMAP*SKETCH_HASHLEN_BITS];
                                       */
-    int    i;
-    uint32 lz;
-
-    for (i = 0; i < NMAP; i++)
-    {
-        lz = leftmost_zero((uint8 *)VARDATA(
-                               bitmaps), NMAP, MD5_HASHLEN_BITS, i);
-        S = S + lz;
-    }
+
+    if (VARSIZE(bitmaps) - VARHDRSZ < NMAP*SKETCH_HASHLEN_BITS/CHAR_BIT)
+        elog(ERROR, "FM sketch is too small: %u bytes",
+             (uint32)(VARSIZE(bitmaps) - VARHDRSZ));
+    S = (uint32)bitset_sum_leading_ones((uint8 *)VARDATA(bitmaps), NMAP,
+                                        SKETCH_HASHLEN_BITS);
 
     PG_RETURN_INT64(ceil( ((double)NMAP/
                            phi) * pow(2.0, (double)S/(double)NMAP) ));
@@ -378,7 +367,8 @@ Datum __fmsketch_merge(PG_FUNCTION_ARGS)
         fmtransval *newval;
         tblob_big = fm_new(transval1);
         newval = (fmtransval *)VARDATA(tblob_big);
-        big_or(transblob1, transblob2, (bytea *)newval->storage);
+        big_or_c((bytea *)transval1->storage, (bytea *)transval2->storage,
+                 (bytea *)newval->storage);
         PG_RETURN_DATUM(PointerGetDatum(tblob_big));
     }
     else if (transval1->status == SMALL && transval2->status == SMALL) {
@@ -440,25 +430,36 @@ Datum __fmsketch_merge(PG_FUNCTION_ARGS)
     PG_RETURN_DATUM(PointerGetDatum(tblob_big));
 }
 
-/*! OR of two big bitmaps, for gathering sketches computed in parallel. */
-void big_or(bytea *bitmap1, bytea *bitmap2, bytea *out)
+/*!
+ * OR of two big bitmaps, for gathering sketches computed in parallel.
+ * \param bitmap1 the FM bitmaps of one sketch
+ * \param bitmap2 the FM bitmaps of another sketch
+ * \param out preallocated bitmaps of the same size to receive the result
+ */
+void big_or_c(bytea *bitmap1, bytea *bitmap2, bytea *out)
 {
-    uint32  i;
-
-    if (VARSIZE(bitmap1) != VARSIZE(bitmap2))
+    if (VARSIZE(bitmap1) != VARSIZE(bitmap2) || VARSIZE(out) != VARSIZE(bitmap1))
         elog(ERROR,
              "attempting to OR two different-sized bitmaps: %d, %d",
              VARSIZE(bitmap1),
              VARSIZE(bitmap2));
 
-    out = (bytea *)palloc(VARSIZE(bitmap1));
-    SET_VARSIZE(out, VARSIZE(bitmap1));
+    bitset_or((uint8 *)VARDATA(out), (uint8 *)VARDATA(bitmap1),
+              (uint8 *)VARDATA(bitmap2), VARSIZE(bitmap1) - VARHDRSZ);
+}
 
-    /* could probably be more efficient doing this 32 or 64 bits at a time */
-    for (i=0; i < VARSIZE(bitmap1) - VARHDRSZ; i+=8)
-        ((char *)(VARDATA(out)))[i] = ((char *)(VARDATA(bitmap1)))[i] |
-                                      ((char *)(VARDATA(bitmap2)))[i];
+PG_FUNCTION_INFO_V1(big_or);
 
+/*! UDF returning the OR of two equal-sized bitmaps */
+Datum big_or(PG_FUNCTION_ARGS)
+{
+    bytea *bitmap1 = PG_GETARG_BYTEA_P(0);
+    bytea *bitmap2 = PG_GETARG_BYTEA_P(1);
+    bytea *out = (bytea *)palloc(VARSIZE(bitmap1));
+
+    SET_VARSIZE(out, VARSIZE(bitmap1));
+    big_or_c(bitmap1, bitmap2, out);
+    PG_RETURN_BYTEA_P(out);
 }
 
 /*!
@@ -0,0 +1,628 @@
+/*!
+ * \file hll.c
+ *
+ * \brief HyperLogLog sketch implementation
+ */
+/*!
+ * \implementation
+ * A HyperLogLog sketch hashes every value to 64 bits, uses the top p bits
+ * to pick one of m = 2^p registers, and keeps in that register the largest
+ * "rank" (position of the leftmost one in the remaining bits) seen so far.
+ * The distinct count is estimated from the distribution of register values.
+ *
+ * Following HyperLogLog++ [1], a sketch starts out in a <i>sparse</i>
+ * encoding: a list of (index, rank) pairs at a much finer precision
+ * (HLL_SPARSE_PRECISION bits of index), which is both smaller and far more
+ * accurate than m registers for small cardinalities.  New pairs are appended
+ * to an unsorted tail which is sorted and deduplicated every HLL_SPARSE_SLOP
+ * entries, in the spirit of our sortasort.  Once the list would outgrow the
+ * register array, it is folded into the <i>dense</i> encoding of one byte per
+ * register.
+ *
+ * Sparse sketches are estimated by linear counting over the fine-grained
+ * index space.  Dense sketches use the improved raw estimator of Ertl [2],
+ * which corrects the bias of the original HyperLogLog estimator over the
+ * whole cardinality range without HyperLogLog++'s empirical bias tables.
+ *
+ * The transition value is also the serialized sketch: it is a
+ * self-describing bytea that can be stored in a table, merged with other
+ * sketches of the same precision, and estimated later on.
+ *
+ * [1] S. Heule, M. Nunkesser, A. Hall.  HyperLogLog in Practice: Algorithmic
+ *     Engineering of a State of The Art Cardinality Estimation Algorithm,
+ *     EDBT 2013.
+ * [2] O. Ertl.  New Cardinality Estimation Algorithms for HyperLogLog
+ *     Sketches, arXiv:1702.01284, 2017.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include "sketch_hash.h"
+#include <math.h>
+
+/*! format version stored in every sketch */
+#define HLL_VERSION 1
+
+/*! range and default of the number of index bits p (2^p registers) */
+#define HLL_MIN_PRECISION     4
+#define HLL_MAX_PRECISION     18
+#define HLL_DEFAULT_PRECISION 14
+
+/*! number of index bits kept by the sparse encoding */
+#define HLL_SPARSE_PRECISION 25
+/*! bits used for the rank inside a sparse entry */
+#define HLL_SPARSE_RANK_BITS 6
+#define HLL_SPARSE_RANK_MASK ((1U << HLL_SPARSE_RANK_BITS) - 1)
+/*! unsorted sparse entries we tolerate before sorting and deduplicating */
+#define HLL_SPARSE_SLOP      128
+/*! number of sparse entries a new sketch has room for */
+#define HLL_SPARSE_INITIAL   64
+
+typedef enum {HLL_SPARSE, HLL_DENSE} hllencoding;
+
+/*!
+ * \internal
+ * \brief transition value and serialized form of a HyperLogLog sketch
+ *
+ * In the sparse encoding, data holds \c capacity uint32 entries of the form
+ * (index << HLL_SPARSE_RANK_BITS) | rank, of which the first \c nsorted are
+ * sorted and free of duplicate indexes and the rest, up to \c nsparse, are
+ * an unsorted tail.  In the dense encoding, data holds 2^precision uint8
+ * registers and the sparse fields are unused.
+ * \endinternal
+ */
+typedef struct {
+    uint8  version;
+    uint8  precision;
+    uint8  encoding;
+    bool   typByVal;
+    int16  typLen;
+    uint16 pad;
+    uint32 nsorted;
+    uint32 nsparse;
+    uint32 capacity;
+    char   data[];
+} hlltransval;
+
+#define HLL_NUMREGS(t)  ((uint32)1 << (t)->precision)
+#define HLL_ENTRIES(t)  ((uint32 *)(t)->data)
+#define HLL_REGS(t)     ((uint8 *)(t)->data)
+#define HLL_SZ(datasz)  (VARHDRSZ + sizeof(hlltransval) + (datasz))
+/*! a sparse list outgrows the dense registers at this many entries */
+#define HLL_SPARSE_MAX(t) (HLL_NUMREGS(t) / sizeof(uint32))
+#define HLL_INITIALIZED(blob) (VARSIZE(blob) > VARHDRSZ)
+
+Datum __hllsketch_trans(PG_FUNCTION_ARGS);
+Datum __hllsketch_merge(PG_FUNCTION_ARGS);
+Datum __hllsketch_final(PG_FUNCTION_ARGS);
+Datum __hllsketch_dcount_final(PG_FUNCTION_ARGS);
+Datum hllsketch_estimate(PG_FUNCTION_ARGS);
+Datum hllsketch_union(PG_FUNCTION_ARGS);
+Datum hllsketch_intersect_estimate(PG_FUNCTION_ARGS);
+bytea *hll_new(uint8, hllencoding, uint32, int16, bool);
+bytea *hll_add_hash(bytea *, uint64);
+bytea *hll_sparse_append(bytea *, uint32);
+void hll_sparse_compact(hlltransval *);
+bytea *hll_densify(bytea *);
+void hll_dense_set_entry(hlltransval *, uint32);
+bytea *hll_union_c(bytea *, bytea *);
+bytea *hll_copy_compact(bytea *);
+double hll_estimate_c(bytea *);
+void hll_check(bytea *);
+
+/*!
+ * Allocate a new, empty sketch.
+ * \param precision number of index bits
+ * \param encoding HLL_SPARSE or HLL_DENSE
+ * \param capacity room for this many sparse entries (ignored when dense)
+ * \param typLen the Postgres type length of the values sketched
+ * \param typByVal whether the values sketched are passed by value
+ */
+bytea *hll_new(uint8 precision, hllencoding encoding, uint32 capacity,
+               int16 typLen, bool typByVal)
+{
+    size_t       datasz = (encoding == HLL_DENSE)
+                          ? ((size_t)1 << precision)
+                          : capacity*sizeof(uint32);
+    bytea       *blob = (bytea *)palloc0(HLL_SZ(datasz));
+    hlltransval *transval;
+
+    SET_VARSIZE(blob, HLL_SZ(datasz));
+    transval = (hlltransval *)VARDATA(blob);
+    transval->version = HLL_VERSION;
+    transval->precision = precision;
+    transval->encoding = encoding;
+    transval->typLen = typLen;
+    transval->typByVal = typByVal;
+    transval->capacity = (encoding == HLL_DENSE) ? 0 : capacity;
+    return blob;
+}
+
+/*!
+ * Sanity-check a sketch that came from outside this module, e.g. a bytea
+ * stored in a table.
+ * \param blob a serialized sketch
+ */
+void hll_check(bytea *blob)
+{
+    hlltransval *transval;
+    size_t       datasz;
+
+    if (VARSIZE(blob) < HLL_SZ(0))
+        elog(ERROR, "invalid HyperLogLog sketch: too short");
+    transval = (hlltransval *)VARDATA(blob);
+    if (transval->version != HLL_VERSION)
+        elog(ERROR, "unsupported HyperLogLog sketch version %d",
+             (int)transval->version);
+    if (transval->precision < HLL_MIN_PRECISION
+        || transval->precision > HLL_MAX_PRECISION)
+        elog(ERROR, "invalid HyperLogLog sketch: precision %d",
+             (int)transval->precision);
+    datasz = VARSIZE(blob) - HLL_SZ(0);
+    if (transval->encoding == HLL_DENSE) {
+        if (datasz != HLL_NUMREGS(transval))
+            elog(ERROR, "invalid HyperLogLog sketch: wrong size");
+    }
+    else if (transval->encoding == HLL_SPARSE) {
+        if (transval->capacity*sizeof(uint32) != datasz
+            || transval->nsparse > transval->capacity
+            || transval->nsorted > transval->nsparse)
+            elog(ERROR, "invalid HyperLogLog sketch: wrong size");
+    }
+    else
+        elog(ERROR, "invalid HyperLogLog sketch: unknown encoding %d",
+             (int)transval->encoding);
+}
+
+/*!
+ * Update a sketch with one 64-bit hash value.  May return a new blob if
+ * the sparse list had to grow or was converted to dense.
+ * \param blob the sketch
+ * \param hash the hash of the value being added
+ */
+bytea *hll_add_hash(bytea *blob, uint64 hash)
+{
+    hlltransval *transval = (hlltransval *)VARDATA(blob);
+
+    if (transval->encoding == HLL_DENSE) {
+        uint8  p = transval->precision;
+        uint32 idx = (uint32)(hash >> (64 - p));
+        /* the sentinel bit caps the rank at 64 - p + 1 */
+        uint8  rank = (uint8)ui64_leading_zeros((hash << p)
+                                                | ((uint64)1 << (p - 1))) + 1;
+
+        if (HLL_REGS(transval)[idx] < rank)
+            HLL_REGS(transval)[idx] = rank;
+        return blob;
+    }
+    else {
+        uint32 idx = (uint32)(hash >> (64 - HLL_SPARSE_PRECISION));
+        uint8  rank = (uint8)ui64_leading_zeros(
+            (hash << HLL_SPARSE_PRECISION)
+            | ((uint64)1 << (HLL_SPARSE_PRECISION - 1))) + 1;
+
+        return hll_sparse_append(blob, (idx << HLL_SPARSE_RANK_BITS) | rank);
+    }
+}
+
+/*!
+ * Append an entry to a sparse sketch, making room if needed.  If the list
+ * would outgrow the dense registers, the sketch is converted to dense.
+ * \param blob a sparse sketch
+ * \param entry an encoded (index, rank) pair
+ */
+bytea *hll_sparse_append(bytea *blob, uint32 entry)
+{
+    hlltransval *transval = (hlltransval *)VARDATA(blob);
+
+    if (transval->nsparse == transval->capacity)
+        hll_sparse_compact(transval);
+
+    if (transval->nsparse == transval->capacity) {
+        uint32 newcap = Max(transval->capacity*2, HLL_SPARSE_INITIAL);
+
+        if (newcap > HLL_SPARSE_MAX(transval)) {
+            /* the sparse list is no longer a win: go dense and add there */
+            bytea *newblob = hll_densify(blob);
+
+            hll_dense_set_entry((hlltransval *)VARDATA(newblob), entry);
+            return newblob;
+        }
+        else {
+            bytea *newblob = hll_new(transval->precision, HLL_SPARSE, newcap,
+                                     transval->typLen, transval->typByVal);
+            hlltransval *newval = (hlltransval *)VARDATA(newblob);
+
+            memcpy(newval->data, transval->data,
+                   transval->nsparse*sizeof(uint32));
+            newval->nsorted = transval->nsorted;
+            newval->nsparse = transval->nsparse;
+            blob = newblob;
+            transval = newval;
+        }
+    }
+
+    HLL_ENTRIES(transval)[transval->nsparse++] = entry;
+    if (transval->nsparse - transval->nsorted >= HLL_SPARSE_SLOP)
+        hll_sparse_compact(transval);
+    return blob;
+}
+
+/*! comparator for sparse entries */
+static int hll_entry_cmp(const void *a, const void *b)
+{
+    uint32 x = *(const uint32 *)a;
+    uint32 y = *(const uint32 *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*!
+ * Sort a sparse sketch and keep only the largest rank for every index.
+ * Since the rank is stored in the low bits, that is the last entry of each
+ * run of equal indexes.
+ * \param transval a sparse sketch
+ */
+void hll_sparse_compact(hlltransval *transval)
+{
+    uint32 *entries = HLL_ENTRIES(transval);
+    uint32  i, n = 0;
+
+    if (transval->nsorted == transval->nsparse)
+        return;
+
+    qsort(entries, transval->nsparse, sizeof(uint32), hll_entry_cmp);
+    for (i = 0; i < transval->nsparse; i++) {
+        if (i + 1 < transval->nsparse
+            && (entries[i] >> HLL_SPARSE_RANK_BITS)
+               == (entries[i+1] >> HLL_SPARSE_RANK_BITS))
+            continue;
+        entries[n++] = entries[i];
+    }
+    transval->nsorted = transval->nsparse = n;
+}
+
+/*!
+ * Fold one sparse entry into the registers of a dense sketch.  A sparse
+ * index keeps HLL_SPARSE_PRECISION - p more bits of the hash than the
+ * register index; if any of them is one, it determines the rank, otherwise
+ * they add to the sparse rank.
+ * \param transval a dense sketch
+ * \param entry an encoded (index, rank) pair
+ */
+void hll_dense_set_entry(hlltransval *transval, uint32 entry)
+{
+    uint32 extra = HLL_SPARSE_PRECISION - transval->precision;
+    uint32 sidx = entry >> HLL_SPARSE_RANK_BITS;
+    uint32 idx = sidx >> extra;
+    uint32 low = sidx & (((uint32)1 << extra) - 1);
+    uint8  rank;
+
+    if (low)
+        rank = (uint8)(ui64_leading_zeros(low) - (64 - extra) + 1);
+    else
+        rank = (uint8)(extra + (entry & HLL_SPARSE_RANK_MASK));
+    if (HLL_REGS(transval)[idx] < rank)
+        HLL_REGS(transval)[idx] = rank;
+}
+
+/*!
+ * Convert a sparse sketch into a new dense sketch.
+ * \param blob a sparse sketch
+ */
+bytea *hll_densify(bytea *blob)
+{
+    hlltransval *transval = (hlltransval *)VARDATA(blob);
+    bytea       *newblob = hll_new(transval->precision, HLL_DENSE, 0,
+                                   transval->typLen, transval->typByVal);
+    hlltransval *newval = (hlltransval *)VARDATA(newblob);
+    uint32       i;
+
+    for (i = 0; i < transval->nsparse; i++)
+        hll_dense_set_entry(newval, HLL_ENTRIES(transval)[i]);
+    return newblob;
+}
+
+/*!
+ * Return a compacted copy of a sketch, suitable for storing.  Sparse
+ * sketches are sorted, deduplicated and trimmed to their contents.
+ * \param blob a sketch
+ */
+bytea *hll_copy_compact(bytea *blob)
+{
+    hlltransval *transval = (hlltransval *)VARDATA(blob);
+    bytea       *newblob;
+    hlltransval *newval;
+
+    if (transval->encoding == HLL_DENSE) {
+        newblob = (bytea *)palloc(VARSIZE(blob));
+        memcpy(newblob, blob, VARSIZE(blob));
+        return newblob;
+    }
+
+    newblob = hll_new(transval->precision, HLL_SPARSE, transval->nsparse,
+                      transval->typLen, transval->typByVal);
+    newval = (hlltransval *)VARDATA(newblob);
+    memcpy(newval->data, transval->data, transval->nsparse*sizeof(uint32));
+    newval->nsorted = transval->nsorted;
+    newval->nsparse = transval->nsparse;
+    hll_sparse_compact(newval);
+    /* duplicates may have been dropped; the slack stays zeroed but unused */
+    return newblob;
+}
+
+/*! sigma function of Ertl's estimator, for the count of zero registers */
+static double hll_sigma(double x)
+{
+    double y = 1.0, z = x, zold;
+
+    if (x == 1.0)
+        return INFINITY;
+    do {
+        x *= x;
+        zold = z;
+        z += x*y;
+        y += y;
+    } while (z != zold);
+    return z;
+}
+
+/*! tau function of Ertl's estimator, for the count of saturated registers */
+static double hll_tau(double x)
+{
+    double y = 1.0, z, zold;
+
+    if (x == 0.0 || x == 1.0)
+        return 0.0;
+    z = 1.0 - x;
+    do {
+        x = sqrt(x);
+        zold = z;
+        y *= 0.5;
+        z -= (1.0 - x)*(1.0 - x)*y;
+    } while (z != zold);
+    return z/3.0;
+}
+
+/*!
+ * Estimate the number of distinct values in a sketch.
+ * \param blob a sketch
+ */
+double hll_estimate_c(bytea *blob)
+{
+    hlltransval *transval = (hlltransval *)VARDATA(blob);
+
+    if (transval->encoding == HLL_SPARSE) {
+        /* linear counting over the sparse index space */
+        double  mprime = (double)((uint32)1 << HLL_SPARSE_PRECISION);
+        uint32 *entries = HLL_ENTRIES(transval);
+        uint32  ndistinct = transval->nsparse;
+
+        if (transval->nsorted != transval->nsparse) {
+            /* count distinct indexes on a scratch copy, leave the input be */
+            uint32 *tmp = palloc(transval->nsparse*sizeof(uint32));
+            uint32  i;
+
+            memcpy(tmp, entries, transval->nsparse*sizeof(uint32));
+            qsort(tmp, transval->nsparse, sizeof(uint32), hll_entry_cmp);
+            for (i = 1, ndistinct = (transval->nsparse > 0); i < transval->nsparse; i++)
+                if ((tmp[i] >> HLL_SPARSE_RANK_BITS)
+                    != (tmp[i-1] >> HLL_SPARSE_RANK_BITS))
+                    ndistinct++;
+            pfree(tmp);
+        }
+        return mprime*log(mprime/(mprime - ndistinct));
+    }
+    else {
+        uint32 m = HLL_NUMREGS(transval);
+        uint32 q = 64 - transval->precision;
+        uint32 hist[64 + 2];
+        uint8 *regs = HLL_REGS(transval);
+        double z;
+        uint32 i;
+        int    k;
+
+        memset(hist, 0, sizeof(hist));
+        for (i = 0; i < m; i++)
+            hist[Min(regs[i], q + 1)]++;
+
+        z = m*hll_tau(1.0 - (double)hist[q + 1]/m);
+        for (k = q; k >= 1; k--)
+            z = 0.5*(z + hist[k]);
+        z += m*hll_sigma((double)hist[0]/m);
+        return (0.5/log(2.0))*m*(double)m/z;
+    }
+}
+
+/*!
+ * Union of two sketches of the same precision, as a new sketch.
+ * \param blob1 a sketch
+ * \param blob2 a sketch
+ */
+bytea *hll_union_c(bytea *blob1, bytea *blob2)
+{
+    hlltransval *t1 = (hlltransval *)VARDATA(blob1);
+    hlltransval *t2 = (hlltransval *)VARDATA(blob2);
+    bytea       *out;
+    hlltransval *outval;
+    uint32       i;
+
+    if (t1->precision != t2->precision)
+        elog(ERROR, "cannot merge HyperLogLog sketches of precision %d and %d",
+             (int)t1->precision, (int)t2->precision);
+
+    if (t1->encoding == HLL_SPARSE && t2->encoding == HLL_SPARSE
+        && t1->nsparse + t2->nsparse <= HLL_SPARSE_MAX(t1)) {
+        out = hll_new(t1->precision, HLL_SPARSE, t1->nsparse + t2->nsparse,
+                      t1->typLen, t1->typByVal);
+        outval = (hlltransval *)VARDATA(out);
+        memcpy(outval->data, t1->data, t1->nsparse*sizeof(uint32));
+        memcpy(outval->data + t1->nsparse*sizeof(uint32), t2->data,
+               t2->nsparse*sizeof(uint32));
+        outval->nsparse = t1->nsparse + t2->nsparse;
+        hll_sparse_compact(outval);
+        return out;
+    }
+
+    /* at least one side is (or should become) dense */
+    if (t1->encoding == HLL_DENSE)
+        out = hll_copy_compact(blob1);
+    else
+        out = hll_densify(blob1);
+    outval = (hlltransval *)VARDATA(out);
+
+    if (t2->encoding == HLL_SPARSE)
+        blob2 = hll_densify(blob2);
+    t2 = (hlltransval *)VARDATA(blob2);
+    for (i = 0; i < HLL_NUMREGS(outval); i++)
+        if (HLL_REGS(outval)[i] < HLL_REGS(t2)[i])
+            HLL_REGS(outval)[i] = HLL_REGS(t2)[i];
+    return out;
+}
+
+PG_FUNCTION_INFO_V1(__hllsketch_trans);
+
+/*!
+ * UDA transition function for the hllsketch aggregates.  An optional third
+ * argument sets the precision of a new sketch; it is ignored afterwards.
+ */
+Datum __hllsketch_trans(PG_FUNCTION_ARGS)
+{
+    bytea       *transblob = PG_GETARG_BYTEA_P(0);
+    hlltransval *transval;
+    uint64       hash[SKETCH_HASHLEN/sizeof(uint64)];
+
+    /*
+     * This is Postgres boilerplate for UDFs that modify the data in their own context.
+     * Such UDFs can only be correctly called in an agg context since regular scalar
+     * UDFs are essentially stateless across invocations.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(
+            ERROR,
+            "UDF call to a function that only works for aggs (destructive pass by reference)");
+
+    if (!HLL_INITIALIZED(transblob)) {
+        sketch_typinfo *ti = sketch_get_typinfo(fcinfo, 1);
+        int32           precision = HLL_DEFAULT_PRECISION;
+
+        if (PG_NARGS() > 2) {
+            precision = PG_GETARG_INT32(2);
+            if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+                elog(ERROR, "HyperLogLog precision must be between %d and %d",
+                     HLL_MIN_PRECISION, HLL_MAX_PRECISION);
+        }
+        transblob = hll_new((uint8)precision, HLL_SPARSE, HLL_SPARSE_INITIAL,
+                            ti->typLen, ti->typByVal);
+    }
+    transval = (hlltransval *)VARDATA(transblob);
+
+    sketch_hash_datum(PG_GETARG_DATUM(1), transval->typLen, transval->typByVal,
+                      (uint8 *)hash);
+    PG_RETURN_BYTEA_P(hll_add_hash(transblob, hash[0]));
+}
+
+PG_FUNCTION_INFO_V1(__hllsketch_merge);
+
+/*!
+ * Greenplum "prefunc" to combine the partial results of two hllsketch
+ * transitions, and transition function of hllsketch_union_agg.
+ */
+Datum __hllsketch_merge(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    /* either argument may still be the empty initial value */
+    if (!HLL_INITIALIZED(blob2))
+        PG_RETURN_BYTEA_P(blob1);
+    hll_check(blob2);
+    if (!HLL_INITIALIZED(blob1))
+        PG_RETURN_BYTEA_P(hll_copy_compact(blob2));
+    hll_check(blob1);
+
+    PG_RETURN_BYTEA_P(hll_union_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(__hllsketch_final);
+
+/*!
+ * UDA final function returning the serialized sketch.  An empty input
+ * yields an empty sketch of the default precision.
+ */
+Datum __hllsketch_final(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    if (!HLL_INITIALIZED(transblob))
+        PG_RETURN_BYTEA_P(hll_new(HLL_DEFAULT_PRECISION, HLL_SPARSE, 0, 0, false));
+    PG_RETURN_BYTEA_P(hll_copy_compact(transblob));
+}
+
+PG_FUNCTION_INFO_V1(__hllsketch_dcount_final);
+
+/*! UDA final function returning the estimated distinct count */
+Datum __hllsketch_dcount_final(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    if (!HLL_INITIALIZED(transblob))
+        PG_RETURN_INT64(0);
+    PG_RETURN_INT64((int64)floor(hll_estimate_c(transblob) + 0.5));
+}
+
+PG_FUNCTION_INFO_V1(hllsketch_estimate);
+
+/*! estimated distinct count of a serialized sketch */
+Datum hllsketch_estimate(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    hll_check(blob);
+    PG_RETURN_INT64((int64)floor(hll_estimate_c(blob) + 0.5));
+}
+
+PG_FUNCTION_INFO_V1(hllsketch_union);
+
+/*! union of two serialized sketches of the same precision */
+Datum hllsketch_union(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    hll_check(blob1);
+    hll_check(blob2);
+    PG_RETURN_BYTEA_P(hll_union_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(hllsketch_intersect_estimate);
+
+/*!
+ * Estimated number of distinct values common to two serialized sketches, by
+ * inclusion-exclusion: |A and B| = |A| + |B| - |A or B|.  The error is that
+ * of the three estimates combined, so it is only meaningful when the
+ * intersection is not much smaller than the union.
+ */
+Datum hllsketch_intersect_estimate(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+    double est;
+
+    hll_check(blob1);
+    hll_check(blob2);
+    est = hll_estimate_c(blob1) + hll_estimate_c(blob2)
+          - hll_estimate_c(hll_union_c(blob1, blob2));
+    PG_RETURN_INT64(est > 0 ? (int64)floor(est + 0.5) : 0);
+}
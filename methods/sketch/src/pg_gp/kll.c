@@ -0,0 +1,689 @@
+/*!
+ * \file kll.c
+ *
+ * \brief KLL quantile sketch implementation
+ */
+/*!
+ * \implementation
+ * The KLL sketch of Karnin, Lang and Liberty keeps a hierarchy of
+ * "compactors".  Level h holds values that each stand for 2^h input values.
+ * When a level overflows its capacity, it is sorted, every other value (from
+ * a random offset) is promoted to the level above, and the rest are dropped.
+ * Capacities shrink geometrically (by 2/3) from the top level down, so the
+ * sketch retains O(k) values overall, and a value's rank among the retained
+ * weighted values is within about 1.65/k of its true normalized rank with
+ * high probability, for any input size.
+ *
+ * The layout follows the DataSketches implementation: all levels share one
+ * float8 array, stored bottom level first and ending at the end of the
+ * array; free space is at the front, so that new values are prepended to
+ * level 0.  levels[h] is the offset of level h, and levels[numlevels] is the
+ * capacity of the array.  Levels above 0 are kept sorted.
+ *
+ * The sketch is its own transition value and serialized form, so it can be
+ * stored and merged later.  The random bits come from a generator whose
+ * state lives in the sketch, which makes results reproducible.
+ *
+ * [1] Z. Karnin, K. Lang, E. Liberty.  Optimal Quantile Approximation in
+ *     Streams, FOCS 2016.  http://arxiv.org/abs/1603.05346
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "nodes/execnodes.h"
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include <math.h>
+
+/*! format version stored in every sketch */
+#define KLL_VERSION 1
+/*! range and default of the accuracy parameter k */
+#define KLL_MIN_K     8
+#define KLL_MAX_K     65535
+#define KLL_DEFAULT_K 200
+/*! no level is ever given less room than this */
+#define KLL_MIN_WIDTH 8
+/*! enough levels for 2^60 * k values */
+#define KLL_MAX_LEVELS 60
+/*! seed of the random bit generator of a new sketch */
+#define KLL_SEED UINT64CONST(0x9e3779b97f4a7c15)
+
+/*!
+ * \internal
+ * \brief transition value and serialized form of a KLL sketch
+ * \endinternal
+ */
+typedef struct {
+    uint8  version;
+    uint8  numlevels;
+    uint16 k;
+    uint32 pad;
+    uint64 n;                              /*! number of values seen */
+    float8 min;                            /*! exact minimum */
+    float8 max;                            /*! exact maximum */
+    uint64 rng;                            /*! random bit generator state */
+    uint32 levels[KLL_MAX_LEVELS + 2];
+    float8 items[];
+} kllsketch;
+
+#define KLL_SZ(cap) (VARHDRSZ + sizeof(kllsketch) + (cap)*sizeof(float8))
+#define KLL_INITIALIZED(blob) (VARSIZE(blob) > VARHDRSZ)
+#define KLL_CAPACITY(s) ((s)->levels[(s)->numlevels])
+#define KLL_RETAINED(s) (KLL_CAPACITY(s) - (s)->levels[0])
+
+/*!
+ * \internal
+ * \brief a retained value and the number of input values it stands for
+ * \endinternal
+ */
+typedef struct {
+    float8 val;
+    uint64 weight;
+} kllweighted;
+
+Datum __kllsketch_trans(PG_FUNCTION_ARGS);
+Datum __kllsketch_merge(PG_FUNCTION_ARGS);
+Datum __kllsketch_final(PG_FUNCTION_ARGS);
+Datum kllsketch_quantile(PG_FUNCTION_ARGS);
+Datum kllsketch_quantiles(PG_FUNCTION_ARGS);
+Datum kllsketch_rank(PG_FUNCTION_ARGS);
+Datum kllsketch_count(PG_FUNCTION_ARGS);
+Datum kllsketch_rank_error(PG_FUNCTION_ARGS);
+bytea *kll_new(uint16);
+bytea *kll_update(bytea *, float8);
+bytea *kll_compress_while_updating(bytea *);
+bytea *kll_merge_c(bytea *, bytea *);
+void kll_check(bytea *);
+kllweighted *kll_sorted_view(kllsketch *, uint32 *);
+float8 kll_quantile_c(kllweighted *, uint32, uint64, float8, float8, float8);
+
+/*!
+ * capacity of level <c>height</c> in a sketch of <c>numlevels</c> levels:
+ * k at the top, shrinking by 2/3 per level down, but at least KLL_MIN_WIDTH
+ */
+static uint32 kll_level_capacity(uint16 k, uint32 numlevels, uint32 height)
+{
+    uint32 depth = numlevels - height - 1;
+    uint32 cap = (uint32)floor(k*pow(2.0/3.0, depth) + 0.5);
+
+    return Max(cap, KLL_MIN_WIDTH);
+}
+
+/*! total capacity of a sketch of <c>numlevels</c> levels */
+static uint32 kll_total_capacity(uint16 k, uint32 numlevels)
+{
+    uint32 h, total = 0;
+
+    for (h = 0; h < numlevels; h++)
+        total += kll_level_capacity(k, numlevels, h);
+    return total;
+}
+
+/*! one random bit, from a xorshift64* generator kept in the sketch */
+static uint32 kll_random_bit(kllsketch *s)
+{
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return (uint32)((s->rng*UINT64CONST(0x2545f4914f6cdd1d)) >> 63);
+}
+
+static int float8_cmp(const void *a, const void *b)
+{
+    float8 x = *(const float8 *)a;
+    float8 y = *(const float8 *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int kllweighted_cmp(const void *a, const void *b)
+{
+    return float8_cmp(&((const kllweighted *)a)->val,
+                      &((const kllweighted *)b)->val);
+}
+
+/*!
+ * keep every other value of buf[start, start+len) from a random offset,
+ * packed into the first half of the range
+ */
+static void kll_halve_down(kllsketch *s, float8 *buf, uint32 start, uint32 len)
+{
+    uint32 half = len/2, i;
+    uint32 j = start + kll_random_bit(s);
+
+    for (i = start; i < start + half; i++, j += 2)
+        buf[i] = buf[j];
+}
+
+/*!
+ * keep every other value of buf[start, start+len) from a random offset,
+ * packed into the second half of the range
+ */
+static void kll_halve_up(kllsketch *s, float8 *buf, uint32 start, uint32 len)
+{
+    uint32 half = len/2, i;
+    int64  j = (int64)start + len - 1 - kll_random_bit(s);
+
+    for (i = start + len; i > start + half; i--, j -= 2)
+        buf[i - 1] = buf[j];
+}
+
+/*!
+ * merge sorted a[0, lena) and b[0, lenb) into c.  c may overlap the tail of
+ * b, as long as it starts at least lena slots before b.
+ */
+static void kll_merge_sorted(const float8 *a, uint32 lena,
+                             const float8 *b, uint32 lenb, float8 *c)
+{
+    uint32 ia = 0, ib = 0;
+
+    while (ia < lena && ib < lenb)
+        *c++ = (a[ia] <= b[ib]) ? a[ia++] : b[ib++];
+    while (ia < lena)
+        *c++ = a[ia++];
+    while (ib < lenb)
+        *c++ = b[ib++];
+}
+
+/*!
+ * Allocate a new, empty sketch.
+ * \param k the accuracy parameter
+ */
+bytea *kll_new(uint16 k)
+{
+    bytea     *blob = (bytea *)palloc0(KLL_SZ(k));
+    kllsketch *s;
+
+    SET_VARSIZE(blob, KLL_SZ(k));
+    s = (kllsketch *)VARDATA(blob);
+    s->version = KLL_VERSION;
+    s->numlevels = 1;
+    s->k = k;
+    s->min = INFINITY;
+    s->max = -INFINITY;
+    s->rng = KLL_SEED;
+    s->levels[0] = s->levels[1] = k;
+    return blob;
+}
+
+/*!
+ * Sanity-check a sketch that came from outside this module.
+ * \param blob a serialized sketch
+ */
+void kll_check(bytea *blob)
+{
+    kllsketch *s;
+    uint32     h;
+
+    if (VARSIZE(blob) < KLL_SZ(0))
+        elog(ERROR, "invalid KLL sketch: too short");
+    s = (kllsketch *)VARDATA(blob);
+    if (s->version != KLL_VERSION)
+        elog(ERROR, "unsupported KLL sketch version %d", (int)s->version);
+    if (s->numlevels < 1 || s->numlevels > KLL_MAX_LEVELS || s->k < KLL_MIN_K)
+        elog(ERROR, "invalid KLL sketch: bad parameters");
+    for (h = 0; h < s->numlevels; h++)
+        if (s->levels[h] > s->levels[h + 1])
+            elog(ERROR, "invalid KLL sketch: bad level boundaries");
+    if (VARSIZE(blob) != KLL_SZ(KLL_CAPACITY(s)))
+        elog(ERROR, "invalid KLL sketch: wrong size");
+}
+
+/*!
+ * Compact the lowest level that is at capacity, to make room for one more
+ * value in level 0.  If that is the top level, a new empty level is added
+ * first, which grows the sketch.
+ * \param blob a full sketch
+ */
+bytea *kll_compress_while_updating(bytea *blob)
+{
+    kllsketch *s = (kllsketch *)VARDATA(blob);
+    uint32     level, rawbeg, rawend, popabove, rawpop, adjbeg, adjpop, half;
+    bool       oddpop;
+
+    for (level = 0; level < (uint32)s->numlevels - 1; level++)
+        if (s->levels[level + 1] - s->levels[level]
+            >= kll_level_capacity(s->k, s->numlevels, level))
+            break;
+
+    if (level == (uint32)s->numlevels - 1) {
+        /* add an empty top level; every level below gains capacity */
+        uint32     delta = kll_level_capacity(s->k, s->numlevels + 1, 0);
+        uint32     cap = KLL_CAPACITY(s);
+        bytea     *newblob;
+        kllsketch *news;
+        uint32     h;
+
+        if (s->numlevels == KLL_MAX_LEVELS)
+            elog(ERROR, "KLL sketch has reached its maximum number of levels");
+        newblob = (bytea *)palloc0(KLL_SZ(cap + delta));
+        SET_VARSIZE(newblob, KLL_SZ(cap + delta));
+        news = (kllsketch *)VARDATA(newblob);
+        memcpy(news, s, sizeof(kllsketch));
+        memcpy(news->items + s->levels[0] + delta, s->items + s->levels[0],
+               KLL_RETAINED(s)*sizeof(float8));
+        for (h = 0; h <= s->numlevels; h++)
+            news->levels[h] += delta;
+        news->numlevels++;
+        news->levels[news->numlevels] = cap + delta;
+        blob = newblob;
+        s = news;
+    }
+
+    rawbeg = s->levels[level];
+    rawend = s->levels[level + 1];
+    popabove = s->levels[level + 2] - rawend;
+    rawpop = rawend - rawbeg;
+    oddpop = rawpop & 1;
+    adjbeg = rawbeg + oddpop;
+    adjpop = rawpop - oddpop;
+    half = adjpop/2;
+
+    if (level == 0)
+        qsort(s->items + adjbeg, adjpop, sizeof(float8), float8_cmp);
+    if (popabove == 0)
+        kll_halve_up(s, s->items, adjbeg, adjpop);
+    else {
+        kll_halve_down(s, s->items, adjbeg, adjpop);
+        kll_merge_sorted(s->items + adjbeg, half, s->items + rawend, popabove,
+                         s->items + adjbeg + half);
+    }
+    s->levels[level + 1] -= half;
+    if (oddpop) {
+        /* the current level keeps its leftover value */
+        s->levels[level] = s->levels[level + 1] - 1;
+        s->items[s->levels[level]] = s->items[rawbeg];
+    }
+    else
+        s->levels[level] = s->levels[level + 1];
+
+    /* slide the levels below up into the space we freed */
+    if (level > 0) {
+        uint32 h;
+
+        memmove(s->items + s->levels[0] + half, s->items + s->levels[0],
+                (rawbeg - s->levels[0])*sizeof(float8));
+        for (h = 0; h < level; h++)
+            s->levels[h] += half;
+    }
+    return blob;
+}
+
+/*!
+ * Add a value to a sketch.  NaNs are ignored.
+ * \param blob the sketch
+ * \param val the value
+ */
+bytea *kll_update(bytea *blob, float8 val)
+{
+    kllsketch *s = (kllsketch *)VARDATA(blob);
+
+    if (isnan(val))
+        return blob;
+    if (s->levels[0] == 0) {
+        blob = kll_compress_while_updating(blob);
+        s = (kllsketch *)VARDATA(blob);
+    }
+    s->items[--s->levels[0]] = val;
+    s->n++;
+    if (val < s->min)
+        s->min = val;
+    if (val > s->max)
+        s->max = val;
+    return blob;
+}
+
+/*!
+ * Merge two sketches with the same k into a new one.  Level 0 of the second
+ * is added value by value; its higher levels are merged level by level with
+ * those of the first, and the result is compacted until it fits.
+ * \param blob1 a sketch
+ * \param blob2 a sketch
+ */
+bytea *kll_merge_c(bytea *blob1, bytea *blob2)
+{
+    kllsketch *s1 = (kllsketch *)VARDATA(blob1);
+    kllsketch *s2 = (kllsketch *)VARDATA(blob2);
+    bytea     *blob;
+    kllsketch *s;
+    uint32     i, h, numlevels, target, count, inlevels[KLL_MAX_LEVELS + 3];
+    uint32     outlevels[KLL_MAX_LEVELS + 3];
+    float8    *inbuf, *outbuf;
+    bool       done = false;
+
+    if (s1->k != s2->k)
+        elog(ERROR, "cannot merge KLL sketches with k = %d and k = %d",
+             (int)s1->k, (int)s2->k);
+
+    blob = (bytea *)palloc(VARSIZE(blob1));
+    memcpy(blob, blob1, VARSIZE(blob1));
+    for (i = s2->levels[0]; i < s2->levels[1]; i++)
+        blob = kll_update(blob, s2->items[i]);
+    s = (kllsketch *)VARDATA(blob);
+    s->n = s1->n + s2->n;
+    s->min = Min(s1->min, s2->min);
+    s->max = Max(s1->max, s2->max);
+    if (s2->numlevels == 1)
+        return blob;
+
+    /* lay out both sketches' levels, merged, in a work buffer */
+    numlevels = Max(s->numlevels, s2->numlevels);
+    inbuf = palloc((KLL_RETAINED(s) + KLL_RETAINED(s2))*sizeof(float8));
+    outbuf = palloc((KLL_RETAINED(s) + KLL_RETAINED(s2))*sizeof(float8));
+    inlevels[0] = 0;
+    memcpy(inbuf, s->items + s->levels[0],
+           (s->levels[1] - s->levels[0])*sizeof(float8));
+    inlevels[1] = s->levels[1] - s->levels[0];
+    for (h = 1; h < numlevels; h++) {
+        uint32 len1 = (h < s->numlevels) ? s->levels[h + 1] - s->levels[h] : 0;
+        uint32 len2 = (h < s2->numlevels) ? s2->levels[h + 1] - s2->levels[h] : 0;
+
+        kll_merge_sorted(s->items + (h < s->numlevels ? s->levels[h] : 0), len1,
+                         s2->items + (h < s2->numlevels ? s2->levels[h] : 0), len2,
+                         inbuf + inlevels[h]);
+        inlevels[h + 1] = inlevels[h] + len1 + len2;
+    }
+
+    /* compact levels bottom up until the items fit the total capacity */
+    count = inlevels[numlevels];
+    target = kll_total_capacity(s->k, numlevels);
+    outlevels[0] = 0;
+    for (h = 0; !done; h++) {
+        uint32 rawbeg, rawend, rawpop;
+
+        if (h == numlevels - 1)
+            inlevels[h + 2] = inlevels[h + 1];
+        rawbeg = inlevels[h];
+        rawend = inlevels[h + 1];
+        rawpop = rawend - rawbeg;
+        if (count < target
+            || rawpop < kll_level_capacity(s->k, numlevels, h)) {
+            /* this level can stay as it is */
+            memcpy(outbuf + outlevels[h], inbuf + rawbeg, rawpop*sizeof(float8));
+            outlevels[h + 1] = outlevels[h] + rawpop;
+        }
+        else {
+            uint32 popabove = inlevels[h + 2] - rawend;
+            bool   oddpop = rawpop & 1;
+            uint32 adjbeg = rawbeg + oddpop;
+            uint32 adjpop = rawpop - oddpop;
+            uint32 half = adjpop/2;
+
+            if (oddpop)
+                outbuf[outlevels[h]] = inbuf[rawbeg];
+            outlevels[h + 1] = outlevels[h] + oddpop;
+            if (h == 0)
+                qsort(inbuf + adjbeg, adjpop, sizeof(float8), float8_cmp);
+            if (popabove == 0)
+                kll_halve_up(s, inbuf, adjbeg, adjpop);
+            else {
+                kll_halve_down(s, inbuf, adjbeg, adjpop);
+                kll_merge_sorted(inbuf + adjbeg, half, inbuf + rawend, popabove,
+                                 inbuf + adjbeg + half);
+            }
+            count -= half;
+            inlevels[h + 1] -= half;
+            if (h == numlevels - 1) {
+                if (numlevels == KLL_MAX_LEVELS)
+                    elog(ERROR, "KLL sketch has reached its maximum number of levels");
+                numlevels++;
+                target += kll_level_capacity(s->k, numlevels, 0);
+            }
+        }
+        if (h == numlevels - 1)
+            done = true;
+    }
+
+    /* and pack the result at the end of a new sketch of the right size */
+    {
+        bytea     *newblob = (bytea *)palloc0(KLL_SZ(target));
+        kllsketch *news = (kllsketch *)VARDATA(newblob);
+        uint32     free = target - count;
+
+        SET_VARSIZE(newblob, KLL_SZ(target));
+        memcpy(news, s, sizeof(kllsketch));
+        news->numlevels = numlevels;
+        for (h = 0; h <= numlevels; h++)
+            news->levels[h] = outlevels[h] + free;
+        memcpy(news->items + free, outbuf, count*sizeof(float8));
+        pfree(inbuf);
+        pfree(outbuf);
+        return newblob;
+    }
+}
+
+/*!
+ * All retained values with their weights, sorted by value.
+ * \param s a sketch
+ * \param num out-value: number of entries returned
+ */
+kllweighted *kll_sorted_view(kllsketch *s, uint32 *num)
+{
+    kllweighted *view = palloc(Max(KLL_RETAINED(s), 1)*sizeof(kllweighted));
+    uint32       h, i, n = 0;
+
+    for (h = 0; h < s->numlevels; h++)
+        for (i = s->levels[h]; i < s->levels[h + 1]; i++) {
+            view[n].val = s->items[i];
+            view[n].weight = (uint64)1 << h;
+            n++;
+        }
+    qsort(view, n, sizeof(kllweighted), kllweighted_cmp);
+    *num = n;
+    return view;
+}
+
+/*!
+ * The smallest retained value whose cumulative weight reaches phi*n.
+ * \param view the sorted view of a sketch
+ * \param num the number of entries of view
+ * \param n the number of values seen
+ * \param min the exact minimum
+ * \param max the exact maximum
+ * \param phi the quantile, between 0 and 1
+ */
+float8 kll_quantile_c(kllweighted *view, uint32 num, uint64 n,
+                      float8 min, float8 max, float8 phi)
+{
+    float8 target = phi*n;
+    uint64 cum = 0;
+    uint32 i;
+
+    if (phi <= 0.0)
+        return min;
+    if (phi >= 1.0)
+        return max;
+    for (i = 0; i < num; i++) {
+        cum += view[i].weight;
+        if ((float8)cum >= target)
+            return view[i].val;
+    }
+    return max;
+}
+
+PG_FUNCTION_INFO_V1(__kllsketch_trans);
+
+/*!
+ * UDA transition function for the kllsketch aggregates.  An optional third
+ * argument sets k for a new sketch; it is ignored afterwards.
+ */
+Datum __kllsketch_trans(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    /*
+     * This is Postgres boilerplate for UDFs that modify the data in their own context.
+     * Such UDFs can only be correctly called in an agg context since regular scalar
+     * UDFs are essentially stateless across invocations.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(
+            ERROR,
+            "UDF call to a function that only works for aggs (destructive pass by reference)");
+
+    if (!KLL_INITIALIZED(transblob)) {
+        int32 k = KLL_DEFAULT_K;
+
+        if (PG_NARGS() > 2) {
+            k = PG_GETARG_INT32(2);
+            if (k < KLL_MIN_K || k > KLL_MAX_K)
+                elog(ERROR, "KLL parameter k must be between %d and %d",
+                     KLL_MIN_K, KLL_MAX_K);
+        }
+        transblob = kll_new((uint16)k);
+    }
+    PG_RETURN_BYTEA_P(kll_update(transblob, PG_GETARG_FLOAT8(1)));
+}
+
+PG_FUNCTION_INFO_V1(__kllsketch_merge);
+
+/*!
+ * Greenplum "prefunc" to combine the partial results of two kllsketch
+ * transitions, and transition function of kllsketch_merge_agg.
+ */
+Datum __kllsketch_merge(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    /* either argument may still be the empty initial value */
+    if (!KLL_INITIALIZED(blob2))
+        PG_RETURN_BYTEA_P(blob1);
+    kll_check(blob2);
+    if (!KLL_INITIALIZED(blob1))
+        PG_RETURN_BYTEA_P(blob2);
+    kll_check(blob1);
+    PG_RETURN_BYTEA_P(kll_merge_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(__kllsketch_final);
+
+/*!
+ * UDA final function returning the serialized sketch.  An empty input
+ * yields an empty sketch with the default k.
+ */
+Datum __kllsketch_final(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    if (!KLL_INITIALIZED(transblob))
+        PG_RETURN_BYTEA_P(kll_new(KLL_DEFAULT_K));
+    PG_RETURN_BYTEA_P(transblob);
+}
+
+PG_FUNCTION_INFO_V1(kllsketch_quantile);
+
+/*! approximate phi-quantile of the values in a sketch, NULL if it is empty */
+Datum kllsketch_quantile(PG_FUNCTION_ARGS)
+{
+    bytea       *blob = PG_GETARG_BYTEA_P(0);
+    float8       phi = PG_GETARG_FLOAT8(1);
+    kllsketch   *s;
+    kllweighted *view;
+    uint32       num;
+
+    kll_check(blob);
+    s = (kllsketch *)VARDATA(blob);
+    if (phi < 0.0 || phi > 1.0 || isnan(phi))
+        elog(ERROR, "quantile must be between 0 and 1, got %g", phi);
+    if (s->n == 0)
+        PG_RETURN_NULL();
+    view = kll_sorted_view(s, &num);
+    PG_RETURN_FLOAT8(kll_quantile_c(view, num, s->n, s->min, s->max, phi));
+}
+
+PG_FUNCTION_INFO_V1(kllsketch_quantiles);
+
+/*!
+ * approximate quantiles of the values in a sketch, one per element of the
+ * argument array, from a single sort of the retained values
+ */
+Datum kllsketch_quantiles(PG_FUNCTION_ARGS)
+{
+    bytea       *blob = PG_GETARG_BYTEA_P(0);
+    ArrayType   *phis = PG_GETARG_ARRAYTYPE_P(1);
+    kllsketch   *s;
+    kllweighted *view;
+    uint32       num;
+    int          nphis, i;
+    float8      *phiv;
+    float8      *result;
+
+    kll_check(blob);
+    s = (kllsketch *)VARDATA(blob);
+    if (ARR_ELEMTYPE(phis) != FLOAT8OID || ARR_NDIM(phis) > 1
+        || ARR_HASNULL(phis))
+        elog(ERROR, "quantiles must be a one-dimensional float8 array without NULLs");
+    if (s->n == 0)
+        PG_RETURN_NULL();
+
+    nphis = ArrayGetNItems(ARR_NDIM(phis), ARR_DIMS(phis));
+    phiv = (float8 *)ARR_DATA_PTR(phis);
+    view = kll_sorted_view(s, &num);
+    result = palloc(Max(nphis, 1)*sizeof(float8));
+    for (i = 0; i < nphis; i++) {
+        if (phiv[i] < 0.0 || phiv[i] > 1.0 || isnan(phiv[i]))
+            elog(ERROR, "quantile must be between 0 and 1, got %g", phiv[i]);
+        result[i] = kll_quantile_c(view, num, s->n, s->min, s->max, phiv[i]);
+    }
+    PG_RETURN_ARRAYTYPE_P(construct_array((Datum *)result, nphis, FLOAT8OID,
+                                          sizeof(float8), true, 'd'));
+}
+
+PG_FUNCTION_INFO_V1(kllsketch_rank);
+
+/*!
+ * approximate normalized rank of a value: the fraction of the values in a
+ * sketch that are less than or equal to it
+ */
+Datum kllsketch_rank(PG_FUNCTION_ARGS)
+{
+    bytea     *blob = PG_GETARG_BYTEA_P(0);
+    float8     val = PG_GETARG_FLOAT8(1);
+    kllsketch *s;
+    uint64     weight = 0;
+    uint32     h, i;
+
+    kll_check(blob);
+    s = (kllsketch *)VARDATA(blob);
+    if (s->n == 0)
+        PG_RETURN_NULL();
+    for (h = 0; h < s->numlevels; h++)
+        for (i = s->levels[h]; i < s->levels[h + 1]; i++)
+            if (s->items[i] <= val)
+                weight += (uint64)1 << h;
+    PG_RETURN_FLOAT8((float8)weight/s->n);
+}
+
+PG_FUNCTION_INFO_V1(kllsketch_count);
+
+/*! number of (non-NULL, non-NaN) values summarized by a sketch */
+Datum kllsketch_count(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    kll_check(blob);
+    PG_RETURN_INT64((int64)((kllsketch *)VARDATA(blob))->n);
+}
+
+PG_FUNCTION_INFO_V1(kllsketch_rank_error);
+
+/*!
+ * normalized rank error that a single quantile or rank query on a sketch
+ * stays within with 99% confidence.  This is the empirical fit published
+ * with the DataSketches implementation, which our layout follows.
+ */
+Datum kllsketch_rank_error(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    kll_check(blob);
+    PG_RETURN_FLOAT8(2.296/pow((float8)((kllsketch *)VARDATA(blob))->k, 0.9723));
+}
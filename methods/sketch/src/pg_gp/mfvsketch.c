@@ -38,6 +38,7 @@
 #include "nodes/execnodes.h"
 #include "fmgr.h"
 #include "sketch_support.h"
+#include "sketch_hash.h"
 #include "catalog/pg_type.h"
 #include "countmin.h"
 #include "funcapi.h"
@@ -58,7 +59,8 @@ Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
     mfvtransval *transval;
     uint64       tmpcnt;
     int          i;
-    Datum        md5_datum;
+    uint8        hash[SKETCH_HASHLEN];
+    uint32       idxhash;
 
     /*
      * This function makes destructive updates to its arguments.
@@ -74,10 +76,8 @@ Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
              "destructive pass by reference outside agg");
 
     /* initialize if this is first call */
-    if (VARSIZE(transblob) <= sizeof(MFV_TRANSVAL_SZ(0))) {
-        Oid typOid = get_fn_expr_argtype(fcinfo->flinfo, 1);
-        transblob = mfv_init_transval(max_mfvs, typOid);
-    }
+    if (VARSIZE(transblob) <= sizeof(MFV_TRANSVAL_SZ(0)))
+        transblob = mfv_init_transval(max_mfvs, sketch_get_typinfo(fcinfo, 1));
 
     /* ignore NULL inputs */
     if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
@@ -85,39 +85,21 @@ Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
 
     transval = (mfvtransval *)VARDATA(transblob);
     /* insert into the countmin sketch */
-    md5_datum = countmin_trans_c(transval->sketch,
-                                newdatum,
-                                transval->outFuncOid,
-                                transval->typOid);
-
-    tmpcnt = cmsketch_count_md5_datum(transval->sketch,
-                                      (bytea *)DatumGetPointer(md5_datum),
-                                      transval->outFuncOid);
-    i = mfv_find(transblob, newdatum);
-
-    if (i > -1) {
-        transval->mfvs[i].cnt = tmpcnt;
-    }
-    else {
+    sketch_hash_datum(newdatum, transval->typLen, transval->typByVal, hash);
+    countmin_trans_c(transval->sketch, hash);
+
+    tmpcnt = cmsketch_count_hashed(transval->sketch, hash);
+
+    /* the first hash bytes double as the key for the mfv index */
+    memcpy(&idxhash, hash, sizeof(uint32));
+    i = mfv_find_hashed(transblob, newdatum, idxhash);
+
+    if (i > -1)
+        mfv_update_count(transval, i, tmpcnt);
+    else
         /* try to insert as either a new or replacement entry */
-        for (i = 0; i < (int)transval->max_mfvs; i++) {
-            if ((i == (int)transval->next_mfv)) {
-                /* room for new */
-                transblob = mfv_transval_append(transblob, newdatum);
-                transval = (mfvtransval *)VARDATA(transblob);
-                transval->mfvs[i].cnt = tmpcnt;
-                break;
-            }
-            else if (transval->mfvs[i].cnt < tmpcnt) {
-                /* arg beats this mfv */
-                transblob = mfv_transval_replace(transblob, newdatum, i);
-                transval = (mfvtransval *)VARDATA(transblob);
-                transval->mfvs[i].cnt = tmpcnt;
-                break;
-            }
-            /* else this is not a frequent value */
-        }
-    }
+        transblob = mfv_transval_insert(transblob, newdatum, idxhash, tmpcnt);
+
     PG_RETURN_DATUM(PointerGetDatum(transblob));
 }
 
@@ -134,37 +116,221 @@ Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
 int mfv_find(bytea *blob, Datum val)
 {
     mfvtransval *transval = (mfvtransval *)VARDATA(blob);
-    unsigned     i;
-    uint32       len;
-    void *       datp;
-    Datum        iDat;
+    uint8        hash[SKETCH_HASHLEN];
+    uint32       idxhash;
+
+    sketch_hash_datum(val, transval->typLen, transval->typByVal, hash);
+    memcpy(&idxhash, hash, sizeof(uint32));
+    return mfv_find_hashed(blob, val, idxhash);
+}
+
+/*!
+ * mfv_find for callers that already hashed <c>val</c>: probe the hash
+ * index, comparing the stored hashes first and the values only on a match.
+ * \param blob a bytea holding an mfv transval
+ * \param val the datum to search for
+ * \param hash the index hash of val
+ */
+int mfv_find_hashed(bytea *blob, Datum val, uint32 hash)
+{
+    mfvtransval *transval = (mfvtransval *)VARDATA(blob);
+    uint32      *buckets = MFV_BUCKETS(transval);
+    uint32       nbuckets = MFV_NBUCKETS(transval->max_mfvs);
+    uint32       b = hash % nbuckets;
+    uint32       len = ExtractDatumLen(val, transval->typLen, transval->typByVal);
     void        *valp = DatumExtractPointer(val, transval->typByVal);
 
-    /* look for existing entry for this value */
-    for (i = 0; i < transval->next_mfv; i++) {
-        /* if they're the same */
+    for (; buckets[b] != 0; b = (b + 1) % nbuckets) {
+        uint32 i = buckets[b] - 1;
+        void  *datp;
+        Datum  iDat;
+
+        if (transval->mfvs[i].hash != hash)
+            continue;
         datp = mfv_transval_getval(blob,i);
         iDat = PointerExtractDatum(datp, transval->typByVal);
+        if (ExtractDatumLen(iDat, transval->typLen, transval->typByVal) == len
+            && !memcmp(datp, valp, len))
+            /* arg is an mfv */
+            return(i);
+    }
+    return(-1);
+}
 
-        if ((len = ExtractDatumLen(iDat, transval->typLen, transval->typByVal))
-            == ExtractDatumLen(val, transval->typLen, transval->typByVal)) {
-            if (!memcmp(datp, valp, len))
-                /* arg is an mfv */
-                return(i);
+/*!
+ * add entry <c>i</c> to an open-addressing hash index, using its stored hash
+ * \param entries the offset/count entries being indexed
+ * \param buckets the index, holding entry index + 1 or 0 when empty
+ * \param nbuckets the number of buckets
+ * \param i index of the entry
+ */
+void offsetcnt_index_insert(offsetcnt *entries, uint32 *buckets,
+                            uint32 nbuckets, uint32 i)
+{
+    uint32 b = entries[i].hash % nbuckets;
+
+    while (buckets[b] != 0)
+        b = (b + 1) % nbuckets;
+    buckets[b] = i + 1;
+}
+
+/*!
+ * remove entry <c>i</c> from an open-addressing hash index.  Rather than
+ * leaving a tombstone, later entries of the same probe run are shifted back
+ * into the hole, so lookups never get slower over time.
+ * \param entries the offset/count entries being indexed
+ * \param buckets the index, holding entry index + 1 or 0 when empty
+ * \param nbuckets the number of buckets
+ * \param i index of the entry
+ */
+void offsetcnt_index_delete(offsetcnt *entries, uint32 *buckets,
+                            uint32 nbuckets, uint32 i)
+{
+    uint32 hole = entries[i].hash % nbuckets;
+    uint32 j, home;
+
+    while (buckets[hole] != i + 1) {
+        if (buckets[hole] == 0)
+            elog(ERROR, "sketch index is missing entry %u", i);
+        hole = (hole + 1) % nbuckets;
+    }
+
+    for (j = (hole + 1) % nbuckets; buckets[j] != 0; j = (j + 1) % nbuckets) {
+        home = entries[buckets[j] - 1].hash % nbuckets;
+        /* the entry at j can fill the hole unless its home lies in (hole, j] */
+        if (hole < j ? (home <= hole || home > j) : (home <= hole && home > j)) {
+            buckets[hole] = buckets[j];
+            hole = j;
         }
     }
-    return(-1);
+    buckets[hole] = 0;
+}
+
+/*!
+ * restore the property of a min-heap of entry indexes upwards from
+ * heap position <c>pos</c>
+ * \param entries the offset/count entries, ordered by cnt
+ * \param heap the heap of entry indexes
+ * \param pos a position in the heap
+ */
+void offsetcnt_heap_sift_up(offsetcnt *entries, uint32 *heap, uint32 pos)
+{
+    uint32 elem = heap[pos];
+    uint64 cnt = entries[elem].cnt;
+
+    while (pos > 0) {
+        uint32 parent = (pos - 1)/2;
+
+        if (entries[heap[parent]].cnt <= cnt)
+            break;
+        heap[pos] = heap[parent];
+        entries[heap[pos]].heappos = pos;
+        pos = parent;
+    }
+    heap[pos] = elem;
+    entries[elem].heappos = pos;
+}
+
+/*!
+ * restore the property of a min-heap of entry indexes downwards from
+ * heap position <c>pos</c>
+ * \param entries the offset/count entries, ordered by cnt
+ * \param heap the heap of entry indexes
+ * \param n the number of entries in the heap
+ * \param pos a position in the heap
+ */
+void offsetcnt_heap_sift_down(offsetcnt *entries, uint32 *heap, uint32 n,
+                              uint32 pos)
+{
+    uint32 elem = heap[pos];
+    uint64 cnt = entries[elem].cnt;
+
+    while (2*pos + 1 < n) {
+        uint32 child = 2*pos + 1;
+
+        if (child + 1 < n
+            && entries[heap[child + 1]].cnt < entries[heap[child]].cnt)
+            child++;
+        if (cnt <= entries[heap[child]].cnt)
+            break;
+        heap[pos] = heap[child];
+        entries[heap[pos]].heappos = pos;
+        pos = child;
+    }
+    heap[pos] = elem;
+    entries[elem].heappos = pos;
+}
+
+/*!
+ * set the count of mfv <c>i</c> and fix up its place in the heap
+ * \param transval an mfv transval
+ * \param i index of the mfv
+ * \param cnt the new count
+ */
+void mfv_update_count(mfvtransval *transval, uint32 i, uint64 cnt)
+{
+    uint64 oldcnt = transval->mfvs[i].cnt;
+
+    transval->mfvs[i].cnt = cnt;
+    if (cnt >= oldcnt)
+        offsetcnt_heap_sift_down(transval->mfvs, MFV_HEAP(transval),
+                                 transval->next_mfv, transval->mfvs[i].heappos);
+    else
+        offsetcnt_heap_sift_up(transval->mfvs, MFV_HEAP(transval),
+                               transval->mfvs[i].heappos);
+}
+
+/*!
+ * offer a value that is not yet an mfv to the sketch: it is appended if
+ * there is room, and otherwise replaces the least frequent mfv if its count
+ * beats that one's.
+ * \param transblob the transition value packed into a bytea
+ * \param dat the value to be inserted
+ * \param hash the index hash of dat
+ * \param cnt the count of dat
+ */
+bytea *mfv_transval_insert(bytea *transblob, Datum dat, uint32 hash, uint64 cnt)
+{
+    mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
+    uint32       i;
+
+    if (transval->next_mfv < transval->max_mfvs) {
+        /* room for new */
+        i = transval->next_mfv;
+        transblob = mfv_transval_append(transblob, dat);
+        transval = (mfvtransval *)VARDATA(transblob);
+        transval->mfvs[i].hash = hash;
+        transval->mfvs[i].cnt = cnt;
+        MFV_HEAP(transval)[i] = i;
+        offsetcnt_heap_sift_up(transval->mfvs, MFV_HEAP(transval), i);
+        offsetcnt_index_insert(transval->mfvs, MFV_BUCKETS(transval),
+                               MFV_NBUCKETS(transval->max_mfvs), i);
+    }
+    else if (transval->max_mfvs > 0
+             && transval->mfvs[MFV_HEAP(transval)[0]].cnt < cnt) {
+        /* arg beats the least frequent mfv, which sits at the heap root */
+        i = MFV_HEAP(transval)[0];
+        offsetcnt_index_delete(transval->mfvs, MFV_BUCKETS(transval),
+                               MFV_NBUCKETS(transval->max_mfvs), i);
+        transblob = mfv_transval_replace(transblob, dat, i);
+        transval = (mfvtransval *)VARDATA(transblob);
+        transval->mfvs[i].hash = hash;
+        offsetcnt_index_insert(transval->mfvs, MFV_BUCKETS(transval),
+                               MFV_NBUCKETS(transval->max_mfvs), i);
+        mfv_update_count(transval, i, cnt);
+    }
+    /* else this is not a frequent value */
+    return(transblob);
 }
 
 /*!
  * Initialize an mfv sketch
  * \param max_mfvs the number of "bins" in the histogram
- * \param typOid the type ID for the column
+ * \param ti the type of the column
  */
-bytea *mfv_init_transval(int max_mfvs, Oid typOid)
+bytea *mfv_init_transval(int max_mfvs, const sketch_typinfo *ti)
 {
     int          initial_size;
-    bool         typIsVarLen;
     bytea *      transblob;
     mfvtransval *transval;
 
@@ -173,8 +339,8 @@ bytea *mfv_init_transval(int max_mfvs, Oid typOid)
      * if typlen is positive (fixed), size chosen accurately.
      * Else we'll do a conservative estimate of 16 bytes, and repalloc as needed.
      */
-    if ((initial_size = get_typlen(typOid)) > 0)
-        initial_size *= max_mfvs*get_typlen(typOid);
+    if ((initial_size = ti->typLen) > 0)
+        initial_size *= max_mfvs*ti->typLen;
     else /* guess */
         initial_size = max_mfvs*16;
 
@@ -185,12 +351,10 @@ bytea *mfv_init_transval(int max_mfvs, Oid typOid)
     transval->max_mfvs = max_mfvs;
     transval->next_mfv = 0;
     transval->next_offset = MFV_TRANSVAL_SZ(max_mfvs)-VARHDRSZ;
-    transval->typOid = typOid;
-    getTypeOutputInfo(transval->typOid,
-                      &(transval->outFuncOid),
-                      &(typIsVarLen));
-    transval->typLen = get_typlen(transval->typOid);
-    transval->typByVal = get_typbyval(transval->typOid);
+    transval->typOid = ti->typOid;
+    transval->outFuncOid = ti->outFuncOid;
+    transval->typLen = ti->typLen;
+    transval->typByVal = ti->typByVal;
     if (!transval->outFuncOid) {
         /* no outFunc for this type! */
         elog(ERROR, "no outFunc for type %d", transval->typOid);
@@ -372,20 +536,26 @@ Datum __mfvsketch_final(PG_FUNCTION_ARGS)
      * (strict) transition function is never called. (MADLIB-254)
      */
     Datum        histo[transval->max_mfvs][2];
+    uint32      *order;
 
     transval = (mfvtransval *)VARDATA(transblob);
 
-    qsort(transval->mfvs, transval->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
+    /* sort mfv indexes, so as not to scramble the heap and hash index */
+    order = palloc(Max(transval->next_mfv, 1)*sizeof(uint32));
+    for (i = 0; i < transval->next_mfv; i++)
+        order[i] = i;
+    qsort_arg(order, transval->next_mfv, sizeof(uint32), mfv_idx_cmp_desc,
+              (void *)transval);
     getTypeOutputInfo(INT8OID,
                       &outFuncOid,
                       &typIsVarlena);
 
     for (i = 0; i < transval->next_mfv; i++) {
-        void *tmpp = mfv_transval_getval(transblob,i);
+        void *tmpp = mfv_transval_getval(transblob, order[i]);
         Datum curval = PointerExtractDatum(tmpp, transval->typByVal);
         char *countbuf =
             OidOutputFunctionCall(outFuncOid,
-                                  Int64GetDatum(transval->mfvs[i].cnt));
+                                  Int64GetDatum(transval->mfvs[order[i]].cnt));
         char *valbuf = OidOutputFunctionCall(transval->outFuncOid, curval);
         
         histo[i][0] = PointerGetDatum(cstring_to_text(valbuf));
@@ -429,7 +599,22 @@ int cnt_cmp_desc(const void *i, const void *j)
     offsetcnt *o = (offsetcnt *)i;
     offsetcnt *p = (offsetcnt *)j;
 
-    return (p->cnt - o->cnt);
+    /* counts are uint64, so their difference does not fit in an int */
+    return (p->cnt > o->cnt) - (p->cnt < o->cnt);
+}
+
+/*!
+ * support function to sort mfv indexes by count
+ * \param i pointer to an mfv index
+ * \param j pointer to an mfv index
+ * \param arg the mfvtransval the indexes refer to
+ */
+int mfv_idx_cmp_desc(const void *i, const void *j, void *arg)
+{
+    mfvtransval *transval = (mfvtransval *)arg;
+
+    return cnt_cmp_desc(&transval->mfvs[*(const uint32 *)i],
+                        &transval->mfvs[*(const uint32 *)j]);
 }
 
 
@@ -446,38 +631,76 @@ Datum __mfvsketch_merge(PG_FUNCTION_ARGS)
     PG_RETURN_DATUM(PointerGetDatum(mfvsketch_merge_c(transblob1, transblob2)));
 }
 
+/*!
+ * \internal
+ * \brief a candidate mfv from one of the sketches being merged
+ * \endinternal
+ */
+typedef struct {
+    bytea *blob;  /*! the sketch holding the value */
+    uint32 i;     /*! index of the value in that sketch */
+    uint64 cnt;   /*! count of the value in the merged sketch */
+} mfvcandidate;
+
+/*! support function to sort merge candidates by count */
+static int candidate_cmp_desc(const void *i, const void *j)
+{
+    const mfvcandidate *o = (const mfvcandidate *)i;
+    const mfvcandidate *p = (const mfvcandidate *)j;
+
+    return (p->cnt > o->cnt) - (p->cnt < o->cnt);
+}
+
+/*!
+ * the type information recorded in an initialized mfv transval
+ * \param transval an mfv transval
+ * \param ti out: the type of the values in transval
+ */
+static void mfv_transval_typinfo(const mfvtransval *transval, sketch_typinfo *ti)
+{
+    ti->typOid = transval->typOid;
+    ti->typLen = transval->typLen;
+    ti->typByVal = transval->typByVal;
+    ti->outFuncOid = transval->outFuncOid;
+}
+
 /*!
  * implementation of the merge of two mfv sketches.  we
  * first merge the embedded countmin sketches to get the
  * sums of the counts, and then use those sums to pick the
- * top values for the resulting histogram.  We overwrite
- * the first argument and return it.
+ * top values for the resulting histogram, which is returned
+ * as a new sketch.  Values present in both inputs are kept once.
  * \param transblob1 an mfv transval stored inside a bytea
  * \param transblob2 another mfv transval in a bytea
  */
 bytea *mfvsketch_merge_c(bytea *transblob1, bytea *transblob2)
 {
-    mfvtransval *transval1 = (mfvtransval *)VARDATA(transblob1);
-    mfvtransval *transval2 = (mfvtransval *)VARDATA(transblob2);
-    void        *newblob;
-    mfvtransval *newval;
-    uint32       i, j, cnt;
+    mfvtransval  *transval1 = (mfvtransval *)VARDATA(transblob1);
+    mfvtransval  *transval2 = (mfvtransval *)VARDATA(transblob2);
+    bytea        *newblob;
+    mfvtransval  *newval;
+    mfvcandidate *cands;
+    sketch_typinfo ti;
+    uint32        i, j, ncands;
 
     /* handle uninitialized args */
     if (VARSIZE(transblob1) <= sizeof(MFV_TRANSVAL_SZ(0))
         && VARSIZE(transblob2) <= sizeof(MFV_TRANSVAL_SZ(0)))
         return(transblob1);
     else if (VARSIZE(transblob1) <= sizeof(MFV_TRANSVAL_SZ(0))) {
-        transblob1 = mfv_init_transval(transval2->max_mfvs, transval2->typOid);
+        mfv_transval_typinfo(transval2, &ti);
+        transblob1 = mfv_init_transval(transval2->max_mfvs, &ti);
         transval1 = (mfvtransval *)VARDATA(transblob1);
     }
     else if (VARSIZE(transblob2) <= sizeof(MFV_TRANSVAL_SZ(0))) {
-        transblob2 = mfv_init_transval(transval1->max_mfvs, transval1->typOid);
+        mfv_transval_typinfo(transval1, &ti);
+        transblob2 = mfv_init_transval(transval1->max_mfvs, &ti);
         transval2 = (mfvtransval *)VARDATA(transblob2);
     }
 
     /* initialize output */
-    newblob   = mfv_init_transval(transval1->max_mfvs, transval1->typOid);
+    mfv_transval_typinfo(transval1, &ti);
+    newblob   = mfv_init_transval(transval1->max_mfvs, &ti);
     newval    = (mfvtransval *)VARDATA(newblob);
 
     /* combine sketches */
@@ -486,59 +709,40 @@ bytea *mfvsketch_merge_c(bytea *transblob1, bytea *transblob2)
             newval->sketch[i][j] = transval1->sketch[i][j] 
                                    + transval2->sketch[i][j];
 
-    /* recompute the counts using the merged sketch */
-    for (i = 0; i < transval1->next_mfv; i++) {
-        void *tmpp = mfv_transval_getval(transblob1,i);
-        Datum dat = PointerExtractDatum(tmpp, transval1->typByVal);
-
-        transval1->mfvs[i].cnt = cmsketch_count_c(newval->sketch,
-                                                  dat,
-                                                  newval->outFuncOid,
-                                                  newval->typOid);
-    }
-    for (i = 0; i < transval2->next_mfv; i++) {
-        void *tmpp = mfv_transval_getval(transblob2,i);
-        Datum dat = PointerExtractDatum(tmpp, transval2->typByVal);
-
-        transval2->mfvs[i].cnt = cmsketch_count_c(newval->sketch,
-                                                  dat,
-                                                  newval->outFuncOid,
-                                                  newval->typOid);
+    /* recompute the counts of all candidates using the merged sketch */
+    cands = palloc(Max(transval1->next_mfv + transval2->next_mfv, 1)
+                   *sizeof(mfvcandidate));
+    ncands = 0;
+    for (i = 0; i < transval1->next_mfv + transval2->next_mfv; i++) {
+        bytea       *blob = (i < transval1->next_mfv) ? transblob1 : transblob2;
+        mfvtransval *tv = (mfvtransval *)VARDATA(blob);
+        uint32       k = (i < transval1->next_mfv) ? i : i - transval1->next_mfv;
+        Datum        dat = PointerExtractDatum(mfv_transval_getval(blob, k),
+                                               tv->typByVal);
+
+        cands[ncands].blob = blob;
+        cands[ncands].i = k;
+        cands[ncands].cnt = cmsketch_count_c(newval->sketch,
+                                             dat,
+                                             newval->typLen,
+                                             newval->typByVal);
+        ncands++;
     }
 
-    /* now take maxes on mfvs in a sort-merge style, copying into transval1  */
-    qsort(transval1->mfvs, transval1->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
-    qsort(transval2->mfvs, transval2->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
-
-    /* choose top k from transval1 and transval2 */
-    for (i = j = cnt = 0;
-         cnt < newval->max_mfvs
-         && (j < transval2->next_mfv || i < transval1->next_mfv);
-         cnt++) {
-        Datum iDatum, jDatum;
-
-	if (i < transval1->next_mfv &&
-            (j == transval2->next_mfv
-             || transval1->mfvs[i].cnt >= transval2->mfvs[j].cnt)) {
-          /* next item comes from transval1 */
-          iDatum = PointerExtractDatum(mfv_transval_getval(transblob1, i),
-                                       transval1->typByVal);
-          newblob = mfv_transval_append(newblob, iDatum);
-          newval = (mfvtransval *)VARDATA(newblob);
-          newval->mfvs[cnt].cnt = transval1->mfvs[i].cnt;
-          i++;
-        }
-        else if (j < transval2->next_mfv &&
-                 (i == transval1->next_mfv 
-                  || transval1->mfvs[i].cnt < transval2->mfvs[j].cnt)) {
-          /* next item comes from transval2 */
-          jDatum = PointerExtractDatum(mfv_transval_getval(transblob2, j),
-                                       transval2->typByVal);
-          newblob = mfv_transval_append(newblob, jDatum);
-          newval = (mfvtransval *)VARDATA(newblob);
-          newval->mfvs[cnt].cnt = transval2->mfvs[j].cnt;
-          j++;
-        }
+    /* choose top k, skipping values already taken from the other side */
+    qsort(cands, ncands, sizeof(mfvcandidate), candidate_cmp_desc);
+    for (i = 0; i < ncands && newval->next_mfv < newval->max_mfvs; i++) {
+        mfvtransval *tv = (mfvtransval *)VARDATA(cands[i].blob);
+        uint32       hash = tv->mfvs[cands[i].i].hash;
+        Datum        dat = PointerExtractDatum(mfv_transval_getval(cands[i].blob,
+                                                                   cands[i].i),
+                                               tv->typByVal);
+
+        if (mfv_find_hashed(newblob, dat, hash) > -1)
+            continue;
+        newblob = mfv_transval_insert(newblob, dat, hash, cands[i].cnt);
+        newval = (mfvtransval *)VARDATA(newblob);
     }
+    pfree(cands);
     return(newblob);
 }
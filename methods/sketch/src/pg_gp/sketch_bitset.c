@@ -0,0 +1,129 @@
+/*!
+ * \file sketch_bitset.c
+ *
+ * \brief Word-parallel routines on the bitmaps held by sketches
+ *
+ * \implementation
+ * Bitmaps are scanned 64 bits at a time.  A scan stops at the first word
+ * that is not all zeros (or all ones) and finds the bit within it with a
+ * single count-trailing/leading-zeros instruction, so a 128-bit FM bitmap
+ * costs at most two word loads.  Bitmaps live inside varlenas and need not
+ * be 8-byte aligned: words are assembled from bytes, which compilers turn
+ * into one (byte-swapping) load.  ORs work on whole words in a loop simple
+ * enough for the compiler to vectorize.
+ */
+
+#include "postgres.h"
+#include "sketch_bitset.h"
+
+/*!
+ * count the zero bits to the right of the rightmost one of a bitmap
+ * \param bits the bitmap
+ * \param nbits its length in bits, a multiple of 32
+ * \returns the number of trailing zeros, nbits if no bit is set
+ */
+uint32 bitset_trailing_zeros(const uint8 *bits, size_t nbits)
+{
+    size_t i = nbits/CHAR_BIT;
+    uint32 c = 0;
+
+    for (; i >= sizeof(uint64); i -= sizeof(uint64), c += 64) {
+        uint64 w = bitset_load64(bits + i - sizeof(uint64));
+
+        if (w)
+            return c + bitset_word_ctz(w);
+    }
+    /* a leftover half word at the left end */
+    if (i >= sizeof(uint32)) {
+        uint32 w = bitset_load32(bits + i - sizeof(uint32));
+
+        if (w)
+            return c + bitset_word_ctz(w);
+        c += 32;
+    }
+    return c;
+}
+
+/*!
+ * count the one bits to the left of the leftmost zero of a bitmap
+ * \param bits the bitmap
+ * \param nbits its length in bits, a multiple of 32
+ * \returns the number of leading ones, nbits if every bit is set
+ */
+uint32 bitset_leading_ones(const uint8 *bits, size_t nbits)
+{
+    size_t nbytes = nbits/CHAR_BIT;
+    size_t i;
+    uint32 c = 0;
+
+    for (i = 0; i + sizeof(uint64) <= nbytes; i += sizeof(uint64), c += 64) {
+        uint64 w = ~bitset_load64(bits + i);
+
+        if (w)
+            return c + bitset_word_clz(w);
+    }
+    /* a leftover half word at the right end */
+    if (i + sizeof(uint32) <= nbytes) {
+        uint32 w = ~bitset_load32(bits + i);
+
+        if (w)
+            return c + bitset_word_clz((uint64)w << 32);
+        c += 32;
+    }
+    return c;
+}
+
+/*!
+ * sum bitset_leading_ones over an array of equal-sized bitmaps
+ * \param bits the bitmaps, back to back
+ * \param numsketches the number of bitmaps
+ * \param sketchsz_bits the size of each bitmap in bits, a multiple of 32
+ */
+uint64 bitset_sum_leading_ones(const uint8 *bits, size_t numsketches,
+                               size_t sketchsz_bits)
+{
+    size_t i;
+    uint64 sum = 0;
+
+    for (i = 0; i < numsketches; i++)
+        sum += bitset_leading_ones(bits + i*sketchsz_bits/CHAR_BIT,
+                                   sketchsz_bits);
+    return sum;
+}
+
+/*!
+ * turn on one bit of a bitmap.  A single bit lives in a single byte, so
+ * this is a byte operation.
+ * \param bits the bitmap
+ * \param nbits its length in bits
+ * \param bitnum the bit to set, counting from the right, zero-indexed
+ */
+void bitset_set_bit(uint8 *bits, size_t nbits, size_t bitnum)
+{
+    bits[nbits/CHAR_BIT - 1 - bitnum/CHAR_BIT] |= (uint8)(1 << (bitnum % CHAR_BIT));
+}
+
+/*!
+ * bitwise OR of two bitmaps
+ * \param out the result, which may be the same as either input
+ * \param bits1 a bitmap
+ * \param bits2 another bitmap
+ * \param nbytes the length of all three in bytes
+ */
+void bitset_or(uint8 *out, const uint8 *bits1, const uint8 *bits2,
+               size_t nbytes)
+{
+    size_t i;
+
+    for (i = 0; i + sizeof(uint64) <= nbytes; i += sizeof(uint64)) {
+        uint64 w1, w2;
+
+        /* memcpy keeps us safe from unaligned access */
+        memcpy(&w1, bits1 + i, sizeof(uint64));
+        memcpy(&w2, bits2 + i, sizeof(uint64));
+        w1 |= w2;
+        memcpy(out + i, &w1, sizeof(uint64));
+    }
+    for (; i < nbytes; i++)
+        out[i] = bits1[i] | bits2[i];
+}
@@ -0,0 +1,70 @@
+/*!
+ * \file sketch_bitset.h
+ *
+ * \brief header file for the word-parallel bitmap routines used by sketches
+ */
+#ifndef SKETCH_BITSET_H
+#define SKETCH_BITSET_H
+
+/*
+ * A sketch bitmap is a run of bytes read as one big-endian number: byte 0
+ * holds the most significant bits, and bit 0 is the low bit of the last
+ * byte.  This is the persisted FM sketch format, so it must not change.
+ * Lengths in bits must be multiples of 32.
+ */
+
+/*! count the trailing zeros of a nonzero 64-bit word */
+static inline uint32 bitset_word_ctz(uint64 w)
+{
+#if defined(__GNUC__)
+    return (uint32)__builtin_ctzll(w);
+#else
+    uint32 c = 0;
+
+    while (!(w & 1)) {
+        w >>= 1;
+        c++;
+    }
+    return c;
+#endif
+}
+
+/*! count the leading zeros of a nonzero 64-bit word */
+static inline uint32 bitset_word_clz(uint64 w)
+{
+#if defined(__GNUC__)
+    return (uint32)__builtin_clzll(w);
+#else
+    uint32 c = 0;
+
+    while (!(w & UINT64CONST(0x8000000000000000))) {
+        w <<= 1;
+        c++;
+    }
+    return c;
+#endif
+}
+
+/*! load 8 bytes as a big-endian word, regardless of alignment */
+static inline uint64 bitset_load64(const uint8 *p)
+{
+    return ((uint64)p[0] << 56) | ((uint64)p[1] << 48)
+           | ((uint64)p[2] << 40) | ((uint64)p[3] << 32)
+           | ((uint64)p[4] << 24) | ((uint64)p[5] << 16)
+           | ((uint64)p[6] << 8) | (uint64)p[7];
+}
+
+/*! load 4 bytes as a big-endian word, regardless of alignment */
+static inline uint32 bitset_load32(const uint8 *p)
+{
+    return ((uint32)p[0] << 24) | ((uint32)p[1] << 16)
+           | ((uint32)p[2] << 8) | (uint32)p[3];
+}
+
+uint32 bitset_trailing_zeros(const uint8 *, size_t);
+uint32 bitset_leading_ones(const uint8 *, size_t);
+uint64 bitset_sum_leading_ones(const uint8 *, size_t, size_t);
+void   bitset_set_bit(uint8 *, size_t, size_t);
+void   bitset_or(uint8 *, const uint8 *, const uint8 *, size_t);
+
+#endif /* SKETCH_BITSET_H */
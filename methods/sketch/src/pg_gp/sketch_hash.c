@@ -0,0 +1,253 @@
+/*!
+ * \file sketch_hash.c
+ *
+ * \brief Hash functions for sketches
+ *
+ * \implementation
+ * All sketches consume SKETCH_HASHLEN bytes of hash output per value:
+ * CountMin takes DEPTH successive 16-bit runs of it as independent hash
+ * functions, and FM uses it to pick a bitmap and a bit position.
+ *
+ * Sketches were originally hashed with MD5, which Postgres only exposes as a
+ * hex string that had to be converted back to bytes in a freshly palloc'ed
+ * bytea for every value.  New sketches use MurmurHash3 (x64, 128-bit), a
+ * seeded non-cryptographic hash that writes straight into a caller-provided
+ * buffer.  MD5 is kept so that sketches written in the old format can still
+ * be interpreted.
+ *
+ * Each backend keeps a small direct-mapped cache of recent hash outputs,
+ * keyed by the hashed bytes, which pays off on low-cardinality columns.  A
+ * hit costs a lookup and a compare of the key, which only beats hashing when
+ * the hash function is MD5 or the key spans more than one MurmurHash3 block;
+ * other keys bypass the cache.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "libpq/md5.h"
+#include "utils/array.h"
+#include "catalog/pg_type.h"
+#include "sketch_support.h"
+#include "sketch_hash.h"
+
+/*! number of cache slots, a power of 2 */
+#define SKETCH_HASH_CACHE_BITS  10
+#define SKETCH_HASH_CACHE_SLOTS (1 << SKETCH_HASH_CACHE_BITS)
+/*! longest key kept in the cache */
+#define SKETCH_HASH_CACHE_KEYLEN 64
+/*! MurmurHash3 consumes 16-byte blocks: shorter keys hash faster than a lookup */
+#define SKETCH_HASH_CACHE_MINLEN 16
+
+/*!
+ * \internal
+ * \brief an entry of the per-backend hash cache
+ * \endinternal
+ */
+typedef struct {
+    uint64 seed;                           /*! seed of the cached hash */
+    uint8  hash[SKETCH_HASHLEN];           /*! the cached hash output */
+    uint8  len;                            /*! key length, 0 if the slot is empty */
+    uint8  hashfn;                         /*! sketch_hashfn of the cached hash */
+    uint8  key[SKETCH_HASH_CACHE_KEYLEN];  /*! the hashed bytes */
+} sketch_hash_cache_entry;
+
+static sketch_hash_cache_entry sketch_hash_cache[SKETCH_HASH_CACHE_SLOTS];
+static uint64 sketch_hash_cache_hits = 0;
+static uint64 sketch_hash_cache_misses = 0;
+
+Datum sketch_hash_cache_stats(PG_FUNCTION_ARGS);
+
+static inline uint64 rotl64(uint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/*! final avalanche step of MurmurHash3 */
+static inline uint64 fmix64(uint64 k)
+{
+    k ^= k >> 33;
+    k *= UINT64CONST(0xff51afd7ed558ccd);
+    k ^= k >> 33;
+    k *= UINT64CONST(0xc4ceb9fe1a85ec53);
+    k ^= k >> 33;
+    return k;
+}
+
+/*!
+ * Austin Appleby's MurmurHash3_x64_128 (public domain), widened to take a
+ * 64-bit seed.  Blocks are read in native byte order, like the original.
+ * \param key the bytes to hash
+ * \param len the number of bytes
+ * \param seed selects a member of the hash family
+ * \param out array of two uint64s to receive the 128-bit result
+ */
+void murmur3_x64_128(const void *key, size_t len, uint64 seed, uint64 *out)
+{
+    const uint8 *data = (const uint8 *)key;
+    size_t       nblocks = len / 16;
+    uint64       h1 = seed;
+    uint64       h2 = seed;
+    const uint64 c1 = UINT64CONST(0x87c37b91114253d5);
+    const uint64 c2 = UINT64CONST(0x4cf5ad432745937f);
+    const uint8 *tail;
+    uint64       k1, k2;
+    size_t       i;
+
+    for (i = 0; i < nblocks; i++) {
+        /* memcpy keeps us safe from unaligned access */
+        memcpy(&k1, data + i*16, sizeof(uint64));
+        memcpy(&k2, data + i*16 + 8, sizeof(uint64));
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    tail = data + nblocks*16;
+    k1 = k2 = 0;
+    switch (len & 15) {
+        case 15: k2 ^= ((uint64)tail[14]) << 48; /* FALLTHROUGH */
+        case 14: k2 ^= ((uint64)tail[13]) << 40; /* FALLTHROUGH */
+        case 13: k2 ^= ((uint64)tail[12]) << 32; /* FALLTHROUGH */
+        case 12: k2 ^= ((uint64)tail[11]) << 24; /* FALLTHROUGH */
+        case 11: k2 ^= ((uint64)tail[10]) << 16; /* FALLTHROUGH */
+        case 10: k2 ^= ((uint64)tail[ 9]) << 8;  /* FALLTHROUGH */
+        case  9: k2 ^= ((uint64)tail[ 8]);
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+            /* FALLTHROUGH */
+        case  8: k1 ^= ((uint64)tail[ 7]) << 56; /* FALLTHROUGH */
+        case  7: k1 ^= ((uint64)tail[ 6]) << 48; /* FALLTHROUGH */
+        case  6: k1 ^= ((uint64)tail[ 5]) << 40; /* FALLTHROUGH */
+        case  5: k1 ^= ((uint64)tail[ 4]) << 32; /* FALLTHROUGH */
+        case  4: k1 ^= ((uint64)tail[ 3]) << 24; /* FALLTHROUGH */
+        case  3: k1 ^= ((uint64)tail[ 2]) << 16; /* FALLTHROUGH */
+        case  2: k1 ^= ((uint64)tail[ 1]) << 8;  /* FALLTHROUGH */
+        case  1: k1 ^= ((uint64)tail[ 0]);
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= (uint64)len;
+    h2 ^= (uint64)len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    out[0] = h1;
+    out[1] = h2;
+}
+
+/*!
+ * Hash a run of bytes into SKETCH_HASHLEN bytes of output, without the cache.
+ * \param bytes the bytes to hash
+ * \param len the number of bytes
+ * \param hashfn which hash function to use
+ * \param seed the seed for seeded hash functions (ignored by MD5)
+ * \param out caller-provided buffer of at least SKETCH_HASHLEN bytes
+ */
+static void sketch_hash_bytes_uncached(const void *bytes, size_t len,
+                                       sketch_hashfn hashfn, uint64 seed,
+                                       uint8 *out)
+{
+    switch (hashfn) {
+        case SKETCH_HASH_MURMUR3: {
+            uint64 h[2];
+
+            murmur3_x64_128(bytes, len, seed, h);
+            memcpy(out, h, SKETCH_HASHLEN);
+            break;
+        }
+        case SKETCH_HASH_MD5: {
+            /* according to postgres' libpq/md5.c, need 33 bytes for the hex string */
+            char hex[MD5_HASHLEN*2+1];
+
+            if (!pg_md5_hash(bytes, len, hex))
+                elog(ERROR, "out of memory computing md5 hash in sketch");
+            hex_to_bytes(hex, out, MD5_HASHLEN*2);
+            break;
+        }
+        default:
+            elog(ERROR, "unknown sketch hash function %d", (int)hashfn);
+    }
+}
+
+/*!
+ * Hash a run of bytes into SKETCH_HASHLEN bytes of output, going through the
+ * per-backend cache when that is cheaper than hashing.
+ * \param bytes the bytes to hash
+ * \param len the number of bytes
+ * \param hashfn which hash function to use
+ * \param seed the seed for seeded hash functions (ignored by MD5)
+ * \param out caller-provided buffer of at least SKETCH_HASHLEN bytes
+ */
+void sketch_hash_bytes(const void *bytes, size_t len, sketch_hashfn hashfn,
+                       uint64 seed, uint8 *out)
+{
+    sketch_hash_cache_entry *e;
+    uint64 head = 0, tail = 0;
+
+    if (len == 0 || len > SKETCH_HASH_CACHE_KEYLEN
+        || (hashfn == SKETCH_HASH_MURMUR3 && len <= SKETCH_HASH_CACHE_MINLEN)) {
+        sketch_hash_bytes_uncached(bytes, len, hashfn, seed, out);
+        return;
+    }
+
+    /* pick a slot from the first and last 8 bytes of the key */
+    memcpy(&head, bytes, Min(len, sizeof(uint64)));
+    if (len > sizeof(uint64))
+        memcpy(&tail, (const uint8 *)bytes + len - sizeof(uint64), sizeof(uint64));
+    e = &sketch_hash_cache[((head ^ rotl64(tail, 29) ^ len)
+                            * UINT64CONST(0x9e3779b97f4a7c15))
+                           >> (64 - SKETCH_HASH_CACHE_BITS)];
+
+    if (e->len == len && e->hashfn == hashfn && e->seed == seed
+        && memcmp(e->key, bytes, len) == 0) {
+        sketch_hash_cache_hits++;
+        memcpy(out, e->hash, SKETCH_HASHLEN);
+        return;
+    }
+    sketch_hash_cache_misses++;
+    sketch_hash_bytes_uncached(bytes, len, hashfn, seed, out);
+    e->len = (uint8)len;
+    e->hashfn = (uint8)hashfn;
+    e->seed = seed;
+    memcpy(e->key, bytes, len);
+    memcpy(e->hash, out, SKETCH_HASHLEN);
+}
+
+/*!
+ * Hash a datum with the default sketch hash function.  No need to
+ * special-case variable-length types, we'll just hash their length header too.
+ * \param dat a Postgres Datum
+ * \param typLen the Postgres type length of dat
+ * \param typByVal whether dat is passed by value
+ * \param out caller-provided buffer of at least SKETCH_HASHLEN bytes
+ */
+void sketch_hash_datum(Datum dat, int16 typLen, bool typByVal, uint8 *out)
+{
+    size_t len = ExtractDatumLen(dat, typLen, typByVal);
+    void  *datp = DatumExtractPointer(dat, typByVal);
+
+    sketch_hash_bytes(datp, len, SKETCH_HASH_DEFAULT, SKETCH_HASH_SEED, out);
+}
+
+PG_FUNCTION_INFO_V1(sketch_hash_cache_stats);
+
+/*!
+ * UDF returning the {hits, misses} of this backend's hash cache, to tell
+ * whether a workload benefits from it
+ */
+Datum sketch_hash_cache_stats(PG_FUNCTION_ARGS)
+{
+    Datum stats[2];
+
+    (void) fcinfo; /* avoid warning about unused parameter */
+    stats[0] = Int64GetDatum((int64)sketch_hash_cache_hits);
+    stats[1] = Int64GetDatum((int64)sketch_hash_cache_misses);
+    PG_RETURN_ARRAYTYPE_P(construct_array(stats, 2, INT8OID, sizeof(int64),
+                                          FLOAT8PASSBYVAL, 'd'));
+}
@@ -0,0 +1,32 @@
+/*!
+ * \file sketch_hash.h
+ *
+ * \brief header file for the hash functions used by the sketches
+ */
+#ifndef SKETCH_HASH_H
+#define SKETCH_HASH_H
+
+/*! number of bytes produced by every sketch hash function */
+#define SKETCH_HASHLEN 16
+#define SKETCH_HASHLEN_BITS (8*SKETCH_HASHLEN)
+
+/*!
+ * \brief the hash functions a sketch can be built with
+ *
+ * The numeric values are persisted in sketch headers, so existing entries
+ * must never be renumbered.
+ */
+typedef enum {
+    SKETCH_HASH_MD5     = 0,  /*! MD5 of the datum bytes (legacy sketches) */
+    SKETCH_HASH_MURMUR3 = 1   /*! 128-bit MurmurHash3, x64 variant */
+} sketch_hashfn;
+
+/*! hash function and seed used for newly built sketches */
+#define SKETCH_HASH_DEFAULT SKETCH_HASH_MURMUR3
+#define SKETCH_HASH_SEED    UINT64CONST(0x5bd1e9955bd1e995)
+
+void sketch_hash_bytes(const void *, size_t, sketch_hashfn, uint64, uint8 *);
+void sketch_hash_datum(Datum, int16, bool, uint8 *);
+void murmur3_x64_128(const void *, size_t, uint64, uint64 *);
+
+#endif /* SKETCH_HASH_H */
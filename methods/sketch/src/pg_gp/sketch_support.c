@@ -39,12 +39,12 @@
 #include "nodes/execnodes.h"
 #include "fmgr.h"
 #include "sketch_support.h"
+#include "sketch_bitset.h"
 #include "utils/builtins.h"
-#include "libpq/md5.h"
 #include "utils/lsyscache.h"
 
 /*!
- * Simple linear function to find the rightmost bit that's set to one
+ * Find the rightmost bit that's set to one
  * (i.e. the # of trailing zeros to the right).
  * \param bits a bitmap containing many fm sketches
  * \param numsketches the number of sketches in the bits variable
@@ -57,10 +57,6 @@ uint32 rightmost_one(uint8 *bits,
                      size_t sketchnum)
 {
     (void) numsketches; /* avoid warning about unused parameter */
-    uint8 *s =
-        &(((uint8 *)(bits))[sketchnum*sketchsz_bits/8]);
-    int    i;
-    uint32 c = 0;       /* output: c will count trailing zero bits, */
 
     if (sketchsz_bits % (sizeof(uint32)*CHAR_BIT))
         elog(
@@ -69,32 +65,12 @@ uint32 rightmost_one(uint8 *bits,
             (uint32)sketchsz_bits,
             (uint32)sizeof(uint32));
 
-    /*
-     * loop through the chunks of bits from right to left, counting zeros.
-     * stop when we hit a 1.
-     * XXX currently we look at CHAR_BIT (8) bits at a time
-     * which would seem to avoid any 32- vs. 64-bit concerns.
-     * might be worth tuning this up to do 32 bits at a time.
-     */
-    for (i = sketchsz_bits/(CHAR_BIT) -1; i >= 0; i--)
-    {
-        uint32 v = (uint32) (s[i]);
-
-        if (!v)         /* all CHAR_BIT of these bits are 0 */
-            c += CHAR_BIT /* * sizeof(uint32) */;
-        else
-        {
-            c += ui_rightmost_one(v);
-            break;             /* we found a 1 in this value of i, so we stop looping here. */
-        }
-    }
-    return c;
+    return bitset_trailing_zeros(&bits[sketchnum*sketchsz_bits/CHAR_BIT],
+                                 sketchsz_bits);
 }
 
 /*!
- * Simple linear function to find the leftmost zero (# leading 1's)
- * Would be nice to unify with the previous -- e.g. a foomost_bar function
- * where foo would be left or right, and bar would be 0 or 1.
+ * Find the leftmost zero (# leading 1's)
  * \param bits a bitmap containing many fm sketches
  * \param numsketches the number of sketches in the bits variable
  * \param the size of each sketch in bits
@@ -105,12 +81,6 @@ uint32 leftmost_zero(uint8 *bits,
                      size_t sketchsz_bits,
                      size_t sketchnum)
 {
-    uint8 *  s = &(((uint8 *)bits)[sketchnum*sketchsz_bits/8]);
-
-    unsigned i;
-    uint32   c = 0;     /* output: c will count trailing zero bits, */
-    uint32   maxbyte = pow(2,8) - 1;
-
     if (sketchsz_bits % (sizeof(uint32)*8))
         elog(
             ERROR,
@@ -122,35 +92,8 @@ uint32 leftmost_zero(uint8 *bits,
         elog(ERROR, "sketch sz declared at %u, but bitmap is only %u",
              (uint32)sketchsz_bits, (uint32)numsketches*8);
 
-
-    /*
-     * loop through the chunks of bits from left to right, counting ones.
-     * stop when we hit a 0.
-     */
-    for (i = 0; i < sketchsz_bits/(CHAR_BIT); i++)
-    {
-        uint32 v = (uint32) s[i];
-
-        if (v == maxbyte)
-            c += CHAR_BIT /* * sizeof(uint32) */;
-        else
-        {
-            /*
-             * reverse and invert v, then do rightmost_one
-             * magic reverse from http://graphics.stanford.edu/~seander/bithacks.html#ReverseByteWith32Bits
-             */
-            uint8 b =
-                ((s[i] * 0x0802LU &
-                  0x22110LU) |
-                 (s[i] * 0x8020LU &
-                  0x88440LU)) * 0x10101LU >> 16;
-            v = (uint32) b ^ 0xff;
-
-            c += ui_rightmost_one(v);
-            break;             /* we found a 1 in this value of i, so we stop looping here. */
-        }
-    }
-    return c;
+    return bitset_leading_ones(&bits[sketchnum*sketchsz_bits/CHAR_BIT],
+                               sketchsz_bits);
 }
 
 
@@ -174,9 +117,6 @@ Datum array_set_bit_in_place(bytea *bitmap,
                              int4 sketchnum,
                              int4 bitnum)
 {
-    char mask;
-    char bytes_per_sketch = sketchsz_bits/CHAR_BIT;
-
     if (sketchnum >= numsketches || sketchnum < 0)
         elog(ERROR,
              "sketch offset exceeds the number of sketches (0-based)");
@@ -191,36 +131,30 @@ Datum array_set_bit_in_place(bytea *bitmap,
             sketchsz_bits,
             (uint32)sizeof(uint32));
 
-    mask = 0x1 << bitnum%8;     /* the bit to be modified within the proper byte (from the right) */
-    ((char *)(VARDATA(bitmap)))[sketchnum*bytes_per_sketch     /* left boundary of the proper sketch */
-                                + ( (bytes_per_sketch - 1)     /* right boundary of the proper sketch */
-                                    - bitnum/CHAR_BIT      /* the byte to be modified (from the right) */
-                                    )
-    ]
-        |= mask;
+    bitset_set_bit((uint8 *)VARDATA(bitmap) + sketchnum*(sketchsz_bits/CHAR_BIT),
+                   sketchsz_bits, bitnum);
 
     PG_RETURN_BYTEA_P(bitmap);
 }
 
 /*!
- * Simple linear function to find the rightmost one (# trailing zeros) in an uint32.
- * Based on
- * http://graphics.stanford.edu/~seander/bithacks.html#ZerosOnRightLinear
- * Look there for fancier ways to do this.
+ * Find the rightmost one (# trailing zeros) in an uint32.
  * \param v an integer
+ * \return the number of trailing zero bits, 32 if v is 0
  */
 uint32 ui_rightmost_one(uint32 v)
 {
-    uint32 c;
-
-    v = (v ^ (v - 1)) >> 1;     /* Set v's trailing 0s to 1s and zero rest */
-
-    for (c = 0; v; c++)
-    {
-        v >>= 1;
-    }
+    return v ? bitset_word_ctz(v) : 32;
+}
 
-    return c;
+/*!
+ * Count the leading zeros (# zeros left of the leftmost one) in a uint64.
+ * \param v an integer
+ * \return the number of leading zero bits, 64 if v is 0
+ */
+uint32 ui64_leading_zeros(uint64 v)
+{
+    return v ? bitset_word_clz(v) : 64;
 }
 
 /*!
@@ -279,49 +213,6 @@ bit_print(uint8 *c, int numbytes)
     elog(NOTICE, "bitmap: %s", p);
 }
 
-/*!
- * Run the datum through an md5 hash.  No need to special-case variable-length types,
- * we'll just hash their length header too.
- * The POSTGRES code for md5 returns a bytea with a textual representation of the
- * md5 result.  We then convert it back into binary.
- * \param dat a Postgres Datum
- * \param typOid Postgres type Oid
- * \returns a bytea containing the hashed bytes
- */
-bytea *sketch_md5_bytea(Datum dat, Oid typOid)
-{
-    // according to postgres' libpq/md5.c, need 33 bytes to hold 
-    // null-terminated md5 string
-    char outbuf[MD5_HASHLEN*2+1];
-    bytea *out = palloc0(MD5_HASHLEN+VARHDRSZ);    
-    bool byval = get_typbyval(typOid);
-    int len = ExtractDatumLen(dat, get_typlen(typOid), byval);
-    void *datp = DatumExtractPointer(dat, byval);
-    /* 
-     * it's very common to be hashing 0 for countmin sketches.  Rather than 
-     * hard-code it here, we cache on first lookup.  In future a bigger cache here
-     * would be nice.
-     */
-    static bool zero_cached = false;
-    static char md5_of_0_mem[MD5_HASHLEN+VARHDRSZ];
-    static bytea *md5_of_0 = (bytea *) &md5_of_0_mem;
-        
-    if (byval && len == sizeof(int64) && *(int64 *)datp == 0 && zero_cached) {
-        return md5_of_0;
-    }
-    else
-        pg_md5_hash(datp, len, outbuf);        
-    
-    hex_to_bytes(outbuf, (uint8 *)VARDATA(out), MD5_HASHLEN*2);
-    SET_VARSIZE(out, MD5_HASHLEN+VARHDRSZ);
-    if (byval && len == sizeof(int64) && *(int64 *)datp == 0 && !zero_cached) {
-        zero_cached = true;
-        memcpy(md5_of_0, out, MD5_HASHLEN+VARHDRSZ);
-    }
-    return out;
-}
-
-
 /*  TEST ROUTINES */
 PG_FUNCTION_INFO_V1(sketch_array_set_bit_in_place);
 Datum sketch_array_set_bit_in_place(PG_FUNCTION_ARGS);
@@ -380,6 +271,43 @@ Datum sketch_array_set_bit_in_place(PG_FUNCTION_ARGS)
                                   bitnum);
 }
 
+/*!
+ * look up the properties of a type in the syscache
+ * \param typOid the type
+ * \param ti out: the properties of typOid
+ */
+void sketch_lookup_typinfo(Oid typOid, sketch_typinfo *ti)
+{
+    bool typIsVarlena;
+
+    if (!OidIsValid(typOid))
+        elog(ERROR, "could not determine data type of input");
+    ti->typOid = typOid;
+    get_typlenbyval(typOid, &(ti->typLen), &(ti->typByVal));
+    getTypeOutputInfo(typOid, &(ti->outFuncOid), &typIsVarlena);
+}
+
+/*!
+ * get the properties of the type of an argument to a UDF.  They are looked
+ * up on the first call and cached in fn_extra, which lives as long as the
+ * call site, so later calls do no catalog access at all.  The type of an
+ * argument cannot change between calls through the same FmgrInfo.
+ * \param fcinfo the UDF's call info
+ * \param argno the argument whose type we want
+ */
+sketch_typinfo *sketch_get_typinfo(FunctionCallInfo fcinfo, int argno)
+{
+    sketch_typinfo *ti = (sketch_typinfo *)fcinfo->flinfo->fn_extra;
+
+    if (ti == NULL) {
+        ti = (sketch_typinfo *)MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+                                                  sizeof(sketch_typinfo));
+        sketch_lookup_typinfo(get_fn_expr_argtype(fcinfo->flinfo, argno), ti);
+        fcinfo->flinfo->fn_extra = ti;
+    }
+    return ti;
+}
+
 /* In some cases with large numbers, log2 seems to round up incorrectly. */
 int4 safe_log2(int64 x)
 {
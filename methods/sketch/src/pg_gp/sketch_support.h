@@ -17,10 +17,10 @@ Datum  array_set_bit_in_place(bytea *, int4, int4, int4, int4);
 uint32 rightmost_one(uint8 *, size_t, size_t, size_t);
 uint32 leftmost_zero(uint8 *, size_t, size_t, size_t);
 uint32 ui_rightmost_one(uint32 v);
+uint32 ui64_leading_zeros(uint64 v);
 void   hex_to_bytes(char *hex, uint8 *bytes, size_t);
 void bit_print(uint8 *c, int numbytes);
 Datum md5_cstring(char *);
-bytea *sketch_md5_bytea(Datum, Oid);
 int4   safe_log2(int64);
 void   int64_big_endianize(uint64 *, uint32, bool);
 
@@ -30,4 +30,20 @@ void   int64_big_endianize(uint64 *, uint32, bool);
 #define DatumExtractPointer(x, byVal)  (byVal ? (void *)&x : DatumGetPointer(x))
 
 size_t ExtractDatumLen(Datum x, int len, bool byVal);
+
+/*!
+ * \brief the properties of a sketched type that the sketches need
+ *
+ * sketch_get_typinfo keeps these in fn_extra, so transition functions look
+ * them up once per call site instead of once per row or group.
+ */
+typedef struct {
+    Oid   typOid;      /*! the type */
+    int16 typLen;      /*! its length: >0 fixed, -1 varlena, -2 cstring */
+    bool  typByVal;    /*! whether it is passed by value */
+    Oid   outFuncOid;  /*! its output function */
+} sketch_typinfo;
+
+void            sketch_lookup_typinfo(Oid, sketch_typinfo *);
+sketch_typinfo *sketch_get_typinfo(FunctionCallInfo, int);
 #endif /* SKETCH_SUPPORT_H */
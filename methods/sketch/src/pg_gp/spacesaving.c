@@ -0,0 +1,526 @@
+/*!
+ * \file spacesaving.c
+ *
+ * \brief Space-Saving sketch for heavy hitters
+ */
+/*!
+ * \implementation
+ * The Space-Saving algorithm of Metwally et al. monitors at most k values,
+ * each with a counter.  A monitored value increments its counter.  An
+ * unmonitored value takes over the counter with the smallest count c, which
+ * it increments, and records c as its maximal overestimation error.
+ *
+ * The estimated count of a monitored value is never below its true count,
+ * and overestimates it by at most its error, which is itself at most N/k for
+ * a stream of N values.  Any value whose true count exceeds N/k is
+ * guaranteed to be monitored.  Unlike the MFV sketch, which keeps a full
+ * CountMin sketch per group in addition to its k values, the state is just
+ * the k counters and values, so it is cheap to run per group over many
+ * groups.
+ *
+ * Counters are kept in the same layout as the MFV sketch: an array of
+ * offset/count entries with a min-heap over the counts, whose root is the
+ * counter to take over, and a hash index over the values, followed by the
+ * values themselves.  The classic "stream summary" list of count buckets
+ * gives O(1) unit increments but needs several links per counter; the heap
+ * costs O(log k) in the worst case, and in practice a unit increment rarely
+ * moves a counter more than a level.
+ *
+ * Sketches are merged following Agarwal et al.: a value missing from one
+ * side is charged that side's minimum count (the most it could have had
+ * there), both as count and as error, and the k largest results are kept.
+ * This preserves the guarantees above for the combined stream.
+ *
+ * [1] A. Metwally, D. Agrawal, A. El Abbadi.  Efficient Computation of
+ *     Frequent and Top-k Elements in Data Streams, ICDT 2005.
+ * [2] P. K. Agarwal, G. Cormode, Z. Huang, J. M. Phillips, Z. Wei, K. Yi.
+ *     Mergeable Summaries, PODS 2012.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include "sketch_hash.h"
+#include "catalog/pg_type.h"
+#include "countmin.h"
+
+/*!
+ * \internal
+ * \brief the transition value struct for Space-Saving sketches
+ *
+ * Followed by items[max_items] offset/count entries, then max_items uint64
+ * errors, a heap of max_items uint32 entry indexes, MFV_NBUCKETS(max_items)
+ * uint32 hash index buckets, and finally the values, reached via the
+ * entry offsets.
+ * \endinternal
+ */
+typedef struct {
+    uint32    max_items;   /*! number of counters */
+    uint32    next_item;   /*! number of counters in use */
+    uint32    next_offset; /*! next memory offset to insert a value into */
+    Oid       typOid;      /*! Oid of the type being counted */
+    Oid       outFuncOid;  /*! Oid of the outfunc for this type */
+    int16     typLen;      /*! length of the data type */
+    bool      typByVal;    /*! whether type is by value or by reference */
+    uint64    total;       /*! number of values seen */
+    offsetcnt items[];
+} sstransval;
+
+/*! base size of a Space-Saving transval, without the values */
+#define SS_TRANSVAL_SZ(k) (VARHDRSZ + sizeof(sstransval) \
+                           + (k)*sizeof(offsetcnt) \
+                           + (k)*sizeof(uint64) \
+                           + (k)*sizeof(uint32) \
+                           + MFV_NBUCKETS(k)*sizeof(uint32))
+#define SS_ERRS(tv)    ((uint64 *)&((tv)->items[(tv)->max_items]))
+#define SS_HEAP(tv)    ((uint32 *)(SS_ERRS(tv) + (tv)->max_items))
+#define SS_BUCKETS(tv) (SS_HEAP(tv) + (tv)->max_items)
+#define SS_GETVAL(tv, i) ((void *)(((char *)(tv)) + (tv)->items[i].offset))
+#define SS_INITIALIZED(blob) (VARSIZE(blob) >= SS_TRANSVAL_SZ(0))
+/*! the most an unmonitored value can have occurred */
+#define SS_MIN_COUNT(tv) ((tv)->next_item < (tv)->max_items ? 0 \
+                          : (tv)->items[SS_HEAP(tv)[0]].cnt)
+
+Datum __sssketch_trans(PG_FUNCTION_ARGS);
+Datum __sssketch_merge(PG_FUNCTION_ARGS);
+Datum __sssketch_final(PG_FUNCTION_ARGS);
+bytea *ss_init_transval(uint32, const sketch_typinfo *);
+int    ss_find(sstransval *, Datum, uint32);
+bytea *ss_store_value(bytea *, uint32, Datum);
+bytea *ss_add(bytea *, Datum, uint32, uint64);
+bytea *sssketch_merge_c(bytea *, bytea *);
+
+/*!
+ * Initialize a Space-Saving sketch
+ * \param max_items the number of counters
+ * \param ti the type of the column
+ */
+bytea *ss_init_transval(uint32 max_items, const sketch_typinfo *ti)
+{
+    size_t      initial_size;
+    bytea      *transblob;
+    sstransval *transval;
+
+    /*
+     * fixed-length values are sized exactly; for variable-length ones we
+     * guess 16 bytes each, and ss_store_value grows the blob as needed
+     */
+    initial_size = max_items*(ti->typLen > 0 ? ti->typLen : 16);
+
+    transblob = (bytea *)palloc0(SS_TRANSVAL_SZ(max_items) + initial_size);
+    SET_VARSIZE(transblob, SS_TRANSVAL_SZ(max_items) + initial_size);
+    transval = (sstransval *)VARDATA(transblob);
+    transval->max_items = max_items;
+    transval->next_offset = SS_TRANSVAL_SZ(max_items) - VARHDRSZ;
+    transval->typOid = ti->typOid;
+    transval->typLen = ti->typLen;
+    transval->typByVal = ti->typByVal;
+    transval->outFuncOid = ti->outFuncOid;
+    if (!transval->outFuncOid)
+        /* no outFunc for this type! */
+        elog(ERROR, "no outFunc for type %d", ti->typOid);
+    return(transblob);
+}
+
+/*!
+ * look up a value among the monitored values of a Space-Saving sketch
+ * \param transval a Space-Saving transval
+ * \param val the datum to search for
+ * \param hash the index hash of val
+ * \returns the index of the counter for val, or -1 if not monitored
+ */
+int ss_find(sstransval *transval, Datum val, uint32 hash)
+{
+    uint32 *buckets = SS_BUCKETS(transval);
+    uint32  nbuckets = MFV_NBUCKETS(transval->max_items);
+    uint32  b = hash % nbuckets;
+    size_t  len = ExtractDatumLen(val, transval->typLen, transval->typByVal);
+    void   *valp = DatumExtractPointer(val, transval->typByVal);
+
+    for (; buckets[b] != 0; b = (b + 1) % nbuckets) {
+        uint32 i = buckets[b] - 1;
+        void  *datp;
+        Datum  iDat;
+
+        if (transval->items[i].hash != hash)
+            continue;
+        datp = SS_GETVAL(transval, i);
+        iDat = PointerExtractDatum(datp, transval->typByVal);
+        if (ExtractDatumLen(iDat, transval->typLen, transval->typByVal) == len
+            && !memcmp(datp, valp, len))
+            return(i);
+    }
+    return(-1);
+}
+
+/*!
+ * make <c>dat</c> the value of counter <c>i</c>, overwriting the previous
+ * value in place if it fits.  Otherwise the value is appended, repacking
+ * the live values into a bigger blob if there is no room left.
+ * \param transblob a Space-Saving transval packed into a bytea
+ * \param i the index of the counter, at most next_item
+ * \param dat the value
+ */
+bytea *ss_store_value(bytea *transblob, uint32 i, Datum dat)
+{
+    sstransval *transval = (sstransval *)VARDATA(transblob);
+    size_t      len = ExtractDatumLen(dat, transval->typLen, transval->typByVal);
+    size_t      base = SS_TRANSVAL_SZ(transval->max_items) - VARHDRSZ;
+
+    if (i < transval->next_item) {
+        Datum  oldDat = PointerExtractDatum(SS_GETVAL(transval, i),
+                                            transval->typByVal);
+        size_t oldLen = ExtractDatumLen(oldDat, transval->typLen,
+                                        transval->typByVal);
+
+        if (len <= oldLen) {
+            memmove(SS_GETVAL(transval, i),
+                    DatumExtractPointer(dat, transval->typByVal), len);
+            return(transblob);
+        }
+    }
+
+    if (VARSIZE(transblob) - VARHDRSZ - transval->next_offset < len) {
+        /* repack the live values, leaving as much room again plus len */
+        size_t      live = 0;
+        uint32      j;
+        bytea      *newblob;
+        sstransval *newval;
+
+        for (j = 0; j < transval->next_item; j++)
+            if (j != i)
+                live += ExtractDatumLen(
+                    PointerExtractDatum(SS_GETVAL(transval, j),
+                                        transval->typByVal),
+                    transval->typLen, transval->typByVal);
+        newblob = (bytea *)palloc0(VARHDRSZ + base + 2*live + 2*len);
+        SET_VARSIZE(newblob, VARHDRSZ + base + 2*live + 2*len);
+        memcpy(VARDATA(newblob), transval, base);
+        newval = (sstransval *)VARDATA(newblob);
+        newval->next_offset = base;
+        for (j = 0; j < transval->next_item; j++) {
+            size_t jlen;
+
+            if (j == i)
+                continue;
+            jlen = ExtractDatumLen(PointerExtractDatum(SS_GETVAL(transval, j),
+                                                       transval->typByVal),
+                                   transval->typLen, transval->typByVal);
+            memcpy(((char *)newval) + newval->next_offset,
+                   SS_GETVAL(transval, j), jlen);
+            newval->items[j].offset = newval->next_offset;
+            newval->next_offset += jlen;
+        }
+        transblob = newblob;
+        transval = newval;
+    }
+
+    transval->items[i].offset = transval->next_offset;
+    memcpy(SS_GETVAL(transval, i),
+           DatumExtractPointer(dat, transval->typByVal), len);
+    transval->next_offset += len;
+    return(transblob);
+}
+
+/*!
+ * count <c>weight</c> occurrences of a value that is not monitored: it
+ * gets a free counter if there is one, and otherwise takes over the counter
+ * with the smallest count, inheriting that count as its error.
+ * \param transblob a Space-Saving transval packed into a bytea
+ * \param dat the value
+ * \param hash the index hash of dat
+ * \param weight the number of occurrences
+ */
+bytea *ss_add(bytea *transblob, Datum dat, uint32 hash, uint64 weight)
+{
+    sstransval *transval = (sstransval *)VARDATA(transblob);
+    uint32      nbuckets = MFV_NBUCKETS(transval->max_items);
+    uint32      i;
+    uint64      base;
+    bool        appended = (transval->next_item < transval->max_items);
+
+    if (transval->max_items == 0)
+        return(transblob);
+
+    if (appended) {
+        i = transval->next_item;
+        base = 0;
+    }
+    else {
+        /* take over the counter with the smallest count, at the heap root */
+        i = SS_HEAP(transval)[0];
+        base = transval->items[i].cnt;
+        offsetcnt_index_delete(transval->items, SS_BUCKETS(transval),
+                               nbuckets, i);
+    }
+    transblob = ss_store_value(transblob, i, dat);
+    transval = (sstransval *)VARDATA(transblob);
+
+    transval->items[i].hash = hash;
+    transval->items[i].cnt = base + weight;
+    SS_ERRS(transval)[i] = base;
+    offsetcnt_index_insert(transval->items, SS_BUCKETS(transval), nbuckets, i);
+    if (appended) {
+        /* the new counter enters the heap at the bottom */
+        SS_HEAP(transval)[i] = i;
+        transval->next_item++;
+        offsetcnt_heap_sift_up(transval->items, SS_HEAP(transval), i);
+    }
+    else
+        offsetcnt_heap_sift_down(transval->items, SS_HEAP(transval),
+                                 transval->next_item, 0);
+    return(transblob);
+}
+
+PG_FUNCTION_INFO_V1(__sssketch_trans);
+
+/*! transition function to maintain a Space-Saving sketch */
+Datum __sssketch_trans(PG_FUNCTION_ARGS)
+{
+    bytea      *transblob = PG_GETARG_BYTEA_P(0);
+    sstransval *transval;
+    Datum       newdatum;
+    uint8       hash[SKETCH_HASHLEN];
+    uint32      idxhash;
+    int         i;
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+   #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+   #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* ignore NULL inputs */
+    if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
+
+    /* initialize if this is first call */
+    if (!SS_INITIALIZED(transblob)) {
+        int32 max_items = PG_GETARG_INT32(2);
+
+        if (max_items <= 0)
+            elog(ERROR, "number of counters must be positive, got %d",
+                 max_items);
+        transblob = ss_init_transval(max_items, sketch_get_typinfo(fcinfo, 1));
+    }
+
+    transval = (sstransval *)VARDATA(transblob);
+    newdatum = PG_GETARG_DATUM(1);
+    sketch_hash_datum(newdatum, transval->typLen, transval->typByVal, hash);
+    memcpy(&idxhash, hash, sizeof(uint32));
+    transval->total++;
+
+    if ((i = ss_find(transval, newdatum, idxhash)) > -1) {
+        transval->items[i].cnt++;
+        offsetcnt_heap_sift_down(transval->items, SS_HEAP(transval),
+                                 transval->next_item,
+                                 transval->items[i].heappos);
+    }
+    else
+        transblob = ss_add(transblob, newdatum, idxhash, 1);
+
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
+/*!
+ * \internal
+ * \brief a candidate counter from one of the sketches being merged
+ * \endinternal
+ */
+typedef struct {
+    sstransval *transval;  /*! the sketch holding the value */
+    uint32      i;         /*! index of the value in that sketch */
+    uint64      cnt;       /*! combined count */
+    uint64      err;       /*! combined error */
+} sscandidate;
+
+/*! support function to sort merge candidates by count */
+static int sscandidate_cmp_desc(const void *i, const void *j)
+{
+    const sscandidate *o = (const sscandidate *)i;
+    const sscandidate *p = (const sscandidate *)j;
+
+    return (p->cnt > o->cnt) - (p->cnt < o->cnt);
+}
+
+/*!
+ * merge two Space-Saving sketches into a new one
+ * \param transblob1 a Space-Saving transval stored inside a bytea
+ * \param transblob2 another Space-Saving transval in a bytea
+ */
+bytea *sssketch_merge_c(bytea *transblob1, bytea *transblob2)
+{
+    sstransval  *tv[2];
+    uint64       mincnt[2];
+    sscandidate *cands;
+    uint32       ncands = 0, i, s;
+    bytea       *newblob;
+    sstransval  *newval;
+    sketch_typinfo ti;
+
+    /* handle uninitialized args */
+    if (!SS_INITIALIZED(transblob2))
+        return(transblob1);
+    if (!SS_INITIALIZED(transblob1))
+        return(transblob2);
+
+    tv[0] = (sstransval *)VARDATA(transblob1);
+    tv[1] = (sstransval *)VARDATA(transblob2);
+    if (tv[0]->max_items != tv[1]->max_items)
+        elog(ERROR, "cannot merge Space-Saving sketches with %u and %u counters",
+             tv[0]->max_items, tv[1]->max_items);
+    mincnt[0] = SS_MIN_COUNT(tv[0]);
+    mincnt[1] = SS_MIN_COUNT(tv[1]);
+
+    /*
+     * every value monitored on either side is a candidate; a value missing
+     * on the other side is charged that side's minimum count
+     */
+    cands = palloc(Max(tv[0]->next_item + tv[1]->next_item, 1)
+                   *sizeof(sscandidate));
+    for (s = 0; s < 2; s++) {
+        sstransval *self = tv[s], *other = tv[1 - s];
+
+        for (i = 0; i < self->next_item; i++) {
+            Datum dat = PointerExtractDatum(SS_GETVAL(self, i), self->typByVal);
+            int   j = ss_find(other, dat, self->items[i].hash);
+
+            if (j > -1 && s == 1)
+                /* already taken care of from the first side */
+                continue;
+            cands[ncands].transval = self;
+            cands[ncands].i = i;
+            cands[ncands].cnt = self->items[i].cnt
+                                + (j > -1 ? other->items[j].cnt : mincnt[1 - s]);
+            cands[ncands].err = SS_ERRS(self)[i]
+                                + (j > -1 ? SS_ERRS(other)[j] : mincnt[1 - s]);
+            ncands++;
+        }
+    }
+    qsort(cands, ncands, sizeof(sscandidate), sscandidate_cmp_desc);
+
+    ti.typOid = tv[0]->typOid;
+    ti.typLen = tv[0]->typLen;
+    ti.typByVal = tv[0]->typByVal;
+    ti.outFuncOid = tv[0]->outFuncOid;
+    newblob = ss_init_transval(tv[0]->max_items, &ti);
+    for (i = 0; i < ncands && i < tv[0]->max_items; i++) {
+        sstransval *from = cands[i].transval;
+        Datum       dat = PointerExtractDatum(SS_GETVAL(from, cands[i].i),
+                                              from->typByVal);
+
+        newblob = ss_add(newblob, dat, from->items[cands[i].i].hash,
+                         cands[i].cnt);
+        newval = (sstransval *)VARDATA(newblob);
+        SS_ERRS(newval)[i] = cands[i].err;
+    }
+    newval = (sstransval *)VARDATA(newblob);
+    newval->total = tv[0]->total + tv[1]->total;
+    pfree(cands);
+    return(newblob);
+}
+
+PG_FUNCTION_INFO_V1(__sssketch_merge);
+
+/*!
+ * Greenplum "prefunc" to combine Space-Saving sketches from multiple
+ * machines.
+ */
+Datum __sssketch_merge(PG_FUNCTION_ARGS)
+{
+    bytea *transblob1 = (bytea *)PG_GETARG_BYTEA_P(0);
+    bytea *transblob2 = (bytea *)PG_GETARG_BYTEA_P(1);
+
+    PG_RETURN_DATUM(PointerGetDatum(sssketch_merge_c(transblob1, transblob2)));
+}
+
+/*! support function to sort counter indexes by count */
+static int ss_idx_cmp_desc(const void *i, const void *j, void *arg)
+{
+    sstransval *transval = (sstransval *)arg;
+
+    return cnt_cmp_desc(&transval->items[*(const uint32 *)i],
+                        &transval->items[*(const uint32 *)j]);
+}
+
+PG_FUNCTION_INFO_V1(__sssketch_final);
+
+/*!
+ * final function of the Space-Saving aggregate: a histogram of the
+ * monitored values in descending order of estimated count.  Each row is
+ * {value, count, error, guaranteed}, where the true count lies in
+ * [count - error, count], and guaranteed is 't' if the value is certain to
+ * be at least as frequent as any value not listed.
+ */
+Datum __sssketch_final(PG_FUNCTION_ARGS)
+{
+    bytea      *transblob = PG_GETARG_BYTEA_P(0);
+    sstransval *transval;
+    ArrayType  *retval;
+    Datum      *histo;
+    uint32     *order;
+    uint32      i;
+    int         dims[2], lbs[2];
+    Oid         int8OutOid;
+    bool        typIsVarlena;
+    uint64      mincnt;
+
+    if (!SS_INITIALIZED(transblob))
+        PG_RETURN_NULL();
+    transval = (sstransval *)VARDATA(transblob);
+    if (transval->next_item == 0)
+        PG_RETURN_NULL();
+
+    /* sort counter indexes, so as not to scramble the heap and index */
+    order = palloc(transval->next_item*sizeof(uint32));
+    for (i = 0; i < transval->next_item; i++)
+        order[i] = i;
+    qsort_arg(order, transval->next_item, sizeof(uint32), ss_idx_cmp_desc,
+              (void *)transval);
+
+    getTypeOutputInfo(INT8OID, &int8OutOid, &typIsVarlena);
+    mincnt = SS_MIN_COUNT(transval);
+    histo = palloc(transval->next_item*4*sizeof(Datum));
+    for (i = 0; i < transval->next_item; i++) {
+        uint32 j = order[i];
+        Datum  curval = PointerExtractDatum(SS_GETVAL(transval, j),
+                                            transval->typByVal);
+        uint64 cnt = transval->items[j].cnt;
+        uint64 err = SS_ERRS(transval)[j];
+
+        histo[4*i] = PointerGetDatum(cstring_to_text(
+            OidOutputFunctionCall(transval->outFuncOid, curval)));
+        histo[4*i + 1] = PointerGetDatum(cstring_to_text(
+            OidOutputFunctionCall(int8OutOid, Int64GetDatum(cnt))));
+        histo[4*i + 2] = PointerGetDatum(cstring_to_text(
+            OidOutputFunctionCall(int8OutOid, Int64GetDatum(err))));
+        histo[4*i + 3] = PointerGetDatum(cstring_to_text(
+            (cnt - err >= mincnt) ? "t" : "f"));
+    }
+
+    dims[0] = transval->next_item;
+    dims[1] = 4;
+    lbs[0] = lbs[1] = 0;
+    retval = construct_md_array(histo,
+                                NULL,
+                                2,
+                                dims,
+                                lbs,
+                                TEXTOID,
+                                -1,
+                                0,
+                                'i');
+    PG_RETURN_ARRAYTYPE_P(retval);
+}
@@ -24,8 +24,6 @@
 #include "access/htup.h"
 #include "catalog/pg_proc.h"
 
-void* array_pos_ref = NULL;
-
 
 /* -----------------------------------------------------------------------------
  *
@@ -69,6 +67,7 @@ void append_to_rle_index(StringInfo index, int64 run_len)
 /* Adds a new block to a SparseData
  * The function appendBinaryStringInfo always make sure to attach a trailing '\0'
  * to the data array of the vals StringInfo.
+ * A dense SparseData is given an explicit index of ones first.
  */
 void add_run_to_sdata(char *run_val, int64 run_len, size_t width,
 		SparseData sdata)
@@ -76,6 +75,12 @@ void add_run_to_sdata(char *run_val, int64 run_len, size_t width,
 	StringInfo index = sdata->index;
 	StringInfo vals  = sdata->vals;
 
+	if (index->data == NULL)
+	{
+		initStringInfo(index);
+		for (int i=0; i<sdata->unique_value_count; i++)
+			append_to_rle_index(index,1);
+	}
 	appendBinaryStringInfo(vals,run_val,width);
 	append_to_rle_index(index, run_len);
 	sdata->unique_value_count++;
@@ -178,6 +183,50 @@ int64 compword_to_int8(const char *entry)
 	return num;
 }
 
+/**
+ * Checks that a run-length index, typically received from a client, is
+ * well formed: one compword per run, each a positive count, together
+ * filling exactly index_len bytes and adding up to total_value_count.
+ * An empty index stands for runs of length one.
+ *
+ * @return NULL if the index is valid, or else a description of the problem
+ */
+const char *sdata_index_check(const char *index, int index_len,
+		int unique_value_count, int total_value_count)
+{
+	const char *ptr = index;
+	const char *end = index + index_len;
+	int64 total = 0;
+
+	if (index_len == 0)
+		return (unique_value_count == total_value_count) ? NULL :
+			"an empty index needs one run per element";
+
+	for (int i=0; i<unique_value_count; i++)
+	{
+		int64 run_len;
+
+		if (ptr >= end)
+			return "fewer run lengths than values";
+		if (*ptr >= 0 && *ptr != 2 && *ptr != 4 && *ptr != 8)
+			return "malformed run length";
+		if (ptr + int8compstoragesize(ptr) > end)
+			return "truncated run length";
+		run_len = compword_to_int8(ptr);
+		if (run_len <= 0)
+			return "run lengths must be positive";
+		total += run_len;
+		if (total > total_value_count)
+			return "run lengths add up to more than the number of elements";
+		ptr += int8compstoragesize(ptr);
+	}
+	if (ptr != end)
+		return "more run lengths than values";
+	if (total != total_value_count)
+		return "run lengths add up to less than the number of elements";
+	return NULL;
+}
+
 void printout_double(double *vals, int num_values, int stop)
 {
 	(void) stop; /* avoid warning about unused parameter */
@@ -289,6 +338,14 @@ void printout_sdata(SparseData sdata, char *msg, int stop)
 		break; \
 }
 
+/*
+ * Applies op to two float8s. If both are NaNs (NULLs are NaNs too, see
+ * NVP), C does not say which of them the result carries, and compilers do
+ * swap the operands of + and *. Taking the left one makes every code path
+ * agree bit for bit. A left NaN is what the hardware returns anyway.
+ */
+#define float8_op(l,op,r) (isnan(l) ? (l) : (l) op (r))
+
 #define accum_sdata_result(result,left,i,op,right,j) \
 	switch ((left)->type_of_data) \
 { \
@@ -298,9 +355,9 @@ void printout_sdata(SparseData sdata, char *msg, int stop)
 		valref(float,right,j); \
 		break; \
 	case FLOAT8OID: \
-		typref(float8,result) = \
-		valref(float8,left,i) op \
-		valref(float8,right,j); \
+		typref(float8,result) = float8_op( \
+		valref(float8,left,i),op, \
+		valref(float8,right,j)); \
 		break; \
 	case CHAROID: \
 		typref(char,result) = \
@@ -772,8 +829,245 @@ double l1norm_sdata_values_double(SparseData sdata) {
  *   which creates a new SparseData array
  *------------------------------------------------------------------------------
  */
+
+/* Applies operation to the elements from..to-1 of two float8 operands
+ * given as expressions in k, storing into result[k].
+ */
+#define op_float8_range(operation,result,from,to,lexpr,rexpr) \
+switch (operation) \
+{ \
+	case subtract: \
+		for (int k=(from); k<(to); k++) (result)[k] = float8_op((lexpr),-,(rexpr)); \
+		break; \
+	case add: \
+	default: \
+		for (int k=(from); k<(to); k++) (result)[k] = float8_op((lexpr),+,(rexpr)); \
+		break; \
+	case multiply: \
+		for (int k=(from); k<(to); k++) (result)[k] = float8_op((lexpr),*,(rexpr)); \
+		break; \
+	case divide: \
+		for (int k=(from); k<(to); k++) (result)[k] = float8_op((lexpr),/,(rexpr)); \
+		break; \
+}
+
+/*
+ * The kernel of op_sdata_by_sdata when at least one side is dense. The
+ * result changes value about as often as the dense side does, so it is
+ * computed element by element into a plain array, walking the runs of the
+ * other side if it is run-length encoded, and only compressed afterwards
+ * if that pays.
+ */
+static SparseData
+op_sdata_by_sdata_dense(enum operation_t operation,
+			SparseData left, SparseData right)
+{
+	int count = left->total_value_count;
+	double *lvals = (double *)left->vals->data;
+	double *rvals = (double *)right->vals->data;
+	double *result = (double *)palloc(sizeof(float8)*count+1);
+
+	if (SDATA_IS_DENSE(left) && SDATA_IS_DENSE(right))
+	{
+		op_float8_range(operation,result,0,count,lvals[k],rvals[k])
+	} else if (SDATA_IS_DENSE(left))
+	{
+		char *ix = right->index->data;
+		int pos = 0;
+
+		for (int i=0; i<right->unique_value_count; i++)
+		{
+			int end = pos + compword_to_int8(ix);
+			double rval = rvals[i];
+
+			op_float8_range(operation,result,pos,end,lvals[k],rval)
+			pos = end;
+			ix += int8compstoragesize(ix);
+		}
+	} else
+	{
+		char *ix = left->index->data;
+		int pos = 0;
+
+		for (int i=0; i<left->unique_value_count; i++)
+		{
+			int end = pos + compword_to_int8(ix);
+			double lval = lvals[i];
+
+			op_float8_range(operation,result,pos,end,lval,rvals[k])
+			pos = end;
+			ix += int8compstoragesize(ix);
+		}
+	}
+	return float8arr_to_sdata_by_density(result,count);
+}
+
+static void append_run_merging(SparseData sdata, double run_val,
+			       int64 run_len, double *last_val, int64 *last_len);
+
+/* Applies operation to two float8s */
+static inline double
+op_float8(enum operation_t operation, double left, double right)
+{
+	switch (operation)
+	{
+		case subtract: return float8_op(left,-,right);
+		case add:
+		default:       return float8_op(left,+,right);
+		case multiply: return float8_op(left,*,right);
+		case divide:   return float8_op(left,/,right);
+	}
+}
+
+/*
+ * The kernel of op_sdata_by_sdata for two run-length encoded float8 arrays.
+ * The runs are walked with typed values and plain positions. Wherever both
+ * sides have a stretch of runs of length one, their values are contiguous,
+ * so the stretch is computed by op_float8_range in one loop the compiler
+ * can vectorize, and only then merged into runs.
+ *
+ * Equal neighbouring results are merged by comparing their bits, as the
+ * generic loop does, so the result is the same bit for bit.
+ */
+static SparseData
+op_sdata_by_sdata_runs(enum operation_t operation,
+		       SparseData left, SparseData right)
+{
+	SparseData sdata = makeSparseData();
+	int64 total = left->total_value_count;
+	double *lvals = (double *)left->vals->data;
+	double *rvals = (double *)right->vals->data;
+	char *lix = left->index->data;
+	char *rix = right->index->data;
+	int i = 0, j = 0;       /* the current runs */
+	int64 lrem, rrem;       /* the elements left in the current runs */
+	int64 pos = 0;
+	double *stretch = NULL;
+	double run_val = 0;
+	int64 run_len = 0;
+
+	sdata->type_of_data = FLOAT8OID;
+	if (total == 0)
+		return sdata;
+
+	lrem = compword_to_int8(lix);
+	rrem = compword_to_int8(rix);
+	while (pos < total)
+	{
+		if (lrem == 1 && rrem == 1)
+		{
+			/* the unit runs that follow on both sides */
+			char *lnext = lix + int8compstoragesize(lix);
+			char *rnext = rix + int8compstoragesize(rix);
+			int n = 1;
+
+			while (i+n < left->unique_value_count &&
+			       j+n < right->unique_value_count &&
+			       lnext[n-1] == (char)-1 && rnext[n-1] == (char)-1)
+				n++;
+
+			if (stretch == NULL)
+				stretch = (double *)palloc(sizeof(double)*
+					Min(left->unique_value_count,right->unique_value_count));
+			op_float8_range(operation,stretch,0,n,lvals[i+k],rvals[j+k])
+
+			/*
+			 * At most n runs are completed here, so make room for
+			 * them at once and write them directly. A count never
+			 * takes more bytes than the elements it covers, except
+			 * for that of the run pending from before the stretch.
+			 */
+			enlargeStringInfo(sdata->vals,n*sizeof(double));
+			enlargeStringInfo(sdata->index,n+9);
+			for (int k=0; k<n; k++)
+			{
+				if (run_len > 0 &&
+				    memcmp(&stretch[k],&run_val,sizeof(double)) == 0)
+				{
+					run_len++;
+					continue;
+				}
+				if (run_len > 0)
+				{
+					StringInfo vals = sdata->vals, index = sdata->index;
+
+					memcpy(vals->data+vals->len,&run_val,sizeof(double));
+					vals->len += sizeof(double);
+					int8_to_compword(run_len,index->data+index->len);
+					index->len += int8compstoragesize(index->data+index->len);
+					sdata->unique_value_count++;
+					sdata->total_value_count += run_len;
+				}
+				run_val = stretch[k];
+				run_len = 1;
+			}
+			sdata->vals->data[sdata->vals->len] = '\0';
+			sdata->index->data[sdata->index->len] = '\0';
+
+			i += n;
+			j += n;
+			lix = lnext + (n-1);
+			rix = rnext + (n-1);
+			lrem = rrem = 0;
+			pos += n;
+		} else
+		{
+			int64 len = Min(lrem,rrem);
+
+			append_run_merging(sdata,op_float8(operation,lvals[i],rvals[j]),
+					   len,&run_val,&run_len);
+			lrem -= len;
+			rrem -= len;
+			pos += len;
+			if (lrem == 0)
+			{
+				i++;
+				lix += int8compstoragesize(lix);
+			}
+			if (rrem == 0)
+			{
+				j++;
+				rix += int8compstoragesize(rix);
+			}
+		}
+		if (pos < total)
+		{
+			if (lrem == 0)
+				lrem = compword_to_int8(lix);
+			if (rrem == 0)
+				rrem = compword_to_int8(rix);
+		}
+	}
+	if (run_len > 0)
+		add_run_to_sdata((char *)&run_val,run_len,sizeof(float8),sdata);
+
+	if (stretch != NULL)
+		pfree(stretch);
+	return sdata;
+}
+
 SparseData op_sdata_by_sdata(enum operation_t operation,
 					   SparseData left, SparseData right)
+{
+	if (left->type_of_data == FLOAT8OID)
+	{
+		check_sdata_dimensions(left,right);
+		if (left->total_value_count > 0 &&
+		    (SDATA_IS_DENSE(left) || SDATA_IS_DENSE(right)))
+			return op_sdata_by_sdata_dense(operation,left,right);
+		return op_sdata_by_sdata_runs(operation,left,right);
+	}
+
+	return op_sdata_by_sdata_generic(operation,left,right);
+}
+
+/**
+ * The type-generic loop behind op_sdata_by_sdata. It is used for element
+ * types other than float8, and serves as the reference implementation the
+ * float8 kernels must agree with bit for bit.
+ */
+SparseData op_sdata_by_sdata_generic(enum operation_t operation,
+					   SparseData left, SparseData right)
 {
 	SparseData sdata = makeSparseData();
 
@@ -881,6 +1175,155 @@ SparseData op_sdata_by_sdata(enum operation_t operation,
 	return sdata;
 }
 
+/*
+ * Fused reductions over a pair of SparseData arrays
+ *
+ * These walk the runs of both arrays once, with the same pair of cursors
+ * as op_sdata_by_sdata, but fold each stretch where both runs overlap
+ * straight into a double instead of building the elementwise result and
+ * summing it afterwards. Nothing is allocated, which matters to callers
+ * like k-means that compute millions of distances.
+ *
+ * Equal consecutive terms are no longer merged into one run before being
+ * multiplied by their length, so the result may differ from the old
+ * materialize-then-sum path in the last bits. NVPs still propagate.
+ *
+ * Either index may be NULL (every run of length one). An array holding a
+ * single value is broadcast across the other, which is how the svec
+ * operators treat a scalar operand.
+ *------------------------------------------------------------------------------
+ */
+enum reduction_t { dot_product, l2_squared, l1_sum };
+
+static inline double
+reduce_term(enum reduction_t reduction, double lval, double rval)
+{
+	double term;
+
+	switch (reduction)
+	{
+		case dot_product:
+		default:
+			return lval * rval;
+		case l2_squared:
+			term = lval - rval;
+			return term * term;
+		case l1_sum:
+			term = lval - rval;
+			return (term < 0) ? -term : term;
+	}
+}
+
+/*
+ * reduce_sdata_pair when at least one side is dense and neither is
+ * broadcast. Every overlap is then one element long, so this adds up the
+ * same terms in the same order as the general walk, without the
+ * bookkeeping.
+ */
+static inline double
+reduce_sdata_pair_dense(enum reduction_t reduction, SparseData left,
+			SparseData right)
+{
+	double *lvals = (double *)left->vals->data;
+	double *rvals = (double *)right->vals->data;
+	double accum = 0.;
+
+	if (SDATA_IS_DENSE(left) && SDATA_IS_DENSE(right))
+	{
+		for (int k=0; k<left->total_value_count; k++)
+			accum += reduce_term(reduction,lvals[k],rvals[k]);
+	} else if (SDATA_IS_DENSE(left))
+	{
+		char *ix = right->index->data;
+		int pos = 0;
+
+		for (int i=0; i<right->unique_value_count; i++)
+		{
+			int end = pos + compword_to_int8(ix);
+
+			for (int k=pos; k<end; k++)
+				accum += reduce_term(reduction,lvals[k],rvals[i]);
+			pos = end;
+			ix += int8compstoragesize(ix);
+		}
+	} else
+	{
+		char *ix = left->index->data;
+		int pos = 0;
+
+		for (int i=0; i<left->unique_value_count; i++)
+		{
+			int end = pos + compword_to_int8(ix);
+
+			for (int k=pos; k<end; k++)
+				accum += reduce_term(reduction,lvals[i],rvals[k]);
+			pos = end;
+			ix += int8compstoragesize(ix);
+		}
+	}
+	return (accum);
+}
+
+static inline double
+reduce_sdata_pair(enum reduction_t reduction, SparseData left, SparseData right)
+{
+	if ((SDATA_IS_DENSE(left) || SDATA_IS_DENSE(right)) &&
+	    left->total_value_count == right->total_value_count)
+		return reduce_sdata_pair_dense(reduction,left,right);
+
+	double *lvals = (double *)left->vals->data;
+	double *rvals = (double *)right->vals->data;
+	char *liptr = left->index->data;
+	char *riptr = right->index->data;
+	int64 total = Max(left->total_value_count,right->total_value_count);
+	int64 lrun = (left->total_value_count == 1) ? total : compword_to_int8(liptr);
+	int64 rrun = (right->total_value_count == 1) ? total : compword_to_int8(riptr);
+	int64 done = 0;
+	double accum = 0.;
+	int i = 0, j = 0;
+
+	while (done < total)
+	{
+		int64 overlap = Min(lrun,rrun);
+
+		accum += reduce_term(reduction,lvals[i],rvals[j]) * overlap;
+
+		done += overlap;
+		if (done >= total) break;
+		lrun -= overlap;
+		rrun -= overlap;
+		if (lrun == 0)
+		{
+			i++;
+			liptr += int8compstoragesize(liptr);
+			lrun = compword_to_int8(liptr);
+		}
+		if (rrun == 0)
+		{
+			j++;
+			riptr += int8compstoragesize(riptr);
+			rrun = compword_to_int8(riptr);
+		}
+	}
+	return (accum);
+}
+
+/* Computes the dot product of two SparseData without materializing their product */
+double dot_sdata_values_double(SparseData left, SparseData right) {
+	check_sdata_dimensions(left,right);
+	return reduce_sdata_pair(dot_product,left,right);
+}
+
+/* Computes the l2 norm of the difference of two SparseData */
+double l2dist_sdata_values_double(SparseData left, SparseData right) {
+	return sqrt(reduce_sdata_pair(l2_squared,left,right));
+}
+
+/* Computes the l1 norm of the difference of two SparseData */
+double l1dist_sdata_values_double(SparseData left, SparseData right) {
+	return reduce_sdata_pair(l1_sum,left,right);
+}
+
 /* END Previously in SparseData.h */
 
 
@@ -1031,7 +1474,8 @@ void freeSparseData(SparseData sdata) {
  */
 void freeSparseDataAndData(SparseData sdata) {
 	pfree(sdata->vals->data);
-	pfree(sdata->index->data);
+	if (sdata->index->data != NULL)
+		pfree(sdata->index->data);
 	freeSparseData(sdata);
 }
 
@@ -1071,7 +1515,7 @@ StringInfo makeStringInfoFromData(char *data,int len) {
 
 	sinfo->data   = data;
 	sinfo->len    = len;
-	sinfo->maxlen = len+1;
+	sinfo->maxlen = data == NULL ? 0 : len+1;
 	sinfo->cursor = 0;
 	return sinfo;
 }
@@ -1085,6 +1529,34 @@ SparseData float8arr_to_sdata(double *array, int count) {
 	return arr_to_sdata((char *)array, sizeof(float8), FLOAT8OID, count);
 }
 
+/**
+ * Wraps an array of doubles in a SparseData in the representation that
+ * suits it: dense if no two neighbours are equal, run-length encoded
+ * otherwise. Equality is bitwise, as in arr_to_sdata().
+ *
+ * @param array The array of doubles, palloc'd with one spare byte at the
+ * end for the terminating '\0' of a StringInfo; a dense result takes it over
+ * @param count The size of array
+ * @return A SparseData holding the elements of array
+ */
+SparseData float8arr_to_sdata_by_density(double *array, int count) {
+	SparseData sdata;
+
+	((char *)array)[count*sizeof(float8)] = '\0';
+
+	for (int i=1; i<count; i++)
+	{
+		if (memcmp(&array[i],&array[i-1],sizeof(float8)) == 0)
+		{
+			sdata = float8arr_to_sdata(array,count);
+			pfree(array);
+			return sdata;
+		}
+	}
+	return makeInplaceSparseData((char *)array,NULL,
+			count*sizeof(float8),0,FLOAT8OID,count,count);
+}
+
 /**
  * @param array The array of elements to be converted to a SparseData
  * @param width The size of the elements in array
@@ -1128,92 +1600,126 @@ SparseData arr_to_sdata(char *array, size_t width, Oid type_of_data, int count){
 	return sdata;
 }
 
-int compar(const void *i, const void *j){
-	return (int)((int64*)array_pos_ref)[*(int*)i] - ((int64*)array_pos_ref)[*(int*)j];
+/* A (position, value) pair given to position_to_sdata */
+typedef struct
+{
+	int64 pos;
+	double val;
+} position_value;
+
+static int compar_position(const void *i, const void *j)
+{
+	int64 left  = ((const position_value *)i)->pos;
+	int64 right = ((const position_value *)j)->pos;
+	return (left > right) - (left < right);
+}
+
+/*
+ * Appends run_len copies of run_val to a SparseData under construction,
+ * merging them into the pending run (*last_val, *last_len) when the values
+ * are identical, so that the result never has two adjacent equal runs.
+ */
+static void
+append_run_merging(SparseData sdata, double run_val, int64 run_len,
+		   double *last_val, int64 *last_len)
+{
+	if (*last_len > 0 && memcmp(&run_val,last_val,sizeof(double)) == 0) {
+		*last_len += run_len;
+		return;
+	}
+	if (*last_len > 0)
+		add_run_to_sdata((char *)last_val,*last_len,sizeof(double),sdata);
+	*last_val = run_val;
+	*last_len = run_len;
 }
 
 /**
+ * Builds a SparseData straight from runs of positions, without going
+ * through a dense array: the pairs are sorted by position (unless they
+ * already are) and the runs are written in a single pass.
+ *
  * @param array_val The array of values to be converted to values in SparseData
  * @param array_pos The array of positions to be converted to runs in SparseData
- * @param type_of_data type of the value element
+ * @param type_of_data type of the value element, must be FLOAT8OID
  * @param count The (common) size of array and array_pos
- * @param end The size of the desired SparseData
+ * @param end The size of the desired SparseData; if it is smaller than the
+ *        largest position, the SparseData ends at the largest position
  * @param default_val The default value for positions unspecified in array_pos
  * @return A SparseData representation of an input array of doubles
  */
 SparseData position_to_sdata(double *array_val, int64 *array_pos,
 			     Oid type_of_data,
 			     int count, int64 end, double default_val) {
-
-	char * array = (char *)array_val;
-	char * base_val = (char *)&default_val;
-	size_t width = size_of_type(type_of_data);
-	char *run_val=array;
-	int64 run_len;
+	position_value *pairs = (position_value *)palloc(count*sizeof(position_value));
 	SparseData sdata = makeSparseData();
-
-	int *index = (int*)palloc(count*sizeof(int));
-	for(int i = 0; i < count; ++i)
-		index[i] = i;
-
-	/* this is a temp solution that will be in place only until qsort_r
-	 * is a standard library function */
-	array_pos_ref = array_pos;
-	qsort(index, count, sizeof(int), compar);
-
-	sdata->type_of_data=type_of_data;
-	if(array_pos[index[0]] > 1){
-		run_len = array_pos[index[0]]-1;
-		add_run_to_sdata(base_val,run_len,width,sdata);
+	bool sorted = true;
+	int64 last_pos = 0;
+	double run_val = 0;
+	int64 run_len = 0;
+
+	for (int i = 0; i < count; i++) {
+		pairs[i].pos = array_pos[i];
+		pairs[i].val = array_val[i];
+		if (i > 0 && array_pos[i] < array_pos[i-1])
+			sorted = false;
 	}
+	if (!sorted)
+		qsort(pairs, count, sizeof(position_value), compar_position);
 
-	for (int i = 0; i<count; i++) {
-		run_len=1;
+	/* there are at most two runs per position, plus the tail */
+	enlargeStringInfo(sdata->vals, (2*count+1)*sizeof(double));
+	enlargeStringInfo(sdata->index, 2*count+1);
+	sdata->type_of_data = type_of_data;
+
+	for (int i = 0; i < count; i++) {
 		/*
 		 * Note that special double values like denormalized numbers and exceptions
 		 * like NaN are treated like any other value - if there are duplicates, the
 		 * value of the special number is preserved and they are counted.
 		 */
-		while ((i < count-1) &&
-		       ((array_pos[index[i+1]] - array_pos[index[i]])==1) &&
-		       (memcmp((array+index[i]*size_of_type(type_of_data)),
-			       (array+index[i+1]*size_of_type(type_of_data)),width)==0)) {
-			run_len++;
-			i++;
-		}
-		while ((i < count-1)&&((array_pos[index[i+1]] - array_pos[index[i]])==0)) {
-			if ((memcmp((array+index[i]*size_of_type(type_of_data)),
-				    (array+index[i+1]*size_of_type(type_of_data)),width)==0)) {
-				i++;
-			} else {
+		if (i > 0 && pairs[i].pos == last_pos) {
+			if (memcmp(&pairs[i].val,&pairs[i-1].val,sizeof(double)) != 0)
 				ereport(ERROR,
 					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 					 errmsg("posit_to_sdata conflicting values for the same position")));
-			}
-		}
-		run_val = array+index[i]*size_of_type(type_of_data);
-		add_run_to_sdata(run_val,run_len,width,sdata);
-
-		if(i < count-1){
-			run_len = array_pos[index[i+1]]-array_pos[index[i]]-1;
-			if (run_len > 0){
-				add_run_to_sdata(base_val,run_len,width,sdata);
-			}
-		}else if(array_pos[index[i]] < end){
-			run_len = end-array_pos[index[i]];
-			if (run_len > 0){
-				add_run_to_sdata(base_val,run_len,width,sdata);
-			}
+			continue;
 		}
+		if (pairs[i].pos - last_pos > 1)
+			append_run_merging(sdata, default_val, pairs[i].pos - last_pos - 1,
+					   &run_val, &run_len);
+		append_run_merging(sdata, pairs[i].val, 1, &run_val, &run_len);
+		last_pos = pairs[i].pos;
 	}
+	if (end > last_pos)
+		append_run_merging(sdata, default_val, end - last_pos, &run_val, &run_len);
+	if (run_len > 0)
+		add_run_to_sdata((char *)&run_val, run_len, sizeof(double), sdata);
 
-	/* Add the final tallies */
-	sdata->unique_value_count = sdata->vals->len/width;
-	sdata->total_value_count = end;
-	pfree(index);
+	pfree(pairs);
 	return sdata;
 }
 
+/**
+ * @param sdata A SparseData whose neighbouring runs may hold equal values,
+ * such as a dense SparseData that was added to in place
+ * @return A copy of sdata with such runs merged
+ */
+SparseData compress_sdata(SparseData sdata) {
+	SparseData ret = makeSparseData();
+	double *vals = (double *)sdata->vals->data;
+	char *ix = sdata->index->data;
+	double run_val = 0.;
+	int64 run_len = 0;
+
+	for (int i=0; i<sdata->unique_value_count; i++) {
+		append_run_merging(ret, vals[i], compword_to_int8(ix),
+				   &run_val, &run_len);
+		ix += int8compstoragesize(ix);
+	}
+	if (run_len > 0)
+		add_run_to_sdata((char *)&run_val, run_len, sizeof(double), ret);
+	return ret;
+}
 
 /**
  * @param sdata The SparseData to be converted to an array of float8s
@@ -1357,47 +1863,118 @@ double sd_proj(SparseData sdata, int idx) {
  * @return The sub-array, indexed by start and end, of a SparseData.
  */
 SparseData subarr(SparseData sdata, int start, int end) {
+	SparseDataRuns runs = sdata_runs_from_sdata(sdata);
+	SparseData ret = subarr_runs(runs,start,end);
+
+	freeSparseDataRuns(runs);
+	return ret;
+}
+
+/**
+ * Decodes the run-length index of a SparseData into cumulative run ends.
+ * The values are not copied, so the result is only valid while sdata is.
+ *
+ * @param sdata The SparseData to decode
+ * @return A SparseDataRuns describing the runs of sdata
+ */
+SparseDataRuns sdata_runs_from_sdata(SparseData sdata) {
+	SparseDataRuns runs = (SparseDataRuns)palloc(sizeof(SparseDataRunsStruct));
 	char * ix = sdata->index->data;
-	double * vals = (double *)sdata->vals->data;
-	SparseData ret = makeSparseData();
+	int64 read = 0;
+
+	runs->unique_value_count = sdata->unique_value_count;
+	runs->total_value_count  = sdata->total_value_count;
+	runs->vals = (double *)sdata->vals->data;
+	runs->run_end = (int64 *)palloc(
+			sizeof(int64)*Max(sdata->unique_value_count,1));
+
+	/* compword_to_int8(NULL) is 1, which covers uncompressed arrays */
+	for (int i=0; i<sdata->unique_value_count; i++) {
+		read += compword_to_int8(ix);
+		runs->run_end[i] = read;
+		ix += int8compstoragesize(ix);
+	}
+	return runs;
+}
+
+/**
+ * Frees a SparseDataRuns, leaving the values it points to alone.
+ */
+void freeSparseDataRuns(SparseDataRuns runs) {
+	pfree(runs->run_end);
+	pfree(runs);
+}
+
+/**
+ * @param runs A decoded SparseData
+ * @param idx A position in the array, counting from one
+ * @return The number of the run holding position idx
+ */
+int sdata_runs_find(SparseDataRuns runs, int64 idx) {
+	int lo = 0, hi = runs->unique_value_count-1;
+
+	while (lo < hi) {
+		int mid = lo + (hi-lo)/2;
+
+		if (runs->run_end[mid] < idx)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * @param runs A decoded SparseData
+ * @param idx The index of the element to extract, counting from one
+ * @return The element at position idx
+ */
+double sd_runs_proj(SparseDataRuns runs, int idx) {
+	/* error checking */
+	if (0 >= idx || idx > runs->total_value_count)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("Index out of bounds.")));
+
+	return runs->vals[sdata_runs_find(runs,idx)];
+}
+
+/**
+ * @param runs A decoded SparseData from which to extract a subarray
+ * @param start The start index of the desired subarray
+ * @param end The end index of the desired subarray
+ * @return The sub-array, indexed by start and end, of the SparseData.
+ */
+SparseData subarr_runs(SparseDataRuns runs, int start, int end) {
+	SparseData ret;
 	size_t wf8 = sizeof(float8);
+	int first, last;
 
 	if (start > end)
-		return reverse(subarr(sdata,end,start));
+		return reverse(subarr_runs(runs,end,start));
 
 	/* error checking */
-	if (0 >= start || start > end || end > sdata->total_value_count)
+	if (0 >= start || end > runs->total_value_count)
 		ereport(ERROR,
 			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 			 errmsg("Array index out of bounds.")));
 
-	/* find start block */
-	int read = compword_to_int8(ix);
-	int i = 0;
-	while (read < start) {
-		ix += int8compstoragesize(ix);
-		read += compword_to_int8(ix);
-		i++;
-	}
-	if (end <= read) {
-		/* the whole subarray is in the first block, we are done */
-		add_run_to_sdata((char *)(&vals[i]), end-start+1, wf8, ret);
-		return ret;
-	}
-	/* else start building subarray */
-	add_run_to_sdata((char *)(&vals[i]), read-start+1, wf8, ret);
+	ret = makeSparseData();
+	first = sdata_runs_find(runs,start);
+	last  = sdata_runs_find(runs,end);
 
-	for (int j=i+1; j<sdata->unique_value_count; j++) {
-		ix += int8compstoragesize(ix);
-		int esize = compword_to_int8(ix);
-		if (read + esize > end) {
-			add_run_to_sdata((char *)(&vals[j]), end-read, wf8,ret);
-			break;
-		}
-		add_run_to_sdata((char *)(&vals[j]), esize, wf8, ret);
-		read += esize;
-		if (read == end) break;
+	if (first == last) {
+		/* the whole subarray is in one block */
+		add_run_to_sdata((char *)(&runs->vals[first]), end-start+1, wf8, ret);
+		return ret;
 	}
+	add_run_to_sdata((char *)(&runs->vals[first]),
+			runs->run_end[first]-start+1, wf8, ret);
+	for (int j=first+1; j<last; j++)
+		add_run_to_sdata((char *)(&runs->vals[j]),
+				runs->run_end[j]-runs->run_end[j-1], wf8, ret);
+	add_run_to_sdata((char *)(&runs->vals[last]),
+			end-runs->run_end[last-1], wf8, ret);
 	return ret;
 }
 
@@ -1406,23 +1983,35 @@ SparseData subarr(SparseData sdata, int start, int end) {
  * @return A copy of the input SparseData, with the order of the elements reversed.
  */
 SparseData reverse(SparseData sdata) {
-	char * ix = sdata->index->data;
-	double * vals = (double *)sdata->vals->data;
+	SparseDataRuns runs = sdata_runs_from_sdata(sdata);
 	SparseData ret = makeSparseData();
 	size_t w = sizeof(float8);
 
-	/* move to the last count array element */
-	for (int j=0; j<sdata->unique_value_count-1; j++)
-		ix += int8compstoragesize(ix);
-
-	/* copy from right to left */
-	for (int j=sdata->unique_value_count-1; j!=-1; j--) {
-		add_run_to_sdata((char *)(&vals[j]),compword_to_int8(ix),w,ret);
-		ix -= int8compstoragesize(ix);
+	/*
+	 * Copy from right to left. Compwords vary in size and so cannot be
+	 * walked backwards, but the decoded run ends can.
+	 */
+	for (int j=runs->unique_value_count-1; j!=-1; j--) {
+		int64 run_len = runs->run_end[j] - ((j > 0) ? runs->run_end[j-1] : 0);
+		add_run_to_sdata((char *)(&runs->vals[j]),run_len,w,ret);
 	}
+	freeSparseDataRuns(runs);
 	return ret;
 }
 
+/**
+ * @param count The number of runs
+ * @return A run-length index of count runs of length one, which is what
+ * a dense SparseData leaves implicit
+ */
+static StringInfo unit_rle_index(int count) {
+	StringInfo index = makeStringInfo();
+
+	for (int i=0; i<count; i++)
+		append_to_rle_index(index,1);
+	return index;
+}
+
 /**
  * @param left The SparseData that comes first in the resulting concatenation
  * @param right The SparseData that comes second in the resulting concatenation
@@ -1440,24 +2029,37 @@ SparseData concat(SparseData left, SparseData right) {
 	char *vals,*index;
 	int l_val_len = left->vals->len;
 	int r_val_len = right->vals->len;
-	int l_ind_len = left->index->len;
-	int r_ind_len = right->index->len;
 	int val_len = l_val_len + r_val_len;
-	int ind_len = l_ind_len + r_ind_len;
 
 	vals = (char *)palloc(sizeof(char)*val_len + 1);
-	index = (char *)palloc(sizeof(char)*ind_len + 1);
 
 	memcpy(vals, left->vals->data,l_val_len);
 	memcpy(vals+l_val_len,right->vals->data,r_val_len);
 	vals[val_len] = '\0';
 
-	memcpy(index, left->index->data,l_ind_len);
-	memcpy(index+l_ind_len,right->index->data,r_ind_len);
-	index[ind_len] = '\0';
-
 	sdata->vals  = makeStringInfoFromData(vals,val_len);
-	sdata->index = makeStringInfoFromData(index,ind_len);
+	if (SDATA_IS_DENSE(left) && SDATA_IS_DENSE(right))
+	{
+		/* the result is dense too */
+		sdata->index = makeStringInfoFromData(NULL,0);
+	} else
+	{
+		/* a dense side needs its run lengths of one spelled out */
+		StringInfo l_index = SDATA_IS_DENSE(left) ?
+			unit_rle_index(left->unique_value_count) : left->index;
+		StringInfo r_index = SDATA_IS_DENSE(right) ?
+			unit_rle_index(right->unique_value_count) : right->index;
+		int l_ind_len = l_index->len;
+		int r_ind_len = r_index->len;
+		int ind_len = l_ind_len + r_ind_len;
+
+		index = (char *)palloc(sizeof(char)*ind_len + 1);
+		memcpy(index, l_index->data,l_ind_len);
+		memcpy(index+l_ind_len,r_index->data,r_ind_len);
+		index[ind_len] = '\0';
+
+		sdata->index = makeStringInfoFromData(index,ind_len);
+	}
 
 	sdata->type_of_data = left->type_of_data;
 	sdata->unique_value_count = left->unique_value_count +
@@ -1493,6 +2095,12 @@ SparseData concat_replicate(SparseData rep, int multiplier) {
 	index[ind_len] = '\0';
 
 	sdata->vals  = makeStringInfoFromData(vals,val_len);
+	if (SDATA_IS_DENSE(rep))
+	{
+		/* replicas of a dense array make a dense array */
+		pfree(index);
+		index = NULL;
+	}
 	sdata->index = makeStringInfoFromData(index,ind_len);
 	sdata->type_of_data = rep->type_of_data;
 	sdata->unique_value_count = multiplier * rep->unique_value_count;
@@ -47,6 +47,12 @@ typedef struct
  * instead of storing an array of ones [1,1,..,1,1] in the index field, which
  * is wasteful, we choose to use index->data == NULL to represent this special
  * case.
+ *
+ * A SparseData therefore comes in two representations: run-length encoded,
+ * and dense (no index, one value per element). svec_from_sparsedata() stores
+ * an svec dense whenever every run has length one, and the operations on
+ * pairs of SparseData (op_sdata_by_sdata() and the fused reductions) switch
+ * to plain loops over the values when either side is dense.
  */
 
 /**
@@ -54,6 +60,34 @@ typedef struct
  */
 typedef SparseDataStruct *SparseData;
 
+/**
+ * @param x a SparseData
+ * @return True if x is stored without a run-length index
+ */
+#define SDATA_IS_DENSE(x)	((x)->index->data == NULL)
+
+/*!
+ * \internal
+ * A decoded view of the run-length index of a SparseData. run_end[i] is the
+ * number of elements in runs 0..i, so the element at (one-based) position
+ * idx lives in the first run whose run_end is >= idx. This gives lookups by
+ * binary search, and loops over runs that read plain int64s instead of
+ * decoding compwords.
+ * \endinternal
+ */
+typedef struct
+{
+	int unique_value_count; /**< The number of runs */
+	int total_value_count;  /**< The total number of values */
+	double *vals;           /**< The value of each run, not copied from the SparseData */
+	int64 *run_end;         /**< Cumulative run lengths, one per run */
+} SparseDataRunsStruct;
+
+/**
+ * Pointer to a SparseDataRunsStruct
+ */
+typedef SparseDataRunsStruct *SparseDataRuns;
+
 /*------------------------------------------------------------------------------
  * Serialized SparseData
  *------------------------------------------------------------------------------
@@ -124,6 +158,8 @@ typedef SparseDataStruct *SparseData;
 
 void int8_to_compword(int64 num, char entry[9]);
 int64 compword_to_int8(const char *entry);
+const char *sdata_index_check(const char *index, int index_len,
+		int unique_value_count, int total_value_count);
 
 /** Serialization function */
 void serializeSparseData(char *target, SparseData source);
@@ -149,14 +185,21 @@ StringInfo makeStringInfoFromData(char *data,int len);
 double *sdata_to_float8arr(SparseData sdata);
 int64 *sdata_index_to_int64arr(SparseData sdata);
 SparseData float8arr_to_sdata(double *array, int count);
+SparseData float8arr_to_sdata_by_density(double *array, int count);
 SparseData position_to_sdata(double *array_val, int64 *array_pos, Oid type_of_data, int count, int64 end, double default_val);
 SparseData arr_to_sdata(char *array, size_t width, Oid type_of_data, int count);
+SparseData compress_sdata(SparseData sdata);
 SparseData posit_to_sdata(char *array, int64* array_pos, size_t width, Oid type_of_data, int count, int64 end, char *base_val);
 
 /* Some functions for accessing and changing elements of a SparseData */
 SparseData lapply(text * func, SparseData sdata);
 double sd_proj(SparseData sdata, int idx);
 SparseData subarr(SparseData sdata, int start, int end);
+SparseDataRuns sdata_runs_from_sdata(SparseData sdata);
+void freeSparseDataRuns(SparseDataRuns runs);
+int sdata_runs_find(SparseDataRuns runs, int64 idx);
+double sd_runs_proj(SparseDataRuns runs, int idx);
+SparseData subarr_runs(SparseDataRuns runs, int start, int end);
 SparseData reverse(SparseData sdata);
 SparseData concat(SparseData left, SparseData right);
 SparseData concat_replicate(SparseData rep, int multiplier);
@@ -167,6 +210,8 @@ enum operation_t { subtract, add, multiply, divide };
 double sum_sdata_values_double(SparseData sdata);
 SparseData op_sdata_by_sdata(enum operation_t operation, SparseData left,
     SparseData right);
+SparseData op_sdata_by_sdata_generic(enum operation_t operation,
+    SparseData left, SparseData right);
 bool sparsedata_eq(SparseData left, SparseData right);
 bool sparsedata_eq_zero_is_equal(SparseData left, SparseData right);
 bool sparsedata_contains(SparseData left, SparseData right);
@@ -183,6 +228,9 @@ SparseData op_sdata_by_scalar_copy(enum operation_t operation, char *scalar,
 
 double l2norm_sdata_values_double(SparseData sdata);
 double l1norm_sdata_values_double(SparseData sdata);
+double dot_sdata_values_double(SparseData left, SparseData right);
+double l2dist_sdata_values_double(SparseData left, SparseData right);
+double l1dist_sdata_values_double(SparseData left, SparseData right);
 
 size_t size_of_type(Oid type);
 void printout_double(double *vals, int num_values, int stop);
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <math.h>
 
+#include "access/hash.h"
 #include "access/tupmacs.h"
 #include "catalog/pg_type.h"
 #if PG_VERSION_NUM >= 90100
@@ -14,6 +15,7 @@
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 
 #include "sparse_vector.h"
 
@@ -21,7 +23,11 @@ Datum gp_extract_feature_histogram(PG_FUNCTION_ARGS);
 
 static void gp_extract_feature_histogram_errout(char *msg);
 
-static SvecType * classify_document(Datum *features, int num_features,
+typedef struct feature_dictionary feature_dictionary;
+
+static feature_dictionary *get_feature_dictionary(FunctionCallInfo fcinfo);
+
+static SvecType * classify_document(feature_dictionary *dict,
 				  Datum *document, int num_words, bool *null_words);
 
 #if PG_VERSION_NUM >= 90100
@@ -108,29 +114,107 @@ static SvecType * classify_document(Datum *features, int num_features,
  * 	float8 *document_count      //count of all documents in corpus
  */
 
-PG_FUNCTION_INFO_V1( gp_extract_feature_histogram );
-Datum gp_extract_feature_histogram(PG_FUNCTION_ARGS)
+/*
+ * A dictionary word in the hash table of a feature_dictionary. Besides the
+ * word, an entry holds the count of the word in the document being
+ * classified; the count is stale unless document matches the dictionary's.
+ */
+typedef struct
 {
-	SvecType   *returnval;
-	ArrayType  *arr0, *arr1;
-	Datum	   *features, *document;
-	int			num_features, num_words;
-	bool	   *null_words;
+	char   *word;			/* points into the dictionary array */
+	int		len;
+	uint32	hash;
+	int		next;			/* next entry in the bucket, or -1 */
+	int64	document;		/* the document counted in count */
+	float8	count;
+} feature_entry;
+
+/*
+ * The dictionary of the last call, parsed into a chained hash table. It is
+ * kept in fn_extra, so that a dictionary that is the same for every row
+ * (the usual case) is deconstructed, checked and hashed once per query
+ * rather than once per document.
+ */
+struct feature_dictionary
+{
+	MemoryContext context;	/* holds the dictionary and everything below */
+	bool		stable;			/* argument cannot change during the query */
+	char	   *key;			/* the raw argument, as passed, or NULL */
+	Size		keylen;
+	int			num_features;
+	int			num_buckets;	/* a power of two */
+	int		   *buckets;		/* first entry of each bucket, or -1 */
+	feature_entry *entries;	/* one per feature, in dictionary order */
+	int64		document;		/* number of documents classified */
+};
+
+/*
+ * Returns the feature entry holding the text datum word, or NULL.
+ */
+static feature_entry *
+feature_lookup(feature_dictionary *dict, Datum word)
+{
+	text   *t = (text *) DatumGetPointer(word);
+	char   *data = VARDATA_ANY(t);
+	int		len = VARSIZE_ANY_EXHDR(t);
+	uint32	hash = DatumGetUInt32(hash_any((unsigned char *) data, len));
+	int		i;
+
+	for (i = dict->buckets[hash & (dict->num_buckets - 1)]; i >= 0;
+		 i = dict->entries[i].next)
+	{
+		feature_entry *entry = &dict->entries[i];
+
+		if (entry->hash == hash && entry->len == len &&
+			memcmp(entry->word, data, len) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * Returns the parsed dictionary (argument 0) of this call, reusing the one
+ * in fn_extra. A constant or an external parameter cannot change during the
+ * query, so it is parsed on the first call and never looked at again. Any
+ * other argument is reused only when it is byte-for-byte the same as last
+ * time. That comparison is on the datum as passed, so a toasted dictionary
+ * is neither detoasted nor compared in full when it has not changed.
+ */
+static feature_dictionary *
+get_feature_dictionary(FunctionCallInfo fcinfo)
+{
+	feature_dictionary *dict = (feature_dictionary *) fcinfo->flinfo->fn_extra;
+	Pointer		raw = DatumGetPointer(PG_GETARG_DATUM(0));
+	Size		rawlen = VARSIZE_ANY(raw);
+	MemoryContext context, oldcontext;
+	ArrayType  *arr0;
+	Datum	   *features;
 	int16		elmlen;
 	bool		elmbyval;
 	char		elmalign;
 	int			i;
 
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+	if (dict != NULL && dict->stable)
+		return dict;
 
-	/* Error checking */
-	if (PG_NARGS() != 2)
-		gp_extract_feature_histogram_errout(
-			"gp_extract_feature_histogram called with wrong number of arguments");
+	if (dict != NULL && dict->keylen == rawlen &&
+		memcmp(dict->key, raw, rawlen) == 0)
+		return dict;
 
-	arr0 = PG_GETARG_ARRAYTYPE_P(0);
-	arr1 = PG_GETARG_ARRAYTYPE_P(1);
+	if (dict != NULL)
+	{
+		MemoryContextDelete(dict->context);
+		fcinfo->flinfo->fn_extra = NULL;
+	}
+
+	context = AllocSetContextCreate(fcinfo->flinfo->fn_mcxt,
+		"gp_extract_feature_histogram dictionary",
+		ALLOCSET_DEFAULT_MINSIZE,
+		ALLOCSET_DEFAULT_INITSIZE,
+		ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(context);
+
+	arr0 = PG_GETARG_ARRAYTYPE_P_COPY(0);
 
 	/* Error if dictionary is empty or contains a null */
 	if (ARR_HASNULL(arr0))
@@ -141,16 +225,17 @@ Datum gp_extract_feature_histogram(PG_FUNCTION_ARGS)
 		gp_extract_feature_histogram_errout(
 		  "dictionary argument is empty");
 
-	if (ARR_ELEMTYPE(arr0) != TEXTOID || ARR_ELEMTYPE(arr1) != TEXTOID)
+	if (ARR_ELEMTYPE(arr0) != TEXTOID)
 		gp_extract_feature_histogram_errout("the input types must be text[]");
 
+	dict = (feature_dictionary *) palloc0(sizeof(feature_dictionary));
+	dict->context = context;
+
 	get_typlenbyvalalign(TEXTOID, &elmlen, &elmbyval, &elmalign);
 	deconstruct_array(arr0, TEXTOID, elmlen, elmbyval, elmalign,
-					  &features, NULL, &num_features);
-	deconstruct_array(arr1, TEXTOID, elmlen, elmbyval, elmalign,
-					  &document, &null_words, &num_words);
+					  &features, NULL, &dict->num_features);
 
-	for (i = 0; i < num_features - 1; i++)
+	for (i = 0; i < dict->num_features - 1; i++)
 	{
 		int		cmp;
 
@@ -164,10 +249,88 @@ Datum gp_extract_feature_histogram(PG_FUNCTION_ARGS)
 					TextDatumGetCString(features[i + 1]));
 	}
 
-	returnval = classify_document(features, num_features,
-								  document, num_words, null_words);
+	/*
+	 * Words are matched by their bytes. This finds the same words as the
+	 * collation-aware comparison the dictionary is sorted by, since that
+	 * only reports two strings equal when their bytes are equal.
+	 */
+	dict->num_buckets = 1;
+	while (dict->num_buckets < 2 * dict->num_features)
+		dict->num_buckets <<= 1;
+	dict->buckets = (int *) palloc(sizeof(int) * dict->num_buckets);
+	memset(dict->buckets, -1, sizeof(int) * dict->num_buckets);
+	dict->entries = (feature_entry *)
+		palloc(sizeof(feature_entry) * dict->num_features);
+
+	for (i = 0; i < dict->num_features; i++)
+	{
+		text   *t = (text *) DatumGetPointer(features[i]);
+		feature_entry *entry = &dict->entries[i];
+		int		bucket;
+
+		entry->word = VARDATA_ANY(t);
+		entry->len = VARSIZE_ANY_EXHDR(t);
+		entry->hash = DatumGetUInt32(hash_any((unsigned char *) entry->word,
+											  entry->len));
+		entry->document = 0;
+		entry->count = 0;
+		bucket = entry->hash & (dict->num_buckets - 1);
+		entry->next = dict->buckets[bucket];
+		dict->buckets[bucket] = i;
+	}
 	pfree(features);
+
+#if PG_VERSION_NUM >= 90000
+	dict->stable = get_fn_expr_arg_stable(fcinfo->flinfo, 0);
+#else
+	dict->stable = false;
+#endif
+	if (!dict->stable)
+	{
+		dict->key = (char *) palloc(rawlen);
+		memcpy(dict->key, raw, rawlen);
+		dict->keylen = rawlen;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+	fcinfo->flinfo->fn_extra = dict;
+	return dict;
+}
+
+PG_FUNCTION_INFO_V1( gp_extract_feature_histogram );
+Datum gp_extract_feature_histogram(PG_FUNCTION_ARGS)
+{
+	SvecType   *returnval;
+	feature_dictionary *dict;
+	ArrayType  *arr1;
+	Datum	   *document;
+	int			num_words;
+	bool	   *null_words;
+	int16		elmlen;
+	bool		elmbyval;
+	char		elmalign;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	/* Error checking */
+	if (PG_NARGS() != 2)
+		gp_extract_feature_histogram_errout(
+			"gp_extract_feature_histogram called with wrong number of arguments");
+
+	dict = get_feature_dictionary(fcinfo);
+
+	arr1 = PG_GETARG_ARRAYTYPE_P(1);
+	if (ARR_ELEMTYPE(arr1) != TEXTOID)
+		gp_extract_feature_histogram_errout("the input types must be text[]");
+
+	get_typlenbyvalalign(TEXTOID, &elmlen, &elmbyval, &elmalign);
+	deconstruct_array(arr1, TEXTOID, elmlen, elmbyval, elmalign,
+					  &document, &null_words, &num_words);
+
+	returnval = classify_document(dict, document, num_words, null_words);
 	pfree(document);
+	pfree(null_words);
 
 	PG_RETURN_POINTER(returnval);
 }
@@ -181,42 +344,55 @@ gp_extract_feature_histogram_errout(char *msg) {
 }
 
 /*
- * The comparator for bsearch.
+ * Counts the dictionary words of a document and returns the counts as an
+ * svec. Only the features found are touched: the svec is built from their
+ * positions rather than from a dense array the size of the dictionary.
  */
-static int
-textdatum_cmp(const void *a, const void *b)
-{
-	return TextDatumCmp(*(Datum *) a, *(Datum *) b);
-}
-
 static SvecType *
-classify_document(Datum *features, int num_features,
+classify_document(feature_dictionary *dict,
 				  Datum *document, int num_words, bool *null_words)
 {
-	float8 * histogram = (float8 *)palloc0(sizeof(float8)*num_features);
+	feature_entry **found = (feature_entry **)
+		palloc(sizeof(feature_entry *) * (num_words + 1));
+	int64  *positions;
+	float8 *counts;
+	int		num_found = 0;
 	SvecType * output_sfv;
 	int i;
 
+	dict->document++;
 	for (i = 0; i < num_words; i++)
 	{
-		void   *found;
+		feature_entry *entry;
 
 		/* Skip if this word is NULL */
 		if (null_words[i])
 			continue;
-		found = bsearch(&document[i], features, num_features,
-						sizeof(Datum), textdatum_cmp);
-		if (found)
+		entry = feature_lookup(dict, document[i]);
+		if (entry == NULL)
+			continue;
+		if (entry->document != dict->document)
 		{
-			int		idx;
-
-			idx = ((uintptr_t) found - (uintptr_t) features) / sizeof(Datum);
-			histogram[idx]++;
+			entry->document = dict->document;
+			entry->count = 0;
+			found[num_found++] = entry;
 		}
+		entry->count++;
+	}
 
+	positions = (int64 *) palloc(sizeof(int64) * (num_found + 1));
+	counts = (float8 *) palloc(sizeof(float8) * (num_found + 1));
+	for (i = 0; i < num_found; i++)
+	{
+		positions[i] = (found[i] - dict->entries) + 1;
+		counts[i] = found[i]->count;
 	}
-	output_sfv = svec_from_float8arr(histogram, num_features);
-	pfree(histogram);
+	output_sfv = svec_from_sparsedata(
+		position_to_sdata(counts, positions, FLOAT8OID, num_found,
+						  dict->num_features, 0.), true);
+	pfree(found);
+	pfree(positions);
+	pfree(counts);
 
 	return output_sfv;
 }
@@ -48,7 +48,7 @@ double svec_svec_dot_product(SvecType *svec1, SvecType *svec2) {
 	SparseData right = sdata_from_svec(svec2);
 	
 	check_dimension(svec1,svec2,"svec_svec_dot_product");
-	return sum_sdata_values_double( op_sdata_by_sdata(multiply,left,right));
+	return dot_sdata_values_double(left,right);
 }
 
 /**
@@ -172,13 +172,17 @@ Datum svec_proj(PG_FUNCTION_ARGS)
 
 	SvecType * sv = PG_GETARG_SVECTYPE_P(0);
 	int idx = PG_GETARG_INT32(1);
+	SparseDataRuns runs = svec_runs_cached(fcinfo->flinfo,sv);
+	double ret;
 
-	SparseData in = sdata_from_svec(sv);
-	double ret = sd_proj(in,idx);
+	if (runs != NULL)
+		ret = sd_runs_proj(runs,idx);
+	else
+		ret = sd_proj(sdata_from_svec(sv),idx);
 
 	if (IS_NVP(ret)) PG_RETURN_NULL();
 
-	PG_RETURN_FLOAT8(sd_proj(in,idx));
+	PG_RETURN_FLOAT8(ret);
 }
 
 /**
@@ -194,6 +198,10 @@ Datum svec_subvec(PG_FUNCTION_ARGS)
 	SvecType * sv = PG_GETARG_SVECTYPE_P(0);
 	int start = PG_GETARG_INT32(1);
 	int end   = PG_GETARG_INT32(2);
+	SparseDataRuns runs = svec_runs_cached(fcinfo->flinfo,sv);
+
+	if (runs != NULL)
+		PG_RETURN_SVECTYPE_P(svec_from_sparsedata(subarr_runs(runs,start,end),true));
 
 	SparseData in = sdata_from_svec(sv);
 	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(subarr(in,start,end),true));
@@ -231,6 +239,7 @@ Datum svec_change(PG_FUNCTION_ARGS)
 	int inlen = indata->total_value_count;
 	int midlen = middle->total_value_count;
 	SparseData head = NULL, tail = NULL, ret = NULL;
+	SparseDataRuns runs = svec_runs_cached(fcinfo->flinfo,in);
 
 	Assert((IS_SCALAR(changed) && midlen == 1) ||
 		   (midlen == changed->dimension));
@@ -245,8 +254,10 @@ Datum svec_change(PG_FUNCTION_ARGS)
 			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 			 errmsg("Change vector is too long")));
 
-	if (idx >= 2) head = subarr(indata, 1, idx-1);
-	if (idx + midlen <= inlen) tail = subarr(indata,idx + midlen, inlen);
+	/* decode the index once for both ends */
+	if (runs == NULL) runs = sdata_runs_from_sdata(indata);
+	if (idx >= 2) head = subarr_runs(runs, 1, idx-1);
+	if (idx + midlen <= inlen) tail = subarr_runs(runs, idx + midlen, inlen);
 
 	if (head == NULL && tail == NULL)
 		ret = makeSparseDataCopy(middle);
@@ -565,6 +576,69 @@ Datum svec_div(PG_FUNCTION_ARGS)
 	PG_RETURN_SVECTYPE_P(result);
 }
 
+PG_FUNCTION_INFO_V1( __svec_elementwise_reference );
+/**
+ *  __svec_elementwise_reference (svec, svec, text):
+ *
+ *		Applies the operation given by '+', '-', '*' or '/' to two svecs
+ *		element by element, like svec_plus and friends, but always through
+ *		the type-generic loop op_sdata_by_sdata_generic(). This is the
+ *		reference the float8 kernels are tested against.
+ */
+Datum __svec_elementwise_reference(PG_FUNCTION_ARGS)
+{
+	SvecType *svec1 = PG_GETARG_SVECTYPE_P(0);
+	SvecType *svec2 = PG_GETARG_SVECTYPE_P(1);
+	char *opname = text_to_cstring(PG_GETARG_TEXT_P(2));
+	enum operation_t op;
+
+	if (strcmp(opname,"+") == 0)
+		op = add;
+	else if (strcmp(opname,"-") == 0)
+		op = subtract;
+	else if (strcmp(opname,"*") == 0)
+		op = multiply;
+	else if (strcmp(opname,"/") == 0)
+		op = divide;
+	else
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unknown elementwise operation \"%s\"", opname)));
+
+	check_dimension(svec1,svec2,"__svec_elementwise_reference");
+
+	/* the scalar cases have no kernels of their own */
+	if (IS_SCALAR(svec1) || IS_SCALAR(svec2))
+		PG_RETURN_SVECTYPE_P(op_svec_by_svec_internal(op,svec1,svec2));
+
+	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(
+		op_sdata_by_sdata_generic(op,sdata_from_svec(svec1),
+					  sdata_from_svec(svec2)),true));
+}
+
+/*
+ * Returns a SparseData with the runs of sdata, holding 1 where sdata has
+ * a non-zero value and 0 elsewhere (including NULLs). The index is shared
+ * with sdata.
+ */
+static SparseData sdata_nonzero_indicator(SparseData sdata)
+{
+	double *vals = (double *)(sdata->vals->data);
+	double *clamped_vals =
+		(double *)palloc0(sizeof(double)*(sdata->unique_value_count)+1);
+
+	for (int i=0;i<(sdata->unique_value_count);i++)
+	{
+		if (vals[i] != 0. && !IS_NVP(vals[i]))
+			clamped_vals[i] = 1.;
+	}
+	return makeInplaceSparseData(
+			(char *)clamped_vals,sdata->index->data,
+			sdata->vals->len,sdata->index->len,FLOAT8OID,
+			sdata->unique_value_count,
+			sdata->total_value_count);
+}
+
 PG_FUNCTION_INFO_V1( svec_count );
 /**
  *  svec_count - Count the number of non-zero entries in the input vector
@@ -587,9 +661,7 @@ Datum svec_count(PG_FUNCTION_ARGS)
 		if (left_vals[0] == 0)
 			left = makeSparseDataFromDouble(0.,right->total_value_count);
 	} 
-	double *right_vals=(double *)(right->vals->data);
 	SvecType *result;
-	double *clamped_vals;
 	SparseData right_clamped,sdata_result;
 
 	if (left->total_value_count != right->total_value_count)
@@ -598,28 +670,13 @@ Datum svec_count(PG_FUNCTION_ARGS)
 			 errmsg("Array dimension of inputs are not the same: dim1=%d, dim2=%d\n",
 				left->total_value_count, right->total_value_count)));
 	
-	/* Create an array of values either 1 or 0 depending on whether
-	 * the right vector has a non-zero value in it
-	 */
-	clamped_vals =
-		(double *)palloc0(sizeof(double)*(right->unique_value_count));
-		
-	for (int i=0;i<(right->unique_value_count);i++)
-	{
-		if (right_vals[i] != 0. && !IS_NVP(right_vals[i])) 
-			clamped_vals[i] = 1.;
-	}
-	right_clamped = makeInplaceSparseData(
-			     (char *)clamped_vals,right->index->data,
-			     right->vals->len,right->index->len,FLOAT8OID,
-			     right->unique_value_count,
-			     right->total_value_count);
+	right_clamped = sdata_nonzero_indicator(right);
 
 	/* Create the output SVEC */
 	sdata_result = op_sdata_by_sdata(add,left,right_clamped);
 	result = svec_from_sparsedata(sdata_result,true);
 		
-	pfree(clamped_vals);
+	pfree(right_clamped->vals->data);
 	pfree(right_clamped);
 		
 	PG_RETURN_SVECTYPE_P(result);
@@ -667,11 +724,10 @@ Datum svec_svec_l2norm(PG_FUNCTION_ARGS)
 	SvecType *svec2 = PG_GETARG_SVECTYPE_P(1);
 	
 	check_dimension(svec1,svec2,"l2norm");
-	SvecType *result = op_svec_by_svec_internal(subtract,svec1,svec2);
-	
-	SparseData sdata  = sdata_from_svec(result);
+	SparseData left  = sdata_from_svec(svec1);
+	SparseData right = sdata_from_svec(svec2);
 	double accum;
-	accum = l2norm_sdata_values_double(sdata);
+	accum = l2dist_sdata_values_double(left,right);
 	
 	if (IS_NVP(accum)) PG_RETURN_NULL();
 	
@@ -688,11 +744,10 @@ Datum svec_svec_l1norm(PG_FUNCTION_ARGS)
 	SvecType *svec2 = PG_GETARG_SVECTYPE_P(1);
 	
 	check_dimension(svec1,svec2,"l1norm");
-	SvecType *result = op_svec_by_svec_internal(subtract,svec1,svec2);
-	
-	SparseData sdata = sdata_from_svec(result);
+	SparseData left  = sdata_from_svec(svec1);
+	SparseData right = sdata_from_svec(svec2);
 	double accum;
-	accum = l1norm_sdata_values_double(sdata);
+	accum = l1dist_sdata_values_double(left,right);
 	
 	if (IS_NVP(accum)) PG_RETURN_NULL();
 	
@@ -969,9 +1024,11 @@ Datum svec_cast_float8arr(PG_FUNCTION_ARGS) {
 
 PG_FUNCTION_INFO_V1( svec_cast_positions_float8arr );
 /**
- *  svec_cast_positions_float8arr - turns a pair of arrays, the first an int4[]
+ *  svec_cast_positions_float8arr - turns a pair of arrays, the first an int8[]
  *    denoting positions and the second a float8[] denoting values, into an 
  *    svec of a given size with a given default value everywhere else.
+ *    The runs are built directly from the sorted positions, so this is the
+ *    way to bulk load sparse vectors without going through a dense array.
  */
 Datum svec_cast_positions_float8arr(PG_FUNCTION_ARGS) {
 	ArrayType *B_PG = PG_GETARG_ARRAYTYPE_P(0);
@@ -1021,17 +1078,17 @@ Datum svec_cast_positions_float8arr(PG_FUNCTION_ARGS) {
 	float8 *array = (float8 *)ARR_DATA_PTR(A_PG);
 	int64 *array_pos =  (int64 *)ARR_DATA_PTR(B_PG);
 	
-	if ((array_pos[dimension-1] > size)&&(size > 0))
-		ereport(ERROR,
-			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-			 errmsg("svec_cast_positions_float8arr some of the position values are larger than maximum array size declared")));	
-	
 	for(i=0;i < dimension;++i){
 		if(array_pos[i] <= 0){
 			ereport(ERROR,
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 				 errmsg("svec_cast_positions_float8arr only accepts position that are positive integers (x > 0)")));
 		}
+		if((array_pos[i] > size)&&(size > 0)){
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("svec_cast_positions_float8arr some of the position values are larger than maximum array size declared")));
+		}
 	}
 	
 	/* Create the output SVEC */
@@ -1216,14 +1273,11 @@ Datum float8arr_dot(PG_FUNCTION_ARGS) {
 	ArrayType *arr_right  = PG_GETARG_ARRAYTYPE_P(1);
 	SparseData left  = sdata_uncompressed_from_float8arr_internal(arr_left);
 	SparseData right = sdata_uncompressed_from_float8arr_internal(arr_right);
-	SparseData mult_result;
 	double accum;
 
-	mult_result = op_sdata_by_sdata(multiply,left,right);
-	accum = sum_sdata_values_double(mult_result);
+	accum = dot_sdata_values_double(left,right);
 	freeSparseData(left);
 	freeSparseData(right);
-	freeSparseDataAndData(mult_result);
 
 	if (IS_NVP(accum)) PG_RETURN_NULL();
 
@@ -1380,12 +1434,9 @@ svec_dot_float8arr(PG_FUNCTION_ARGS)
 	ArrayType *arr = PG_GETARG_ARRAYTYPE_P(1);
 	SparseData right = sdata_uncompressed_from_float8arr_internal(arr);
 	SparseData left = sdata_from_svec(svec);
-	SparseData mult_result;
 	double accum;
-	mult_result = op_sdata_by_sdata(multiply,left,right);
-	accum = sum_sdata_values_double(mult_result);
+	accum = dot_sdata_values_double(left,right);
 	freeSparseData(right);
-	freeSparseDataAndData(mult_result);
 
 	if (IS_NVP(accum)) PG_RETURN_NULL();
 
@@ -1399,12 +1450,9 @@ float8arr_dot_svec(PG_FUNCTION_ARGS)
 	SvecType *svec = PG_GETARG_SVECTYPE_P(1);
 	SparseData left = sdata_uncompressed_from_float8arr_internal(arr);
 	SparseData right = sdata_from_svec(svec);
-	SparseData mult_result;
 	double accum;
-	mult_result = op_sdata_by_sdata(multiply,left,right);
-	accum = sum_sdata_values_double(mult_result);
+	accum = dot_sdata_values_double(left,right);
 	freeSparseData(left);
-	freeSparseDataAndData(mult_result);
 
 	if (IS_NVP(accum)) PG_RETURN_NULL();
 
@@ -1434,41 +1482,18 @@ float8arr_hash(PG_FUNCTION_ARGS) {
 	PG_RETURN_INT32(float8arr_hash_internal(array));
 }
 
-PG_FUNCTION_INFO_V1( svec_pivot );
-/**
- * Aggregate function svec_pivot takes its float8 argument and appends it
- * to the state variable (an svec) to produce the concatenated return variable.
- * The StringInfo variables within the state variable svec are used in a way
- * that minimizes the number of memory re-allocations.
+/*
+ * Appends value to an svec under construction by svec_pivot, and returns
+ * the svec, which is only a new one if it had to grow.
  *
- * Note that the first time this is called, the state variable should be null.
+ * The StringInfos of the svec keep spare room, and the index cursor holds
+ * the offset of the last run count, so that an append neither copies the
+ * svec nor walks its index. When the room runs out the svec is reallocated
+ * at twice the size, which makes appends amortized O(1).
  */
-Datum svec_pivot(PG_FUNCTION_ARGS)
+static SvecType *svec_pivot_append(SvecType *svec, float8 value)
 {
-	SvecType *svec;
-	SparseData sdata;
-	float8 value;
-
-	if (PG_ARGISNULL(1)) value = NVP;
-	else value = PG_GETARG_FLOAT8(1);
-
-	if (! PG_ARGISNULL(0))
-	{
-		svec = PG_GETARG_SVECTYPE_P_COPY(0);
-	} else {	//first call, construct a new svec
-		/*
-		 * Allocate space for the unique values and index
-		 *
-		 * Note that we do this manually because we are going to
-		 * manage the memory allocations for the StringInfo structures
-		 * manually within this aggregate so that we can preserve
-		 * the intermediate state without re-serializing until there is
-		 * a need to re-alloc, at which point we will re-serialize to
-		 * form the returned state variable.
-		 */
-		svec = makeEmptySvec(1);
-	}
-	sdata = sdata_from_svec(svec);
+	SparseData sdata = sdata_from_svec(svec);
 
 	/*
 	 * Add the incoming float8 value to the svec.
@@ -1499,12 +1524,13 @@ Datum svec_pivot(PG_FUNCTION_ARGS)
 		if (sdata->index->len==0) //New vector
 		{
 			new_run=true;
-			index_location = sdata->index->data;
 			sdata->index->cursor = 0;
-			run_count = 0;
 		} else
 		{
-			// initialise index cursor if we need to
+			/*
+			 * Initialise the index cursor if we need to: a state that
+			 * did not come from svec_pivot, or that has a single run.
+			 */
 			if (sdata->index->cursor == 0) {
 				char *i_ptr=sdata->index->data;
 				int len=0;
@@ -1534,211 +1560,336 @@ Datum svec_pivot(PG_FUNCTION_ARGS)
 					- old_index_storage_size);
 			sdata->total_value_count++;
 		} else {
+			/* the count of the new run goes at the end of the index */
+			int new_cursor = sdata->index->len;
+
 			add_run_to_sdata((char *)(&value),1,sizeof(float8),sdata);
-			char *i_ptr=sdata->index->data;
-			int len=0;
-			for (int j=0;j<sdata->unique_value_count-1;j++)
-			{
-				len+=int8compstoragesize(i_ptr);
-				i_ptr+=int8compstoragesize(i_ptr);
-			}
-			sdata->index->cursor = len;
+			sdata->index->cursor = new_cursor;
 		}
 	}
 
-	PG_RETURN_SVECTYPE_P(svec);
+	return svec;
 }
 
-#define RANDOM_RANGE	drand48()
-#define RANDOM_INT(x,y)	((int)(x)+(int)(((y+1)-(x))*RANDOM_RANGE))
-#define SWAPVAL(x,y,temp)	{ (temp) = (x); (x) = (y); (y) = (temp); }
-#define SWAP(x,y,tmp,size)	{ memcpy((tmp),(x),(size)); memcpy((x),(y),(size)); memcpy((y),(tmp),(size)); }
-#define SWAPN(lists,nlists,widths,tmp,I,J) \
-{ \
-	for (uint64 III=0;III<nlists;III++) /* This should be unrolled as nlists will be small */ \
-	{ \
-	  	memcpy((tmp)[III]                  ,(lists)[III]+I*(widths)[III],(widths)[III]); \
-		memcpy((lists)[III]+I*(widths)[III],(lists)[III]+J*(widths)[III],(widths)[III]); \
-		memcpy((lists)[III]+J*(widths)[III],(tmp)[III]                  ,(widths)[III]); \
-	} \
-}
-/*
- * Implements the partition selection algorithm with randomized selection
- *
- * From: http://en.wikipedia.org/wiki/Selection_algorithm#Linear_general_selection_algorithm_-_.22Median_of_Medians_algorithm.22
- *
- * Arguments:
- * 	char **lists:	A list of lists, the first of which contains the 
- *                      values used for pivots, the 2nd and further lists 
- *                      will be pivoted alongside the first.
- * 			A common usage would be to have the first list point 
- *                      to an array of values, then the second would point to 
- *                      another char ** list of strings. The second list would 
- *                      have its pointer values moved around as part of the 
- *                      pivots, and the index location where the partition 
- *                      value (say for the median) occurs would allow a 
- *                      reference to the associated strings in the second list.
- *
- * 	size_t nlists	the number of lists
- *
- * 	size_t *widths	An array of widths, one for each list
- *
- * 	int left,right	The left and right boundary of the list to be pivoted
- *
- * 	int pivotIndex	The index around which to pivot the list.  A common 
- *                      use-case is to choose pivotIndex = listLength/2, then 
- *                      the pivot will provide the median location.
+PG_FUNCTION_INFO_V1( svec_pivot );
+/**
+ * Aggregate function svec_pivot takes its float8 argument and appends it
+ * to the state variable (an svec) to produce the concatenated return variable.
+ * The StringInfo variables within the state variable svec are used in a way
+ * that minimizes the number of memory re-allocations.
  *
- * 	int (*compar)	A comparison function for the first list, which takes 
- *                      two pointers to values in the first list and returns 
- *                      0,-1 or 1 when the first value is equal, less than or 
- *                      greater than the second.
+ * When called as an aggregate, the state is appended to in place rather
+ * than copied, so building an svec of n values takes O(n) time; the final
+ * function trims the spare room. Called as a plain function, the input svec
+ * is copied first.
  *
- * 	char **tmp 	A list of temporary variables, allocated with the size 
- *                      of the value in each list.
+ * Note that the first time this is called, the state variable should be null.
+ */
+Datum svec_pivot(PG_FUNCTION_ARGS)
+{
+	SvecType *svec;
+	float8 value;
+
+	if (PG_ARGISNULL(1)) value = NVP;
+	else value = PG_GETARG_FLOAT8(1);
+
+	if (PG_ARGISNULL(0))
+	{
+		/* first call, construct a new svec */
+		svec = makeEmptySvec(1);
+	} else if (fcinfo->context && IsA(fcinfo->context, AggState)) {
+		/* the state belongs to the aggregate, so it can be changed */
+		svec = PG_GETARG_SVECTYPE_P(0);
+	} else {
+		svec = PG_GETARG_SVECTYPE_P_COPY(0);
+	}
+
+	PG_RETURN_SVECTYPE_P(svec_pivot_append(svec,value));
+}
+
+PG_FUNCTION_INFO_V1( svec_pivot_positions );
+/**
+ *  svec_pivot_positions (svec, int4, int4):
  *
- * 	void *pvalue	Pointers to temporary variable allocated with the 
- *                      width of the values of the first list.
+ *		Transition function of an aggregate that makes an indicator svec
+ *		from a set of positions: appends the position to the state, which
+ *		is built as by svec_pivot and starts with the dimension given on
+ *		the first call. See svec_positions_final.
  */
-static int
-partition_pivot(char **lists, size_t nlists, size_t *widths,
-		int left, int right, int pivotIndex,
-		int (*compar)(const void *, const void *),
-		char **tmp, void *pvalue)
+Datum svec_pivot_positions(PG_FUNCTION_ARGS)
 {
-	int storeIndex = left;
+	SvecType *svec;
+	int position;
+	int dimension;
 
-	memcpy(pvalue,lists[0]+pivotIndex*widths[0],widths[0]);
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		PG_RETURN_SVECTYPE_P(PG_GETARG_SVECTYPE_P(0));
+	}
+	position = PG_GETARG_INT32(1);
 
-	SWAPN(lists,nlists,widths,tmp,pivotIndex,right) // Move pivot to end
-	for (int i=left;i<right;i++)
+	if (PG_ARGISNULL(0))
 	{
-		if (compar(lists[0]+i*widths[0],pvalue) <= 0)
+		if (PG_ARGISNULL(2) || PG_GETARG_INT32(2) < 1)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("svec dimension must be positive")));
+		svec = svec_pivot_append(makeEmptySvec(1),PG_GETARG_INT32(2));
+	} else if (fcinfo->context && IsA(fcinfo->context, AggState)) {
+		svec = PG_GETARG_SVECTYPE_P(0);
+	} else {
+		svec = PG_GETARG_SVECTYPE_P_COPY(0);
+	}
+
+	dimension = ((float8 *)SVEC_VALS_PTR(svec))[0];
+	if (position < 1 || position > dimension)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("Invalid start index")));
+
+	PG_RETURN_SVECTYPE_P(svec_pivot_append(svec,position));
+}
+
+PG_FUNCTION_INFO_V1( svec_positions_final );
+/**
+ *  svec_positions_final (svec):
+ *
+ *		Final function of svec_pivot_positions: returns an svec of the
+ *		dimension in the state with ones at the positions in the state and
+ *		zeros elsewhere.
+ */
+Datum svec_positions_final(PG_FUNCTION_ARGS)
+{
+	SvecType *state = PG_GETARG_SVECTYPE_P(0);
+	SparseData sdata = sdata_from_svec(state);
+	double *vals = (double *)sdata->vals->data;
+	char *ix = sdata->index->data;
+	int64 dimension = vals[0];
+	int64 *positions = (int64 *)palloc(sizeof(int64)*sdata->total_value_count);
+	double *ones = (double *)palloc(sizeof(double)*sdata->total_value_count);
+	int count = 0;
+
+	/* the first run starts with the dimension */
+	for (int i=0; i<sdata->unique_value_count; i++)
+	{
+		int64 run_len = compword_to_int8(ix) - (i == 0 ? 1 : 0);
+
+		for (int64 k=0; k<run_len; k++)
 		{
-			SWAPN(lists,nlists,widths,tmp,i,storeIndex)
-			storeIndex++;
+			positions[count] = vals[i];
+			ones[count] = 1.;
+			count++;
 		}
+		ix += int8compstoragesize(ix);
 	}
-	SWAPN(lists,nlists,widths,tmp,storeIndex,right) // Move pivot to its final place
-	return(storeIndex);
+
+	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(
+		position_to_sdata(ones,positions,FLOAT8OID,count,dimension,0.),true));
 }
 
+#define RANDOM_RANGE	drand48()
+#define RANDOM_INT(x,y)	((int)(x)+(int)(((y+1)-(x))*RANDOM_RANGE))
+#define SWAPVAL(x,y,temp)	{ (temp) = (x); (x) = (y); (y) = (temp); }
+
 /*
- * The call interface to partition_select has one complicated looking feature:
- * you must pass in a "Real Index Calculation" function that will return an 
- * integer corresponding to the actual partition index. This is used to 
- * enable the same routine to work with dense and compressed structures. 
- * This function can just return the input integer unmodified if using a 
- * dense array of values as input.
- * The arguments to realIndexCalc() should be:
- * 	int: 		the pivot index (returned from the pivot function)
- * 	char **:	the list of lists
- * 	size_t:		the number of lists
- * 	size_t *:	the width of each value in the list
+ * A value and the number of times it occurs: a run of an svec, or a single
+ * element of a float8[].
  */
-static int
-partition_select (char **lists, size_t nlists, size_t *widths,
-		int left, int right, int k,
-		int (*compar)(const void *, const void *),
-		int (*realIndexCalc)(const int, const char **, const size_t, const size_t *))
+typedef struct
 {
-	int pivotIndex,pivotNewIndex,realIndex;
-	char **tmp,*pvalue;
-	int maxlen = right;
+	float8 val;
+	int64 count;
+} weighted_value;
 
-	/*
-	 * Allocate memory for the temporary variables
-	 */
-	tmp = (char **)palloc(nlists*sizeof(char *));
-	for (uint64 i=0;i<nlists;i++)
-	{
-		tmp[i] = (void *)palloc(widths[i]);
-	}
-	pvalue = (char *)palloc(widths[0]);
+/*
+ * Orders float8s the way float8 comparisons in SQL do, with NaNs equal to
+ * each other and above everything else, so that selection terminates.
+ */
+static inline int
+float8_order(float8 left, float8 right)
+{
+	if (isnan(left))
+		return isnan(right) ? 0 : 1;
+	if (isnan(right))
+		return -1;
+	return (left > right) - (left < right);
+}
 
-	while (1)
+/*
+ * Finds several order statistics of a multiset given as weighted values,
+ * by a randomized quickselect that works on the weighted values rather than
+ * on the elements, so that it takes expected O(n log nk) time for n
+ * weighted values, however many elements they stand for.
+ *
+ * Arguments:
+ * 	weighted_value *items	The weighted values, reordered in place
+ * 	int n			The number of weighted values
+ * 	int64 offset		The number of elements that sort before the
+ * 				items, zero for the whole multiset
+ * 	int64 *ks		The zero-based ranks to find, in ascending
+ * 				order and among the items
+ * 	float8 *out		Where the value of each rank is stored
+ * 	int nk			The number of ranks
+ *
+ * Each step partitions the items three ways around a random pivot, hands
+ * the ranks that fall before or after the pivot's elements to the two
+ * sides, and answers the ranks that fall among them with the pivot.
+ */
+static void
+weighted_select(weighted_value *items, int n, int64 offset,
+		int64 *ks, float8 *out, int nk)
+{
+	while (nk > 0)
 	{
-		pivotIndex = RANDOM_INT(left,right);
-		pivotNewIndex = partition_pivot(lists,nlists,widths,
-					left,right,pivotIndex,
-					compar,
-					tmp,pvalue);
-		realIndex = realIndexCalc(pivotNewIndex,
-				(const char **)lists,nlists,widths);
-		int nextRealIndex = realIndexCalc(Min(maxlen,pivotNewIndex+1),
-	                                (const char **)lists,nlists,widths);
-
-		if ((realIndex <= k) && (k < nextRealIndex ))
-		{
-			break;
-		} else if (k < realIndex)
+		float8 pivot = items[RANDOM_INT(0,n-1)].val;
+		int lt = 0, gt = n;
+		int64 lt_count = 0, eq_count = 0;
+		weighted_value tmp;
+		int i, nlt, neq;
+
+		/* items[0,lt) < pivot, items[lt,i) == pivot, items[gt,n) > pivot */
+		i = 0;
+		while (i < gt)
 		{
-			right = pivotNewIndex-1;
-		} else
+			int cmp = float8_order(items[i].val,pivot);
+
+			if (cmp < 0) {
+				lt_count += items[i].count;
+				SWAPVAL(items[i],items[lt],tmp);
+				lt++;
+				i++;
+			} else if (cmp > 0) {
+				gt--;
+				SWAPVAL(items[i],items[gt],tmp);
+			} else {
+				eq_count += items[i].count;
+				i++;
+			}
+		}
+
+		for (nlt = 0; nlt < nk && ks[nlt] - offset < lt_count; nlt++)
+			;
+		for (neq = nlt; neq < nk && ks[neq] - offset < lt_count + eq_count; neq++)
+			out[neq] = pivot;
+
+		/*
+		 * Loop on one side, recursing only when both have ranks to
+		 * find; that happens at most nk-1 times, which bounds the depth.
+		 */
+		if (nlt > 0)
 		{
-			left = pivotNewIndex+1;
-			if (left >= maxlen) 
+			if (neq == nk)
 			{
-				pivotNewIndex = maxlen;
-				break;
+				n = lt;
+				nk = nlt;
+				continue;
 			}
+			weighted_select(items,lt,offset,ks,out,nlt);
 		}
+		items += gt;
+		n -= gt;
+		ks += neq;
+		out += neq;
+		nk -= neq;
+		offset += lt_count + eq_count;
 	}
-	/*
-	 * Free temporary variables
-	 */
-	for (uint64 i=0;i<nlists;i++)
-		pfree(tmp[i]);
-	pfree(tmp);
-	pfree(pvalue);
-
-	return(pivotNewIndex); //This index is in the compressed coordinate system
 }
 
-static int
-compar_float8(const void *left,const void *right)
+/*
+ * Returns the runs of a SparseData as weighted values; a dense SparseData
+ * gives each element a count of one.
+ */
+static weighted_value *
+sdata_weighted_values(SparseData sdata)
 {
-	if (*(float8 *)left<*(float8 *)right) { return -1; }
-	else if(*(float8 *)left==*(float8 *)right) { return 0; }
-	else { return 1; }
-}
+	weighted_value *items = (weighted_value *)
+		palloc(sizeof(weighted_value)*Max(sdata->unique_value_count,1));
+	double *vals = (double *)sdata->vals->data;
+	char *ix = sdata->index->data;
 
-static int
-real_index_calc_dense(const int idx,const char **lists,const size_t nlists,const size_t *widths)
-{
-	(void) lists; /* avoid warning about unused parameter */
-	(void) nlists; /* avoid warning about unused parameter */
-	(void) widths; /* avoid warning about unused parameter */
-	return idx;
+	for (int i=0; i<sdata->unique_value_count; i++)
+	{
+		items[i].val = vals[i];
+		items[i].count = compword_to_int8(ix);
+		ix += int8compstoragesize(ix);
+	}
+	return items;
 }
 
-static int
-real_index_calc_sparse_RLE(const int idx,const char **lists,const size_t nlists,const size_t *widths)
+/*
+ * Computes the values at the given fractions of the sorted elements of a
+ * SparseData: the element at zero-based position floor(q*(n-1)) for each
+ * fraction q, so that 0.5 gives the (lower) median. Returns false if the
+ * SparseData has no elements or contains a NULL.
+ */
+static bool
+sdata_quantiles(SparseData sdata, float8 *fractions, float8 *out, int nq)
 {
-	(void) nlists; /* avoid warning about unused parameter */
-	(void) widths; /* avoid warning about unused parameter */
-	int index=0;
-	for (int i=0;i<idx;i++)
+	double *vals = (double *)sdata->vals->data;
+	weighted_value *items;
+	int64 *ks;
+	int *order;
+	float8 *sorted_out;
+
+	if (sdata->total_value_count == 0)
+		return false;
+	for (int i=0; i<sdata->unique_value_count; i++)
+		if (IS_NVP(vals[i]))
+			return false;
+
+	/* sort the ranks, remembering where each one came from */
+	ks = (int64 *)palloc(sizeof(int64)*nq);
+	order = (int *)palloc(sizeof(int)*nq);
+	sorted_out = (float8 *)palloc(sizeof(float8)*nq);
+	for (int i=0; i<nq; i++)
 	{
-		index = index + ((int64 *)(lists[1]))[i];
+		int64 k;
+		int j;
+
+		if (IS_NVP(fractions[i]) || !(fractions[i] >= 0. && fractions[i] <= 1.))
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("quantile fractions must be between 0 and 1")));
+		k = (int64)floor(fractions[i]*(sdata->total_value_count-1));
+		for (j=i; j>0 && ks[j-1] > k; j--)
+		{
+			ks[j] = ks[j-1];
+			order[j] = order[j-1];
+		}
+		ks[j] = k;
+		order[j] = i;
 	}
-	/*
-	 * The index calculation corresponds to the beginning
-	 * of the run located at (idx).
-	 */
-	return (index);
+
+	items = sdata_weighted_values(sdata);
+	weighted_select(items,sdata->unique_value_count,0,ks,sorted_out,nq);
+	for (int i=0; i<nq; i++)
+		out[order[i]] = sorted_out[i];
+
+	pfree(items);
+	pfree(ks);
+	pfree(order);
+	pfree(sorted_out);
+	return true;
 }
 
-static int
-float8arr_partition_internal(float8 *array,int len,int k)
+/*
+ * Computes the quantiles of an svec at the fractions in a float8 array,
+ * and returns them as a float8 array, or NULL.
+ */
+static ArrayType *
+sdata_quantiles_array(SparseData sdata, ArrayType *fractions_array)
 {
-	size_t width=sizeof(float8);
-	char *list = (char *)array;
-	int index = partition_select(&list,1,&width,
-				0,len-1,
-			   	k,compar_float8,
-				real_index_calc_dense);
-	return (index);
+	SparseData fractions = sdata_uncompressed_from_float8arr_internal(fractions_array);
+	int nq = fractions->total_value_count;
+	float8 *result = (float8 *)palloc(sizeof(float8)*Max(nq,1));
+
+	if (!sdata_quantiles(sdata,(float8 *)fractions->vals->data,result,nq))
+		return NULL;
+	return construct_array((Datum *)result,
+			       nq, FLOAT8OID,
+			       sizeof(float8),true,'d');
 }
 
 /**
@@ -1750,27 +1901,20 @@ PG_FUNCTION_INFO_V1( float8arr_median);
 
 Datum
 float8arr_median(PG_FUNCTION_ARGS) {
-	ArrayType *array  = PG_GETARG_ARRAYTYPE_P_COPY(0);
+	ArrayType *array  = PG_GETARG_ARRAYTYPE_P(0);
 	SparseData sdata = sdata_uncompressed_from_float8arr_internal(array);
-	int index,median_index = (sdata->total_value_count-1)/2;
-	float8 ret;
-
-	double * vals = (double *)(sdata->vals->data); 
-	for (int i=0; i<sdata->unique_value_count; i++)
-		if (IS_NVP(vals[i])) 
-			PG_RETURN_NULL();
-
-	index = float8arr_partition_internal((double *)(sdata->vals->data),
-					     sdata->total_value_count,
-					     median_index);
+	float8 half = 0.5, ret;
 
-	ret = ((float8 *)(sdata->vals->data))[index];
-	if (IS_NVP(ret)) PG_RETURN_NULL();
+	if (!sdata_quantiles(sdata,&half,&ret,1))
+		PG_RETURN_NULL();
 	PG_RETURN_FLOAT8(ret);
 }
 
 /**
  * Computes the median of a sparse vector
+ *
+ * The selection works on the runs of the svec, so that it costs time in
+ * proportion to the number of runs rather than to the dimension.
  */
 Datum svec_median(PG_FUNCTION_ARGS);
 
@@ -1778,66 +1922,52 @@ PG_FUNCTION_INFO_V1( svec_median);
 
 Datum
 svec_median(PG_FUNCTION_ARGS) {
-	SvecType *svec  = PG_GETARG_SVECTYPE_P_COPY(0);
+	SvecType *svec  = PG_GETARG_SVECTYPE_P(0);
 	SparseData sdata = sdata_from_svec(svec);
-	int index,median_index = (sdata->total_value_count-1)/2;
-	char *i_ptr;
-	int64 *rle_index;
-	float8 ret;
+	float8 half = 0.5, ret;
 
-	float8 * vals = (float8 *)sdata->vals->data;
-	for (int i=0; i<sdata->unique_value_count; i++)
-		if (IS_NVP(vals[i]))
-			PG_RETURN_NULL();
+	if (!sdata_quantiles(sdata,&half,&ret,1))
+		PG_RETURN_NULL();
+	PG_RETURN_FLOAT8(ret);
+}
 
-	if (sdata->index->data != NULL) //Sparse vector
-	{
-		/*
-	 	 * We need to create an uncompressed run length index to
-	 	 * feed to the partition select routine
-	 	 */
-		rle_index = (int64 *)palloc(sizeof(int64)*(sdata->unique_value_count));
-		i_ptr = sdata->index->data;
-		for (int i=0;i<sdata->unique_value_count;i++,i_ptr+=int8compstoragesize(i_ptr))
-		{
-			rle_index[i] = compword_to_int8(i_ptr);
-		}
-		/*
-		 * Allocate the outer "list of lists"
-		 */
-		char **lists = (char **)palloc(sizeof(char *)*2);
-		lists[0] = sdata->vals->data;
-		lists[1] = (char *)rle_index;
-		size_t *widths = (size_t *)palloc(sizeof(size_t)*2);
-		widths[0] = sizeof(float8);
-		widths[1] = sizeof(int64);
-		index = partition_select(lists,2,widths,
-					0,sdata->unique_value_count-1,
-			   		median_index,compar_float8,
-					real_index_calc_sparse_RLE);
-		/*
-		 * Convert the uncompressed index into the compressed index
-		 */
-		i_ptr = sdata->index->data;
-		for (int i=0;i<sdata->unique_value_count;i++,i_ptr+=int8compstoragesize(i_ptr))
-		{
-			int8_to_compword(rle_index[i],i_ptr);
-		}
+/**
+ * Computes several quantiles of an array of float8s in one pass
+ */
+Datum float8arr_quantiles(PG_FUNCTION_ARGS);
 
-		pfree(lists);
-		pfree(widths);
-		pfree(rle_index);
-	} else
-	{
-		index = float8arr_partition_internal((double *)(sdata->vals->data),
-				sdata->total_value_count,
-				median_index);
-	}
+PG_FUNCTION_INFO_V1( float8arr_quantiles);
 
-	ret = ((float8 *)(sdata->vals->data))[index];
+Datum
+float8arr_quantiles(PG_FUNCTION_ARGS) {
+	ArrayType *array  = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType *result = sdata_quantiles_array(
+		sdata_uncompressed_from_float8arr_internal(array),
+		PG_GETARG_ARRAYTYPE_P(1));
 
-	if (IS_NVP(ret)) PG_RETURN_NULL();
-	PG_RETURN_FLOAT8(ret);
+	if (result == NULL)
+		PG_RETURN_NULL();
+	PG_RETURN_ARRAYTYPE_P(result);
+}
+
+/**
+ * Computes several quantiles of a sparse vector in one pass: the element
+ * at zero-based position floor(q*(n-1)) of the sorted elements, for each
+ * fraction q, so that a fraction of 0.5 gives svec_median.
+ */
+Datum svec_quantiles(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1( svec_quantiles);
+
+Datum
+svec_quantiles(PG_FUNCTION_ARGS) {
+	SvecType *svec  = PG_GETARG_SVECTYPE_P(0);
+	ArrayType *result = sdata_quantiles_array(sdata_from_svec(svec),
+						  PG_GETARG_ARRAYTYPE_P(1));
+
+	if (result == NULL)
+		PG_RETURN_NULL();
+	PG_RETURN_ARRAYTYPE_P(result);
 }
 
 Datum svec_nonbase_positions(PG_FUNCTION_ARGS);
@@ -1859,7 +1989,7 @@ svec_nonbase_positions(PG_FUNCTION_ARGS) {
 	
 	float8 * vals = (float8 *)sdata->vals->data;
 	
-	if (sdata->index->data != NULL) //Sparse vector
+	/* compword_to_int8(NULL) is 1, so this covers dense svecs too */
 	{
 		/*
 	 	 * We need to create an uncompressed run length index to
@@ -1918,7 +2048,7 @@ svec_nonbase_values(PG_FUNCTION_ARGS) {
 	
 	float8 * vals = (float8 *)sdata->vals->data;
 	
-	if (sdata->index->data != NULL) //Sparse vector
+	/* compword_to_int8(NULL) is 1, so this covers dense svecs too */
 	{
 		/*
 	 	 * We need to create an uncompressed run length index to
@@ -1982,162 +2112,247 @@ Datum svec_hash( PG_FUNCTION_ARGS)
 	PG_RETURN_INT32(hash);
 }
 
+/*
+ * Aggregates over svecs: svec_sum, svec_count_nonzero and mean
+ *
+ * All three keep an svec as their state. The mean state carries the
+ * number of rows as an extra last element, so partial states of any of
+ * them are combined by adding them (svec_agg_merge). While the state is
+ * sparse, each row is merged into it run by run, which builds a new state
+ * the size of the old one. Once the state has more than one run per
+ * SVEC_AGG_DENSE_RATIO elements, that no longer pays: the state is
+ * switched to a dense svec, and rows are then added to it in place. A
+ * dense state may hold equal neighbours, so the final functions compress
+ * it.
+ */
+#define SVEC_AGG_DENSE_RATIO 4
+
+/*
+ * Returns a dense svec holding the elements of sdata. Equal neighbours
+ * are not merged, so that the svec can be added to in place.
+ */
+static SvecType *svec_agg_dense(SparseData sdata)
+{
+	int count = sdata->total_value_count;
+	double *vals = (double *)palloc(sizeof(float8)*count+1);
+	double *run_vals = (double *)sdata->vals->data;
+	char *ix = sdata->index->data;
+	int pos = 0;
+	SparseData dense;
+	SvecType *result;
+
+	for (int i=0; i<sdata->unique_value_count; i++)
+	{
+		int end = pos + compword_to_int8(ix);
+
+		for (int k=pos; k<end; k++)
+			vals[k] = run_vals[i];
+		pos = end;
+		ix += int8compstoragesize(ix);
+	}
+	((char *)vals)[count*sizeof(float8)] = '\0';
+
+	dense = makeInplaceSparseData((char *)vals,NULL,count*sizeof(float8),0,
+				      FLOAT8OID,count,count);
+	result = svec_from_sparsedata(dense,true);
+	pfree(vals);
+	pfree(dense);
+	return result;
+}
+
+/*
+ * Adds x to the state of an svec aggregate, followed by a one for the row
+ * count if count_row is set. When called as an aggregate, a dense state is
+ * updated in place; otherwise a new state is returned.
+ */
+static SvecType *svec_agg_add(FunctionCallInfo fcinfo, SvecType *state,
+			      SparseData x, bool count_row)
+{
+	SparseData sdata = sdata_from_svec(state);
+	SparseData sum;
+
+	if (sdata->total_value_count != x->total_value_count + (count_row ? 1 : 0))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("%s: input dimensions should be the same, but are: dim1=%d, dim2=%d\n",
+				"svec aggregate",
+				sdata->total_value_count - (count_row ? 1 : 0),
+				x->total_value_count)));
+
+	if (SDATA_IS_DENSE(sdata) &&
+	    fcinfo->context && IsA(fcinfo->context, AggState))
+	{
+		double *vals = (double *)sdata->vals->data;
+		double *x_vals = (double *)x->vals->data;
+		char *ix = x->index->data;
+		int pos = 0;
+
+		for (int i=0; i<x->unique_value_count; i++)
+		{
+			int end = pos + compword_to_int8(ix);
+
+			/*
+			 * Runs of zeros are skipped. That only makes a difference
+			 * to an element summing to -0, which stays -0 instead of
+			 * becoming 0.
+			 */
+			if (x_vals[i] != 0.)
+				for (int k=pos; k<end; k++)
+					vals[k] += x_vals[i];
+			pos = end;
+			ix += int8compstoragesize(ix);
+		}
+		if (count_row)
+			vals[pos] += 1;
+		return state;
+	}
+
+	if (count_row)
+		x = concat(x,makeSparseDataFromDouble(1.,1));
+	sum = op_sdata_by_sdata(add,sdata,x);
+	if (sum->unique_value_count > sum->total_value_count/SVEC_AGG_DENSE_RATIO)
+		return svec_agg_dense(sum);
+	return svec_from_sparsedata(sum,true);
+}
+
+PG_FUNCTION_INFO_V1( svec_sum_transition );
 /**
- *  svec_mean_transition (float8arr, svec):
+ *  svec_sum_transition (svec, svec):
  *
- *		Accumulates svec's by adding them elementwise and incrementing 
- *      the last element of the state array.
+ *		Adds an svec to the state of svec_sum. The initial state is the
+ *		scalar zero, which is broadcast as by svec_plus.
+ */
+Datum svec_sum_transition(PG_FUNCTION_ARGS)
+{
+	SvecType *state = PG_GETARG_SVECTYPE_P(0);
+	SvecType *svec  = PG_GETARG_SVECTYPE_P(1);
+
+	if (IS_SCALAR(state) || IS_SCALAR(svec))
+		PG_RETURN_SVECTYPE_P(op_svec_by_svec_internal(add,state,svec));
+
+	PG_RETURN_SVECTYPE_P(svec_agg_add(fcinfo,state,sdata_from_svec(svec),false));
+}
+
+PG_FUNCTION_INFO_V1( svec_count_nonzero_transition );
+/**
+ *  svec_count_nonzero_transition (svec, svec):
  *
+ *		Adds one to the state of svec_count_nonzero wherever an svec is
+ *		nonzero, as svec_count does. The initial state is the scalar zero.
  */
+Datum svec_count_nonzero_transition(PG_FUNCTION_ARGS)
+{
+	SvecType *state = PG_GETARG_SVECTYPE_P(0);
+	SvecType *svec  = PG_GETARG_SVECTYPE_P(1);
+
+	if (IS_SCALAR(state) || IS_SCALAR(svec))
+		return svec_count(fcinfo);
+
+	PG_RETURN_SVECTYPE_P(svec_agg_add(fcinfo,state,
+		sdata_nonzero_indicator(sdata_from_svec(svec)),false));
+}
+
 PG_FUNCTION_INFO_V1( svec_mean_transition );
+/**
+ *  svec_mean_transition (svec, svec):
+ *
+ *		Accumulates svec's by adding them elementwise, and counts them in
+ *		an extra last element of the state.
+ */
 Datum svec_mean_transition(PG_FUNCTION_ARGS)
 {
 	/* Validate input*/
-	if (PG_ARGISNULL(0) && PG_ARGISNULL(1)) 
-		PG_RETURN_NULL();	
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
+		PG_RETURN_NULL();
 
-	if (PG_ARGISNULL(1)) 
-		PG_RETURN_ARRAYTYPE_P(PG_GETARG_ARRAYTYPE_P(0));	
+	if (PG_ARGISNULL(1))
+		PG_RETURN_SVECTYPE_P(PG_GETARG_SVECTYPE_P(0));
 
-	/* Get ARG(1) and convert it into float8 array */
 	SvecType *svec = PG_GETARG_SVECTYPE_P(1);
-	SparseData sdata = sdata_from_svec( svec);
-	int svec_dim = sdata->total_value_count;
-	float8 *svec_array = sdata_to_float8arr( sdata);	
-	
+	SparseData sdata = sdata_from_svec(svec);
+
 	if (PG_ARGISNULL(0)) {
-		/* 
-		 * This is the first call, so create new state array
+		/*
+		 * This is the first call, so the state is the svec followed by
+		 * a count of one
 		 */
-		float8 *state_array;
-		state_array = (float8 *) palloc((svec_dim+1) * sizeof(float8));
-		for (int i=0; i<svec_dim; i++) {
-			state_array[i] = svec_array[i];
-		}
-		state_array[svec_dim] = 1;
-		ArrayType *out_array = construct_array((Datum *)state_array,
-						svec_dim+1, FLOAT8OID,
-						sizeof(float8),true,'d');
-
-		PG_RETURN_ARRAYTYPE_P(out_array);
+		SparseData state = concat(sdata,makeSparseDataFromDouble(1.,1));
+		PG_RETURN_SVECTYPE_P(svec_from_sparsedata(state,true));
 	}
 
-	/* Read the state */	
-	ArrayType *transarray; 	
-	if (fcinfo->context && IsA(fcinfo->context, AggState))
-		transarray = PG_GETARG_ARRAYTYPE_P(0);
-	else
-		transarray = PG_GETARG_ARRAYTYPE_P_COPY(0);	
-
-	/* Extract state array */
-	int state_dim = ARR_DIMS(transarray)[0];
-	float8 *state_array = (float8 *) ARR_DATA_PTR(transarray);
-
-	/* Check dimensions on both inputs */
-	if ( state_dim != (svec_dim+1)) 
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("%s: input dimensions should be dim1=dim2+1, but are: dim1=%d, dim2=%d\n",
-						"svec_mean_transition", state_dim, svec_dim)));
-	
-	/* Transition */
-	for (int i=0; i<svec_dim; i++) {
-		state_array[i] = state_array[i] + svec_array[i];
-	}
-	state_array[svec_dim]++;
-	
-	PG_RETURN_ARRAYTYPE_P(transarray);
-	
+	PG_RETURN_SVECTYPE_P(svec_agg_add(fcinfo,PG_GETARG_SVECTYPE_P(0),sdata,true));
 }
 
+PG_FUNCTION_INFO_V1( svec_agg_merge );
 /**
- *  svec_mean_prefunc (float8arr, float8arr):
- *
- *		Preliminary merge function
+ *  svec_agg_merge (svec, svec):
  *
+ *		Preliminary merge function of the svec_sum, svec_count_nonzero
+ *		and mean aggregates: adds two partial states, without making
+ *		sparse ones dense.
  */
-PG_FUNCTION_INFO_V1( svec_mean_prefunc );
-Datum svec_mean_prefunc( PG_FUNCTION_ARGS)
-{	
+Datum svec_agg_merge(PG_FUNCTION_ARGS)
+{
 	/* Validate input*/
-	if (PG_ARGISNULL(0) && PG_ARGISNULL(1)) 
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
 		PG_RETURN_NULL();
 
-	if (PG_ARGISNULL(0)) 
-		PG_RETURN_ARRAYTYPE_P(PG_GETARG_ARRAYTYPE_P(1));
+	if (PG_ARGISNULL(0))
+		PG_RETURN_SVECTYPE_P(PG_GETARG_SVECTYPE_P(1));
 
-	if (PG_ARGISNULL(1)) 
-		PG_RETURN_ARRAYTYPE_P(PG_GETARG_ARRAYTYPE_P(0));
+	if (PG_ARGISNULL(1))
+		PG_RETURN_SVECTYPE_P(PG_GETARG_SVECTYPE_P(0));
 
-	/* Read the arguments */
-	ArrayType *transarray1, *transarray2; 	
-	if (fcinfo->context && IsA(fcinfo->context, AggState)) {
-		transarray1 = PG_GETARG_ARRAYTYPE_P(0);
-		transarray2 = PG_GETARG_ARRAYTYPE_P(1);
-	} else {
-		transarray1 = PG_GETARG_ARRAYTYPE_P_COPY(0);
-		transarray2 = PG_GETARG_ARRAYTYPE_P_COPY(1);
-	}
+	SvecType *state1 = PG_GETARG_SVECTYPE_P(0);
+	SvecType *state2 = PG_GETARG_SVECTYPE_P(1);
 
-	/* Define the arrays */
-	float8 *array1 = (float8 *)ARR_DATA_PTR(transarray1);
-	int dim1 = ARR_DIMS(transarray1)[0];
-	float8 *array2 = (float8 *)ARR_DATA_PTR(transarray2);
-	int dim2 = ARR_DIMS(transarray2)[0];
-	
-	/* Check dimensions */
-	if ( dim1 != dim2) 
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("%s: input dimensions should be the same, but are: dim1=%d, dim2=%d\n",
-						"svec_mean_prefunc", dim1, dim2)));	
-	
-	/* Add */
-	for (int i=0; i<dim1; i++) {
-		array1[i] = array1[i] + array2[i];
-	}
-	
-	PG_RETURN_ARRAYTYPE_P(transarray1);
-	
+	/* The scalar zero is where svec_sum and svec_count_nonzero start */
+	if (IS_SCALAR(state1) || IS_SCALAR(state2))
+		PG_RETURN_SVECTYPE_P(op_svec_by_svec_internal(add,state1,state2));
+
+	PG_RETURN_SVECTYPE_P(svec_agg_add(fcinfo,state1,sdata_from_svec(state2),false));
 }
 
+PG_FUNCTION_INFO_V1( svec_agg_final );
 /**
- *  svec_mean_final (float8arr):
- *
- *		Divides all elements of the array by its last element
- *		and returns n-1 element SVEC 
+ *  svec_agg_final (svec):
  *
+ *		Final function of the svec_sum, svec_count_nonzero and svec_agg
+ *		aggregates: returns the state with equal neighbouring elements
+ *		merged, and without the spare room svec_pivot keeps.
  */
+Datum svec_agg_final(PG_FUNCTION_ARGS)
+{
+	SvecType *state = PG_GETARG_SVECTYPE_P(0);
+	SparseData sdata = compress_sdata(sdata_from_svec(state));
+
+	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(sdata,true));
+}
+
 PG_FUNCTION_INFO_V1( svec_mean_final );
-Datum svec_mean_final( PG_FUNCTION_ARGS)
+/**
+ *  svec_mean_final (svec):
+ *
+ *		Divides all elements of the state by its last element
+ *		and returns n-1 element SVEC
+ *
+ */
+Datum svec_mean_final(PG_FUNCTION_ARGS)
 {
 	/* Validate state input*/
 	if PG_ARGISNULL(0) {
 		PG_RETURN_NULL();
 	}
 
-	SvecType *svec;
-	ArrayType *transarray; 	
-	
-	/* Read the argument */
-	if (fcinfo->context && IsA(fcinfo->context, AggState))
-		transarray = PG_GETARG_ARRAYTYPE_P(0);
-	else
-		transarray = PG_GETARG_ARRAYTYPE_P_COPY(0);
-
-	/* Define the array */
-	float8 *array = (float8 *)ARR_DATA_PTR(transarray);
-	int dim = ARR_DIMS(transarray)[0];
+	SvecType *state = PG_GETARG_SVECTYPE_P(0);
+	SparseData sdata = sdata_from_svec(state);
+	int dim = sdata->total_value_count - 1;
+	float8 count = sd_proj(sdata,sdata->total_value_count);
+	SparseData mean = subarr(sdata,1,dim);
 
 	/* Divide */
-	for (int i=0; i<dim-1; i++) {
-		array[i] = array[i] / array[dim-1];
-	}
-	
-	/* Create the output SVEC */
-	SparseData sdata = float8arr_to_sdata(array,dim-1);
-	svec = svec_from_sparsedata(sdata,true);
-	
-	PG_RETURN_SVECTYPE_P(svec);
+	op_sdata_by_scalar_inplace(divide,(char *)&count,mean,true);
 
+	/* Create the output SVEC */
+	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(compress_sdata(mean),true));
 }
@@ -6,4 +6,6 @@ Datum svec_svec_l2norm(PG_FUNCTION_ARGS);
 Datum svec_svec_angle(PG_FUNCTION_ARGS);
 Datum svec_svec_tanimoto_distance(PG_FUNCTION_ARGS);
 
+void check_dimension(SvecType *svec1, SvecType *svec2, char *msg);
+
 #endif
@@ -0,0 +1,448 @@
+/**
+ * @file
+ * \brief Sparse matrices in compressed sparse row (CSR) form, built by
+ * aggregating svec rows or (row, column, value) triples, and their product
+ * with a vector.
+ *
+ * A matrix is kept as a bytea, as the sketches are: the aggregates collect
+ * coordinates, and their final function sorts them into CSR form once.
+ * svec_spmv() then multiplies the matrix with a float8[] in a single call,
+ * which lets iterative solvers such as conjugate gradient hold the matrix
+ * in a variable instead of scanning a table of rows at every iteration.
+ */
+
+#include <postgres.h>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "catalog/pg_type.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "nodes/execnodes.h"
+
+#include "sparse_vector.h"
+
+/*
+ * An element of a matrix under construction. Rows and columns are one-based.
+ */
+typedef struct
+{
+	int64 row;
+	int64 col;
+	float8 val;
+} matrix_entry;
+
+/*
+ * The state of the matrix aggregates: the nonzero elements seen so far, in
+ * no particular order, with room to append more in place.
+ */
+typedef struct
+{
+	int32 vl_len_;
+	int32 fixed_cols;       /* whether ncols was given by svec rows */
+	int64 nrows;            /* the largest row seen */
+	int64 ncols;            /* the svec dimension, or the largest column */
+	int64 count;            /* the number of entries in use */
+	int64 capacity;         /* the number of entries allocated */
+	matrix_entry entries[1];
+} matrix_builder;
+
+#define MATRIX_BUILDER_SIZE(capacity) \
+	(offsetof(matrix_builder,entries) + (capacity)*sizeof(matrix_entry))
+
+/*
+ * A matrix in compressed sparse row form. The header is followed by the
+ * values of the nonzero elements, row by row, then the index one past the
+ * last element of each row, then the zero-based column of each element.
+ */
+typedef struct
+{
+	int32 vl_len_;
+	int32 unused;
+	int64 nrows;
+	int64 ncols;
+	int64 nnz;
+} csr_matrix;
+
+#define CSR_VALS(m)	((float8 *)((char *)(m) + MAXALIGN(sizeof(csr_matrix))))
+#define CSR_ROW_END(m)	((int64 *)(CSR_VALS(m) + (m)->nnz))
+#define CSR_COLS(m)	((int32 *)(CSR_ROW_END(m) + (m)->nrows))
+#define CSR_SIZE(nrows,nnz) \
+	(MAXALIGN(sizeof(csr_matrix)) + (nnz)*(sizeof(float8)+sizeof(int32)) + \
+	 (nrows)*sizeof(int64))
+
+Datum svec_matrix_transition(PG_FUNCTION_ARGS);
+Datum svec_matrix_transition_triple(PG_FUNCTION_ARGS);
+Datum svec_matrix_merge(PG_FUNCTION_ARGS);
+Datum svec_matrix_final(PG_FUNCTION_ARGS);
+Datum svec_spmv(PG_FUNCTION_ARGS);
+
+/*
+ * Raises an error unless state is a well-formed builder.
+ */
+static void
+matrix_builder_check(matrix_builder *state)
+{
+	if (VARSIZE(state) < MATRIX_BUILDER_SIZE(0) ||
+	    VARSIZE(state) != MATRIX_BUILDER_SIZE(state->capacity) ||
+	    state->count < 0 || state->count > state->capacity)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid sparse matrix aggregate state")));
+}
+
+/*
+ * Returns the builder in argument 0 ready to take n more entries. In an
+ * aggregate the state is changed in place, and reallocated at twice the
+ * size when it is full; outside one it is copied.
+ */
+static matrix_builder *
+matrix_builder_reserve(FunctionCallInfo fcinfo, int64 n)
+{
+	matrix_builder *state, *grown;
+	int64 capacity;
+
+	if (PG_ARGISNULL(0))
+	{
+		capacity = Max(n,16);
+		state = (matrix_builder *)palloc0(MATRIX_BUILDER_SIZE(capacity));
+		SET_VARSIZE(state,MATRIX_BUILDER_SIZE(capacity));
+		state->capacity = capacity;
+		return state;
+	}
+
+	if (fcinfo->context && IsA(fcinfo->context, AggState))
+		state = (matrix_builder *)PG_GETARG_BYTEA_P(0);
+	else
+		state = (matrix_builder *)PG_GETARG_BYTEA_P_COPY(0);
+	matrix_builder_check(state);
+
+	if (state->count + n <= state->capacity)
+		return state;
+
+	capacity = Max(2*state->capacity,state->count + n);
+	if ((Size)MATRIX_BUILDER_SIZE(capacity) > MaxAllocSize)
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+			 errmsg("sparse matrix has too many nonzero elements")));
+	grown = (matrix_builder *)palloc(MATRIX_BUILDER_SIZE(capacity));
+	memcpy(grown,state,MATRIX_BUILDER_SIZE(state->count));
+	SET_VARSIZE(grown,MATRIX_BUILDER_SIZE(capacity));
+	grown->capacity = capacity;
+	return grown;
+}
+
+static void
+matrix_builder_add(matrix_builder *state, int64 row, int64 col, float8 val)
+{
+	matrix_entry *entry = &state->entries[state->count++];
+
+	entry->row = row;
+	entry->col = col;
+	entry->val = val;
+	state->nrows = Max(state->nrows,row);
+	if (!state->fixed_cols)
+		state->ncols = Max(state->ncols,col);
+}
+
+static void
+check_matrix_row(int64 row)
+{
+	if (row < 1 || row > INT_MAX)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("sparse matrix rows must be between 1 and %d", INT_MAX)));
+}
+
+PG_FUNCTION_INFO_V1( svec_matrix_transition );
+/**
+ *  svec_matrix_transition (bytea, int8, svec):
+ *
+ *		Adds the nonzero elements of an svec as a row of a matrix. All
+ *		rows must have the same dimension, which is the number of columns.
+ */
+Datum svec_matrix_transition(PG_FUNCTION_ARGS)
+{
+	matrix_builder *state;
+	SvecType *svec;
+	SparseData sdata;
+	double *vals;
+	char *ix;
+	int64 row, nnz = 0, col = 0;
+
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		PG_RETURN_BYTEA_P(PG_GETARG_BYTEA_P(0));
+	}
+	row = PG_GETARG_INT64(1);
+	check_matrix_row(row);
+	svec = PG_GETARG_SVECTYPE_P(2);
+	sdata = sdata_from_svec(svec);
+	vals = (double *)sdata->vals->data;
+
+	ix = sdata->index->data;
+	for (int i=0; i<sdata->unique_value_count; i++)
+	{
+		if (IS_NVP(vals[i]))
+			ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("sparse matrix rows must not contain NULL elements")));
+		if (vals[i] != 0.)
+			nnz += compword_to_int8(ix);
+		ix += int8compstoragesize(ix);
+	}
+
+	state = matrix_builder_reserve(fcinfo,nnz);
+	if (!state->fixed_cols)
+	{
+		state->fixed_cols = true;
+		state->ncols = sdata->total_value_count;
+	} else if (state->ncols != sdata->total_value_count)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("sparse matrix rows must have the same dimension, but have %ld and %d",
+				(long)state->ncols, sdata->total_value_count)));
+
+	ix = sdata->index->data;
+	for (int i=0; i<sdata->unique_value_count; i++)
+	{
+		int64 run_len = compword_to_int8(ix);
+
+		if (vals[i] != 0.)
+			for (int64 k=0; k<run_len; k++)
+				matrix_builder_add(state,row,col+k+1,vals[i]);
+		col += run_len;
+		ix += int8compstoragesize(ix);
+	}
+	state->nrows = Max(state->nrows,row);
+
+	PG_RETURN_BYTEA_P(state);
+}
+
+PG_FUNCTION_INFO_V1( svec_matrix_transition_triple );
+/**
+ *  svec_matrix_transition_triple (bytea, int8, int8, float8):
+ *
+ *		Adds the element at a row and column of a matrix. The number of
+ *		columns is the largest column given.
+ */
+Datum svec_matrix_transition_triple(PG_FUNCTION_ARGS)
+{
+	matrix_builder *state;
+	int64 row, col;
+	float8 val;
+
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		PG_RETURN_BYTEA_P(PG_GETARG_BYTEA_P(0));
+	}
+	row = PG_GETARG_INT64(1);
+	col = PG_GETARG_INT64(2);
+	val = PG_GETARG_FLOAT8(3);
+	check_matrix_row(row);
+	if (col < 1 || col > INT_MAX)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("sparse matrix columns must be between 1 and %d", INT_MAX)));
+
+	state = matrix_builder_reserve(fcinfo,1);
+	if (val != 0.)
+		matrix_builder_add(state,row,col,val);
+	else
+	{
+		/* a zero still sets the dimensions */
+		state->nrows = Max(state->nrows,row);
+		state->ncols = Max(state->ncols,col);
+	}
+
+	PG_RETURN_BYTEA_P(state);
+}
+
+PG_FUNCTION_INFO_V1( svec_matrix_merge );
+/**
+ *  svec_matrix_merge (bytea, bytea):
+ *
+ *		Preliminary merge function of the matrix aggregates: appends the
+ *		entries of one partial state to the other.
+ */
+Datum svec_matrix_merge(PG_FUNCTION_ARGS)
+{
+	matrix_builder *state, *other;
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		PG_RETURN_BYTEA_P(PG_GETARG_BYTEA_P(0));
+	}
+	other = (matrix_builder *)PG_GETARG_BYTEA_P(1);
+	matrix_builder_check(other);
+	if (PG_ARGISNULL(0))
+		PG_RETURN_BYTEA_P(other);
+
+	state = matrix_builder_reserve(fcinfo,other->count);
+	if (state->fixed_cols && other->fixed_cols && state->ncols != other->ncols)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("sparse matrix rows must have the same dimension, but have %ld and %ld",
+				(long)state->ncols, (long)other->ncols)));
+	memcpy(&state->entries[state->count],other->entries,
+	       other->count*sizeof(matrix_entry));
+	state->count += other->count;
+	state->nrows = Max(state->nrows,other->nrows);
+	state->ncols = Max(state->ncols,other->ncols);
+	state->fixed_cols = state->fixed_cols || other->fixed_cols;
+
+	PG_RETURN_BYTEA_P(state);
+}
+
+static int
+compar_matrix_entry(const void *i, const void *j)
+{
+	const matrix_entry *left  = (const matrix_entry *)i;
+	const matrix_entry *right = (const matrix_entry *)j;
+
+	if (left->row != right->row)
+		return (left->row > right->row) - (left->row < right->row);
+	return (left->col > right->col) - (left->col < right->col);
+}
+
+PG_FUNCTION_INFO_V1( svec_matrix_final );
+/**
+ *  svec_matrix_final (bytea):
+ *
+ *		Final function of the matrix aggregates: sorts the entries into a
+ *		matrix in CSR form. Entries at the same position are added.
+ *		The state is left alone, since the final function may be called
+ *		on it more than once, e.g., when the aggregate is used as a
+ *		window function.
+ */
+Datum svec_matrix_final(PG_FUNCTION_ARGS)
+{
+	matrix_builder *state = (matrix_builder *)PG_GETARG_BYTEA_P(0);
+	matrix_entry *entries;
+	csr_matrix *matrix;
+	float8 *vals;
+	int64 *row_end;
+	int32 *cols;
+	int64 nnz = 0;
+	Size size;
+
+	matrix_builder_check(state);
+	entries = (matrix_entry *)palloc(Max(state->count,1)*sizeof(matrix_entry));
+	memcpy(entries,state->entries,state->count*sizeof(matrix_entry));
+	qsort(entries,state->count,sizeof(matrix_entry),compar_matrix_entry);
+
+	/* merge duplicates in place */
+	for (int64 i=0; i<state->count; i++)
+	{
+		if (nnz > 0 && entries[nnz-1].row == entries[i].row &&
+		    entries[nnz-1].col == entries[i].col)
+			entries[nnz-1].val += entries[i].val;
+		else
+			entries[nnz++] = entries[i];
+	}
+
+	size = CSR_SIZE(state->nrows,nnz);
+	if (size > MaxAllocSize)
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+			 errmsg("sparse matrix is too large")));
+	matrix = (csr_matrix *)palloc0(size);
+	SET_VARSIZE(matrix,size);
+	matrix->nrows = state->nrows;
+	matrix->ncols = state->ncols;
+	matrix->nnz = nnz;
+	vals = CSR_VALS(matrix);
+	row_end = CSR_ROW_END(matrix);
+	cols = CSR_COLS(matrix);
+
+	for (int64 i=0, r=0; r<matrix->nrows; r++)
+	{
+		while (i < nnz && entries[i].row == r+1)
+		{
+			vals[i] = entries[i].val;
+			cols[i] = (int32)(entries[i].col-1);
+			i++;
+		}
+		row_end[r] = i;
+	}
+	pfree(entries);
+
+	PG_RETURN_BYTEA_P(matrix);
+}
+
+PG_FUNCTION_INFO_V1( svec_spmv );
+/**
+ *  svec_spmv (bytea, float8[]):
+ *
+ *		Multiplies a matrix built by svec_matrix_agg with a vector, and
+ *		returns the product as a float8[] with one element per row.
+ */
+Datum svec_spmv(PG_FUNCTION_ARGS)
+{
+	csr_matrix *matrix = (csr_matrix *)PG_GETARG_BYTEA_P(0);
+	ArrayType *x_array = PG_GETARG_ARRAYTYPE_P(1);
+	float8 *x, *y, *vals;
+	int64 *row_end;
+	int32 *cols;
+	int64 start = 0;
+
+	if (VARSIZE(matrix) < MAXALIGN(sizeof(csr_matrix)) ||
+	    matrix->nrows < 0 || matrix->nnz < 0 || matrix->ncols < 0 ||
+	    matrix->nrows > INT_MAX || matrix->ncols > INT_MAX ||
+	    VARSIZE(matrix) != CSR_SIZE(matrix->nrows,matrix->nnz))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid sparse matrix")));
+
+	if (ARR_ELEMTYPE(x_array) != FLOAT8OID || ARR_NDIM(x_array) > 1 ||
+	    ARR_HASNULL(x_array))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("svec_spmv expects a one-dimensional float8[] without NULLs")));
+	if (ArrayGetNItems(ARR_NDIM(x_array),ARR_DIMS(x_array)) != matrix->ncols)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("dimensions of matrix and vector do not match: %ld columns, %d elements",
+				(long)matrix->ncols,
+				ArrayGetNItems(ARR_NDIM(x_array),ARR_DIMS(x_array)))));
+
+	x = (float8 *)ARR_DATA_PTR(x_array);
+	y = (float8 *)palloc(sizeof(float8)*Max(matrix->nrows,1));
+	vals = CSR_VALS(matrix);
+	row_end = CSR_ROW_END(matrix);
+	cols = CSR_COLS(matrix);
+
+	for (int64 r=0; r<matrix->nrows; r++)
+	{
+		int64 end = row_end[r];
+		float8 sum = 0.;
+
+		if (end < start || end > matrix->nnz)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid sparse matrix")));
+		for (int64 i=start; i<end; i++)
+		{
+			if ((uint32)cols[i] >= (uint64)matrix->ncols)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid sparse matrix")));
+			sum += vals[i]*x[cols[i]];
+		}
+		y[r] = sum;
+		start = end;
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_array((Datum *)y,
+					      matrix->nrows, FLOAT8OID,
+					      sizeof(float8),true,'d'));
+}
@@ -44,28 +44,42 @@ ArrayType *svec_return_array_internal(SvecType *svec)
 	return(pgarray);
 }
 
-/* 
- * Must serialize for binary communication with libpq by
- * creating a StringInfo and sending individual data items like:
- *   (from backend/libpq/pqformat.c):
- *      pq_beginmessage - initialize StringInfo buffer
- *      pq_sendbyte     - append a raw byte to a StringInfo buffer
- *      pq_sendint      - append a binary integer to a StringInfo buffer
- *      pq_sendint64    - append a binary 8-byte int to a StringInfo buffer
- *      pq_sendfloat4   - append a float4 to a StringInfo buffer
- *      pq_sendfloat8   - append a float8 to a StringInfo buffer
- *      pq_sendbytes    - append raw data to a StringInfo buffer
- *      pq_sendcountedtext - append a counted text string (with character set conversion)
- *      pq_sendtext     - append a text string (with conversion)
- *      pq_sendstring   - append a null-terminated text string (with conversion)
- *      pq_send_ascii_string - append a null-terminated text string (without conversion)
- *      pq_endmessage   - send the completed message to the frontend
+/*
+ * Binary format
+ *
+ * svec_send and svec_recv exchange the serialized SparseData of an svec
+ * in the layout it has inside the datum, so that binary COPY moves the
+ * bytes without formatting or parsing text:
  *
+ *   int32  type of the values, always FLOAT8OID
+ *   int32  number of runs (unique_value_count)
+ *   int32  number of elements (total_value_count)
+ *   int32  length in bytes of the values, 8 per run
+ *   int32  length in bytes of the run-length index
+ *   bytes  the value of each run, IEEE 754 float8, little-endian
+ *   bytes  the length of each run as a compword (see int8_to_compword()),
+ *          or nothing if every run has length one
+ *
+ * The int32 fields are in network byte order like all pq_sendint() fields.
+ * The values and index are copied as they are on little-endian servers
+ * (compwords have a fixed byte order everywhere). svec_recv checks that
+ * the counts and index agree instead of re-encoding the vector, and the
+ * dimension follows from the number of elements, as in svec_in.
  */
 
+#ifdef WORDS_BIGENDIAN
+/* Reverses the byte order of each float8 in a buffer */
+static void swap_float8_bytes(char *dst, const char *src, int len)
+{
+	for (int i=0; i<len; i+=sizeof(float8))
+		for (int j=0; j<(int)sizeof(float8); j++)
+			dst[i+j] = src[i+sizeof(float8)-1-j];
+}
+#endif
+
 PG_FUNCTION_INFO_V1(svec_send);
 /**
- *  svec_send - converts text to binary format
+ *  svec_send - converts an svec to the binary format
  */
 Datum svec_send(PG_FUNCTION_ARGS)
 {
@@ -74,39 +88,84 @@ Datum svec_send(PG_FUNCTION_ARGS)
 	SparseData sdata = sdata_from_svec(svec);
 
 	pq_begintypsend(&buf);
+	enlargeStringInfo(&buf,5*sizeof(int4)+sdata->vals->len+sdata->index->len);
 	pq_sendint(&buf,sdata->type_of_data,sizeof(Oid));
 	pq_sendint(&buf,sdata->unique_value_count,sizeof(int));
 	pq_sendint(&buf,sdata->total_value_count,sizeof(int));
 	pq_sendint(&buf,sdata->vals->len,sizeof(int));
 	pq_sendint(&buf,sdata->index->len,sizeof(int));
+#ifdef WORDS_BIGENDIAN
+	swap_float8_bytes(buf.data+buf.len,sdata->vals->data,sdata->vals->len);
+	buf.len += sdata->vals->len;
+#else
 	pq_sendbytes(&buf,sdata->vals->data,sdata->vals->len);
-	pq_sendbytes(&buf,sdata->index->data,sdata->index->len);
+#endif
+	if (sdata->index->len > 0)
+		pq_sendbytes(&buf,sdata->index->data,sdata->index->len);
 
 	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
 }
 
 PG_FUNCTION_INFO_V1(svec_recv);
 /**
- *  svec_recv - converts external binary format to text
+ *  svec_recv - converts the binary format to an svec
  */
 Datum svec_recv(PG_FUNCTION_ARGS)
 {
 	StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
-	SvecType *svec;
+	SparseDataStruct sdata;
+	StringInfoData vals, index;
+	const char *problem;
+
+	sdata.type_of_data       = pq_getmsgint(buf, sizeof(Oid));
+	sdata.unique_value_count = pq_getmsgint(buf, sizeof(int));
+	sdata.total_value_count  = pq_getmsgint(buf, sizeof(int));
+	vals.len                 = pq_getmsgint(buf, sizeof(int));
+	index.len                = pq_getmsgint(buf, sizeof(int));
+
+	if (sdata.type_of_data != FLOAT8OID)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+			 errmsg("svec values must be float8, not type %u",
+				sdata.type_of_data)));
+	if (sdata.unique_value_count < 0 ||
+	    sdata.total_value_count < sdata.unique_value_count ||
+	    (int64)vals.len != (int64)sdata.unique_value_count * (int64)sizeof(float8) ||
+	    index.len < 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+			 errmsg("invalid svec header: %d runs, %d elements, %d bytes of values, %d bytes of index",
+				sdata.unique_value_count, sdata.total_value_count,
+				vals.len, index.len)));
+
+	/* pq_getmsgbytes checks the lengths against the message */
+	vals.data  = (char *)pq_getmsgbytes(buf, vals.len);
+	index.data = (char *)pq_getmsgbytes(buf, index.len);
+	pq_getmsgend(buf);
+
+	problem = sdata_index_check(index.data, index.len,
+				    sdata.unique_value_count, sdata.total_value_count);
+	if (problem != NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+			 errmsg("invalid svec index: %s", problem)));
+
+#ifdef WORDS_BIGENDIAN
+	{
+		char *swapped = (char *)palloc(vals.len);
+		swap_float8_bytes(swapped,vals.data,vals.len);
+		vals.data = swapped;
+	}
+#endif
+
+	/* serialize straight from the message, copying it once */
+	if (index.len == 0)
+		index.data = NULL;
+	vals.cursor = index.cursor = 0;
+	sdata.vals  = &vals;
+	sdata.index = &index;
 
-	SparseData sdata=makeEmptySparseData();;
-	sdata->type_of_data       = pq_getmsgint(buf, sizeof(int));
-	sdata->unique_value_count = pq_getmsgint(buf, sizeof(int));
-	sdata->total_value_count  = pq_getmsgint(buf, sizeof(int));
-	sdata->vals->len          = pq_getmsgint(buf, sizeof(int));
-	sdata->index->len         = pq_getmsgint(buf, sizeof(int));
-	sdata->vals->data         = (char *)pq_getmsgbytes(buf,sdata->vals->len);
-	sdata->index->data        = (char *)pq_getmsgbytes(buf,sdata->index->len);
-	svec = svec_from_sparsedata(sdata,true); //Note this copies the data
-//	freeSparseDataAndData(sdata);
-	pfree(sdata);
-
-	PG_RETURN_SVECTYPE_P(svec);
+	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(&sdata,true));
 }
 
 /*
@@ -365,10 +424,17 @@ Datum svec_from_string(PG_FUNCTION_ARGS)
 
 /**
  * Produces an svec from a SparseData
+ *
+ * With trim, the svec is also stored in the representation that suits its
+ * density: if every run has length one the index is left out, which makes
+ * the svec dense (see SparseData.h). Without trim, the StringInfos are kept
+ * as they are so that they can be appended to in place.
  */
 SvecType *svec_from_sparsedata(SparseData sdata, bool trim)
 {
 	int size;
+	SparseDataStruct dense;
+	StringInfoData no_index;
 
 	if (trim)
 	{
@@ -377,6 +443,19 @@ SvecType *svec_from_sparsedata(SparseData sdata, bool trim)
 		 */
 		sdata->vals->maxlen=sdata->vals->len;
 		sdata->index->maxlen=sdata->index->len;
+
+		if (!SDATA_IS_DENSE(sdata) && sdata->unique_value_count > 0 &&
+		    sdata->unique_value_count == sdata->total_value_count)
+		{
+			/* serialize a dense copy of the header, leaving sdata alone */
+			dense = *sdata;
+			no_index.data   = NULL;
+			no_index.len    = 0;
+			no_index.maxlen = 0;
+			no_index.cursor = 0;
+			dense.index = &no_index;
+			sdata = &dense;
+		}
 	}
 
 	size = SVECHDRSIZE + SIZEOF_SPARSEDATASERIAL(sdata);
@@ -421,6 +500,9 @@ SvecType *makeEmptySvec(int allocation)
 
 /**
  * Allocates more space for the count and data arrays of an svec
+ *
+ * A dense svec is given an explicit index of ones, so that runs can be
+ * appended to the result.
  */
 SvecType *reallocSvec(SvecType *source)
 {
@@ -428,13 +510,23 @@ SvecType *reallocSvec(SvecType *source)
 	SparseData sdata = sdata_from_svec(source);
 	int val_newmaxlen = Max(2*sizeof(float8)+1, 2 * (Size) sdata->vals->maxlen);
 	char *newvals = (char *)palloc(val_newmaxlen);
-	int ind_newmaxlen = Max(2*sizeof(int8)+1, 2 * (Size) sdata->index->maxlen);
+	int ind_newmaxlen = Max(2*sizeof(int8)+1,
+		2 * (Size) Max(sdata->index->maxlen,sdata->unique_value_count));
 	char *newindex = (char *)palloc(ind_newmaxlen);
 	/*
 	 * This space was never allocated with palloc, so we can't repalloc it!
 	 */
 	memcpy(newvals ,sdata->vals->data ,sdata->vals->len);
-	memcpy(newindex,sdata->index->data,sdata->index->len);
+	if (SDATA_IS_DENSE(sdata))
+	{
+		/* a run of one is stored in a single byte */
+		for (int i=0; i<sdata->unique_value_count; i++)
+			int8_to_compword(1,newindex+i);
+		sdata->index->len = sdata->unique_value_count;
+		sdata->index->cursor = Max(sdata->unique_value_count-1,0);
+	}
+	else
+		memcpy(newindex,sdata->index->data,sdata->index->len);
 	sdata->vals->data    = newvals;
 	sdata->vals->maxlen  = val_newmaxlen;
 	sdata->index->data   = newindex;
@@ -444,6 +536,125 @@ SvecType *reallocSvec(SvecType *source)
 	return(svec);
 }
 
+/*
+ * The svec last passed to a function and, once that svec is seen again,
+ * its decoded runs. Lives in fn_extra; see svec_runs_cached().
+ */
+typedef struct
+{
+	SvecType *key;              /* address of the last svec seen, never read */
+	Size key_size;              /* VARSIZE of the last svec seen */
+	int dimension;              /* the fields below are only valid if */
+	char *index;                /* index is not NULL, i.e., the svec has */
+	int index_len;              /* been seen twice, and describe its index */
+	bool dense;
+	SparseDataRunsStruct runs;
+} svec_runs_cache;
+
+/*
+ * Compares the run-length index of an svec with the one held by the cache.
+ * The values are not compared, since the cached runs are always pointed at
+ * the values of the svec at hand.
+ */
+static bool svec_runs_cache_matches(svec_runs_cache *cache, SvecType *svec)
+{
+	StringInfo index = (StringInfo)SDATA_INDEX_SINFO(SVEC_SDATAPTR(svec));
+
+	return (cache->dimension == svec->dimension &&
+		cache->runs.unique_value_count == SVEC_UNIQUE_VALCNT(svec) &&
+		cache->runs.total_value_count == SVEC_TOTAL_VALCNT(svec) &&
+		cache->index_len == index->len &&
+		cache->dense == (index->maxlen == 0) &&
+		memcmp(cache->index,SVEC_INDEX_PTR(svec),index->len) == 0);
+}
+
+/*
+ * Releases what the cache holds for the previous svec and remembers the
+ * address and size of a new one.
+ */
+static void svec_runs_cache_reset(svec_runs_cache *cache, SvecType *svec)
+{
+	if (cache->index != NULL)
+	{
+		pfree(cache->index);
+		pfree(cache->runs.run_end);
+		cache->index = NULL;
+	}
+	cache->key = svec;
+	cache->key_size = VARSIZE(svec);
+}
+
+/**
+ * Returns the decoded runs of an svec that the calling function has seen
+ * before, as happens when it is called with a constant svec (a centroid,
+ * say) for every row. The runs are decoded once and kept in fn_extra, and
+ * give O(log n) lookups instead of a scan of the compressed index.
+ *
+ * Svecs are told apart by their address and size, which costs nothing for
+ * the common case of a different svec on every row. Only the second time
+ * the same address and size come by is the index copied and decoded; from
+ * then on, it is compared with the cached copy, since the memory of a
+ * different svec may have been reused. The values are never copied.
+ *
+ * @param flinfo The FmgrInfo of the calling function
+ * @param svec The svec being operated on
+ * @return The runs of svec, owned by the cache and valid while svec is,
+ *         or NULL
+ */
+SparseDataRuns svec_runs_cached(FmgrInfo *flinfo, SvecType *svec)
+{
+	svec_runs_cache *cache;
+	StringInfo index;
+	SparseData sdata;
+	SparseDataRuns runs;
+	MemoryContext oldcontext;
+
+	if (flinfo == NULL)
+		return NULL;
+
+	cache = (svec_runs_cache *)flinfo->fn_extra;
+	if (cache == NULL)
+	{
+		cache = (svec_runs_cache *)MemoryContextAllocZero(flinfo->fn_mcxt,
+							sizeof(svec_runs_cache));
+		flinfo->fn_extra = cache;
+	}
+
+	if (cache->key != svec || cache->key_size != VARSIZE(svec))
+	{
+		/* A new svec: remember where it is in case it comes back */
+		svec_runs_cache_reset(cache,svec);
+		return NULL;
+	}
+
+	if (cache->index != NULL)
+	{
+		if (!svec_runs_cache_matches(cache,svec))
+		{
+			svec_runs_cache_reset(cache,svec);
+			return NULL;
+		}
+		cache->runs.vals = (double *)SVEC_VALS_PTR(svec);
+		return &cache->runs;
+	}
+
+	/* Seen for the second time: decode the runs and keep them */
+	index = (StringInfo)SDATA_INDEX_SINFO(SVEC_SDATAPTR(svec));
+	sdata = sdata_from_svec(svec);
+	oldcontext = MemoryContextSwitchTo(flinfo->fn_mcxt);
+	runs = sdata_runs_from_sdata(sdata);
+	cache->runs = *runs;
+	pfree(runs);
+	cache->index = (char *)palloc(Max(index->len,1));
+	memcpy(cache->index,SVEC_INDEX_PTR(svec),index->len);
+	MemoryContextSwitchTo(oldcontext);
+
+	cache->index_len = index->len;
+	cache->dense = (index->maxlen == 0);
+	cache->dimension = svec->dimension;
+	return &cache->runs;
+}
+
 typedef struct
 {
 	SvecType *svec;
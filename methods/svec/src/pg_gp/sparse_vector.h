@@ -102,6 +102,7 @@ SvecType *op_svec_by_svec_internal(enum operation_t operation, SvecType *svec1,
 SvecType *svec_operate_on_sdata_pair(int scalar_args,enum operation_t operation,SparseData left,SparseData right);
 SvecType *makeEmptySvec(int allocation);
 SvecType *reallocSvec(SvecType *source);
+SparseDataRuns svec_runs_cached(FmgrInfo *flinfo, SvecType *svec);
 
 Datum svec_in(PG_FUNCTION_ARGS);
 Datum svec_out(PG_FUNCTION_ARGS);
@@ -0,0 +1,367 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file kmeans_dense.cpp
+ *
+ * @brief One iteration of k-means for dense points
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#include <dbconnector/dbconnector.hpp>
+#include <modules/shared/HandleTraits.hpp>
+
+#include "metric.hpp"
+#include "kmeans_dense.hpp"
+
+namespace madlib {
+
+// Use Eigen
+using namespace dbal::eigen_integration;
+
+namespace modules {
+
+namespace linalg {
+
+/**
+ * @brief Transition state for the dense k-means step
+ *
+ * To the database, the state is exposed as a single DOUBLE PRECISION array,
+ * to the C++ code it is a proper object containing scalars, vectors, and
+ * matrices.
+ *
+ * The centroids are the same for all rows, so the state keeps a copy of them
+ * together with their squared norms, which are computed only once, for the
+ * first row. For the built-in metrics, points are not assigned one at a time:
+ * They are collected in a buffer, and every full buffer is assigned to the
+ * centroids at once by closestColumnsAndDistances(). Other metrics are called
+ * once per point and centroid.
+ *
+ * Note: We assume that the DOUBLE PRECISION array is initialized by the
+ * database with length at least 8, and all elemenets are 0.
+ */
+template <class Handle>
+class KMeansDenseTransitionState {
+    // By §14.5.3/9: "Friend declarations shall not declare partial
+    // specializations." We do access protected members in operator+=().
+    template <class OtherHandle>
+    friend class KMeansDenseTransitionState;
+
+public:
+    KMeansDenseTransitionState(const AnyType &inArray)
+      : mStorage(inArray.getAs<Handle>()) {
+
+        rebind(static_cast<uint32_t>(mStorage[1]),
+            static_cast<uint32_t>(mStorage[2]),
+            static_cast<uint32_t>(mStorage[4]));
+    }
+
+    /**
+     * @brief Convert to backend representation
+     *
+     * We define this function so that we can use TransitionState in the argument
+     * list and as a return type.
+     */
+    inline operator AnyType() const {
+        return mStorage;
+    }
+
+    /**
+     * @brief Initialize the transition state. Only called for first row.
+     *
+     * @param inAllocator Allocator for the memory transition state. Must fill
+     *     the memory block with zeros.
+     * @param inCentroids The centroids (one per column)
+     * @param inMetric The metric
+     * @param inBufferCapacity Number of points that are assigned at once
+     */
+    template <class Derived>
+    inline void initialize(const Allocator &inAllocator,
+        const Eigen::MatrixBase<Derived>& inCentroids, DistanceMetric inMetric,
+        uint32_t inBufferCapacity) {
+
+        uint32_t numCentroidsInit = static_cast<uint32_t>(inCentroids.cols());
+        uint32_t dimensionInit = static_cast<uint32_t>(inCentroids.rows());
+
+        mStorage = inAllocator.allocateArray<double, dbal::AggregateContext,
+            dbal::DoZero, dbal::ThrowBadAlloc>(
+                arraySize(numCentroidsInit, dimensionInit, inBufferCapacity));
+        rebind(numCentroidsInit, dimensionInit, inBufferCapacity);
+        numCentroids = numCentroidsInit;
+        dimension = dimensionInit;
+        metric = static_cast<uint16_t>(inMetric);
+        bufferCapacity = inBufferCapacity;
+        centroids = inCentroids;
+        centroidSquaredNorms = centroids.colwise().squaredNorm().transpose();
+    }
+
+    /**
+     * @brief Merge with another TransitionState object
+     */
+    template <class OtherHandle>
+    KMeansDenseTransitionState &operator+=(
+        const KMeansDenseTransitionState<OtherHandle> &inOtherState) {
+
+        if (mStorage.size() != inOtherState.mStorage.size()
+            || metric != inOtherState.metric
+            || bufferCapacity != inOtherState.bufferCapacity)
+            throw std::logic_error("Internal error: Incompatible transition "
+                "states");
+        if (centroids != inOtherState.centroids)
+            throw std::invalid_argument("Centroids must be the same for all "
+                "rows.");
+
+        numRows += inOtherState.numRows;
+        objective += inOtherState.objective;
+        sums += inOtherState.sums;
+        counts += inOtherState.counts;
+        objective += assign(
+            inOtherState.buffer.leftCols(inOtherState.numBuffered),
+            sums, counts);
+        return *this;
+    }
+
+    /**
+     * @brief Add a point, to be assigned later by flush()
+     */
+    template <class Derived>
+    void addToBuffer(const Eigen::MatrixBase<Derived>& inPoint) {
+        buffer.col(numBuffered) = inPoint;
+        numBuffered++;
+        if (numBuffered == bufferCapacity)
+            flush();
+    }
+
+    /**
+     * @brief Assign all buffered points
+     */
+    void flush() {
+        objective += assign(buffer.leftCols(numBuffered), sums, counts);
+        numBuffered = 0;
+    }
+
+    /**
+     * @brief Assign points to their closest centroids w.r.t. a built-in
+     *     metric, and add them to the given cluster sums and counts
+     *
+     * @return The sum of the distances of the points to their centroids
+     */
+    template <class Derived, class SumsType, class CountsType>
+    double assign(const Eigen::MatrixBase<Derived>& inPoints,
+        SumsType& ioSums, CountsType& ioCounts) const {
+
+        if (inPoints.cols() == 0)
+            return 0;
+
+        std::vector<Index> columns(inPoints.cols());
+        std::vector<double> distances(inPoints.cols());
+        closestColumnsAndDistances(centroids, centroidSquaredNorms, inPoints,
+            static_cast<DistanceMetric>(static_cast<uint16_t>(metric)),
+            &columns[0], &distances[0]);
+
+        double sumOfDistances = 0;
+        for (Index j = 0; j < inPoints.cols(); ++j) {
+            ioSums.col(columns[j]) += inPoints.col(j);
+            ioCounts(columns[j]) += 1;
+            sumOfDistances += distances[j];
+        }
+        return sumOfDistances;
+    }
+
+private:
+    static inline size_t arraySize(uint32_t inNumCentroids,
+        uint32_t inDimension, uint32_t inBufferCapacity) {
+
+        return 7 + 2 * (inDimension + 1) * inNumCentroids
+            + inDimension * inBufferCapacity;
+    }
+
+    /**
+     * @brief Rebind to a new storage array
+     *
+     * @param inNumCentroids The number of centroids
+     * @param inDimension The dimension of points and centroids
+     * @param inBufferCapacity The number of points that fit in the buffer
+     *
+     * Array layout:
+     * - 0: numRows (number of rows seen so far)
+     * - 1: numCentroids (number of centroids)
+     * - 2: dimension (dimension of points and centroids)
+     * - 3: metric (DistanceMetric; kUserDefinedMetric if the buffer is not
+     *      used)
+     * - 4: bufferCapacity (number of points that fit in the buffer)
+     * - 5: numBuffered (number of points in the buffer)
+     * - 6: objective (sum of distances of the assigned points to their
+     *      centroids)
+     * - 7: centroids (copy of the centroids, one per column)
+     * - 7 + dimension * numCentroids: centroidSquaredNorms (squared 2-norms
+     *      of the centroids)
+     * - 7 + (dimension + 1) * numCentroids: sums (sum of the assigned points,
+     *      per centroid)
+     * - 7 + (2 * dimension + 1) * numCentroids: buffer (points not yet
+     *      assigned, one per column)
+     * - 7 + (2 * dimension + 1) * numCentroids + dimension * bufferCapacity:
+     *      counts (number of assigned points, per centroid)
+     */
+    void rebind(uint32_t inNumCentroids, uint32_t inDimension,
+        uint32_t inBufferCapacity) {
+
+        size_t k = inNumCentroids;
+        size_t d = inDimension;
+
+        numRows.rebind(&mStorage[0]);
+        numCentroids.rebind(&mStorage[1]);
+        dimension.rebind(&mStorage[2]);
+        metric.rebind(&mStorage[3]);
+        bufferCapacity.rebind(&mStorage[4]);
+        numBuffered.rebind(&mStorage[5]);
+        objective.rebind(&mStorage[6]);
+        centroids.rebind(&mStorage[7], d, k);
+        centroidSquaredNorms.rebind(&mStorage[7 + d * k], k);
+        sums.rebind(&mStorage[7 + (d + 1) * k], d, k);
+        buffer.rebind(&mStorage[7 + (2 * d + 1) * k], d, inBufferCapacity);
+        counts.rebind(&mStorage[7 + (2 * d + 1) * k + d * inBufferCapacity],
+            k);
+    }
+
+    Handle mStorage;
+
+public:
+    typename HandleTraits<Handle>::ReferenceToUInt64 numRows;
+    typename HandleTraits<Handle>::ReferenceToUInt32 numCentroids;
+    typename HandleTraits<Handle>::ReferenceToUInt32 dimension;
+    typename HandleTraits<Handle>::ReferenceToUInt16 metric;
+    typename HandleTraits<Handle>::ReferenceToUInt32 bufferCapacity;
+    typename HandleTraits<Handle>::ReferenceToUInt32 numBuffered;
+    typename HandleTraits<Handle>::ReferenceToDouble objective;
+    typename HandleTraits<Handle>::MatrixTransparentHandleMap centroids;
+    typename HandleTraits<Handle>::ColumnVectorTransparentHandleMap
+        centroidSquaredNorms;
+    typename HandleTraits<Handle>::MatrixTransparentHandleMap sums;
+    typename HandleTraits<Handle>::MatrixTransparentHandleMap buffer;
+    typename HandleTraits<Handle>::ColumnVectorTransparentHandleMap counts;
+};
+
+/**
+ * @brief Number of points that the built-in metrics assign at once
+ *
+ * The product of the centroid matrix and a buffer of this many points is
+ * large enough for the matrix-matrix kernel to pay off, and the buffer stays
+ * small compared to the centroids for the usual dimensions.
+ */
+const uint32_t kKMeansDenseBufferCapacity = 64;
+
+/**
+ * @brief Perform the dense k-means transition step
+ *
+ * Each point is assigned to its closest centroid, and we update the sum of
+ * the points assigned to each centroid, their number, and the sum of their
+ * distances to the centroids.
+ */
+AnyType
+kmeans_dense_step_transition::run(AnyType &args) {
+    KMeansDenseTransitionState<MutableArrayHandle<double> > state = args[0];
+    MappedColumnVector x = args[1].getAs<MappedColumnVector>();
+    MappedMatrix centroids = args[2].getAs<MappedMatrix>();
+
+    if (!isfinite(x))
+        throw std::domain_error("Point is not finite.");
+
+    if (state.numRows == 0) {
+        if (centroids.cols() == 0)
+            throw std::invalid_argument("There must be at least one "
+                "centroid.");
+        if (!isfinite(centroids))
+            throw std::domain_error("Centroids are not finite.");
+
+        FunctionHandle dist = args[3].getAs<FunctionHandle>();
+        DistanceMetric metric = builtinMetric(dist);
+        state.initialize(*this, centroids, metric,
+            metric == kUserDefinedMetric ? 0 : kKMeansDenseBufferCapacity);
+    } else if (centroids.rows() != state.dimension
+        || centroids.cols() != state.numCentroids) {
+        throw std::invalid_argument("Centroids must be the same for all "
+            "rows.");
+    }
+    if (x.size() != state.dimension)
+        throw std::invalid_argument("Dimensions of points and centroids do "
+            "not match.");
+
+    state.numRows++;
+    if (state.metric != kUserDefinedMetric) {
+        state.addToBuffer(x);
+    } else {
+        FunctionHandle dist = args[3].getAs<FunctionHandle>();
+        std::tuple<Index, double> result
+            = closestColumnAndDistance(state.centroids, x, dist);
+
+        state.sums.col(std::get<0>(result)) += x;
+        state.counts(std::get<0>(result)) += 1;
+        state.objective += std::get<1>(result);
+    }
+
+    return state;
+}
+
+/**
+ * @brief Perform the perliminary aggregation function: Merge transition states
+ */
+AnyType
+kmeans_dense_step_merge_states::run(AnyType &args) {
+    KMeansDenseTransitionState<MutableArrayHandle<double> > stateLeft = args[0];
+    KMeansDenseTransitionState<ArrayHandle<double> > stateRight = args[1];
+
+    // We first handle the trivial case where this function is called with one
+    // of the states being the initial state
+    if (stateLeft.numRows == 0)
+        return stateRight;
+    else if (stateRight.numRows == 0)
+        return stateLeft;
+
+    // Merge states together and return
+    stateLeft += stateRight;
+    return stateLeft;
+}
+
+/**
+ * @brief Perform the dense k-means final step
+ *
+ * The new centroids are the means of the points assigned to them. Centroids
+ * without any points are returned unchanged. The transition state is left
+ * alone: Points still in the buffer are assigned to copies of the sums and
+ * counts.
+ */
+AnyType
+kmeans_dense_step_final::run(AnyType &args) {
+    KMeansDenseTransitionState<ArrayHandle<double> > state = args[0];
+
+    // If we haven't seen any data, just return Null. This is the standard
+    // behavior of aggregate function on empty data sets (compare, e.g.,
+    // how PostgreSQL handles sum or avg on empty inputs)
+    if (state.numRows == 0)
+        return Null();
+
+    MutableMappedMatrix newCentroids(
+        allocateArray<double>(state.numCentroids, state.dimension));
+    newCentroids = state.sums;
+    ColumnVector counts = state.counts;
+    double objective = state.objective
+        + state.assign(state.buffer.leftCols(state.numBuffered), newCentroids,
+            counts);
+
+    for (Index i = 0; i < newCentroids.cols(); ++i) {
+        if (counts(i) > 0)
+            newCentroids.col(i) /= counts(i);
+        else
+            newCentroids.col(i) = state.centroids.col(i);
+    }
+
+    AnyType tuple;
+    return tuple
+        << newCentroids
+        << objective;
+}
+
+} // namespace linalg
+
+} // namespace modules
+
+} // namespace madlib
@@ -0,0 +1,20 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file kmeans_dense.hpp
+ *
+ *//* ----------------------------------------------------------------------- */
+
+/**
+ * @brief Dense k-means step: Transition function
+ */
+DECLARE_UDF(linalg, kmeans_dense_step_transition)
+
+/**
+ * @brief Dense k-means step: State merge function
+ */
+DECLARE_UDF(linalg, kmeans_dense_step_merge_states)
+
+/**
+ * @brief Dense k-means step: Final function
+ */
+DECLARE_UDF(linalg, kmeans_dense_step_final)
@@ -6,4 +6,5 @@
  *
  *//* ----------------------------------------------------------------------- */
 
+#include "kmeans_dense.hpp"
 #include "metric.hpp"
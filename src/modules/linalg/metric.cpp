@@ -10,6 +10,17 @@
 
 #include "metric.hpp"
 
+// The C entry points of the built-in metrics, as exported by
+// DECLARE_UDF_EXTERNAL. We only need their addresses.
+namespace external {
+extern "C" {
+    Datum dist_norm1(PG_FUNCTION_ARGS);
+    Datum dist_norm2(PG_FUNCTION_ARGS);
+    Datum squared_dist_norm1(PG_FUNCTION_ARGS);
+    Datum squared_dist_norm2(PG_FUNCTION_ARGS);
+} // extern "C"
+} // namespace external
+
 namespace madlib {
 
 // Use Eigen
@@ -19,26 +30,27 @@ namespace modules {
 
 namespace linalg {
 
-template <class Derived, class OtherDerived>
-std::tuple<Index, double>
-closestColumnAndDistance(
-    const Eigen::MatrixBase<Derived>& inMatrix,
-    const Eigen::MatrixBase<OtherDerived>& inVector,
-    FunctionHandle& inMetric) {
-
-    Index closestColumn = 0;
-    double minDist = std::numeric_limits<double>::infinity();
-
-    for (Index i = 0; i < inMatrix.cols(); ++i) {
-        double currentDist
-            = inMetric(inMatrix.col(i), inVector).template getAs<double>();
-        if (currentDist < minDist) {
-            closestColumn = i;
-            minDist = currentDist;
-        }
-    }
-
-    return std::tuple<Index, double>(closestColumn, minDist);
+/**
+ * @brief Recognize the metrics implemented in this file
+ *
+ * @return The metric, or \c kUserDefinedMetric if \c inMetric is not one of
+ *     the built-in metrics (or if it is called through a wrapper, as is the
+ *     case for SECURITY DEFINER functions)
+ */
+DistanceMetric
+builtinMetric(FunctionHandle& inMetric) {
+    PGFunction func = inMetric.funcPtr();
+
+    if (func == external::dist_norm2)
+        return kDistNorm2;
+    else if (func == external::squared_dist_norm2)
+        return kSquaredDistNorm2;
+    else if (func == external::dist_norm1)
+        return kDistNorm1;
+    else if (func == external::squared_dist_norm1)
+        return kSquaredDistNorm1;
+
+    return kUserDefinedMetric;
 }
 
 /**
@@ -51,12 +63,29 @@ closest_column::run(AnyType& args) {
     MappedColumnVector x = args[1].getAs<MappedColumnVector>();
     FunctionHandle dist = args[2].getAs<FunctionHandle>();
 
-    std::tuple<Index, double> result = closestColumnAndDistance(M, x, dist);
+    Index column = 0;
+    double distance = 0;
+    DistanceMetric metric = builtinMetric(dist);
+    if (metric == kUserDefinedMetric) {
+        std::tuple<Index, double> result = closestColumnAndDistance(M, x, dist);
+        column = std::get<0>(result);
+        distance = std::get<1>(result);
+    } else {
+        if (M.cols() == 0)
+            throw std::invalid_argument("Matrix must have at least one "
+                "column.");
+
+        // For a single point, computing the column norms costs no more than
+        // the product M^T x itself
+        ColumnVector colSquaredNorms = M.colwise().squaredNorm().transpose();
+        closestColumnsAndDistances(M, colSquaredNorms, x, metric, &column,
+            &distance);
+    }
 
     AnyType tuple;
     return tuple
-        << static_cast<int16_t>(std::get<0>(result))
-        << std::get<1>(result);
+        << static_cast<int16_t>(column)
+        << distance;
 }
 
 
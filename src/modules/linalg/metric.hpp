@@ -50,10 +50,152 @@ namespace modules {
 
 namespace linalg {
 
-template <typename Derived, typename OtherDerived>
+/**
+ * @brief Metrics that closest-column searches recognize and compute without
+ *     calling back into the database
+ */
+enum DistanceMetric {
+    kUserDefinedMetric = 0,
+    kDistNorm1,
+    kDistNorm2,
+    kSquaredDistNorm1,
+    kSquaredDistNorm2
+};
+
+DistanceMetric builtinMetric(FunctionHandle& inMetric);
+
+/**
+ * @brief Find, for each column of a matrix of points, the closest column of a
+ *     matrix of centroids w.r.t. a built-in metric
+ *
+ * This is the dense nearest-centroid kernel. For the 2-norm, all squared
+ * distances are obtained from
+ * \f$ \| x \|^2 - 2 C^T x + \| c \|^2 \f$, i.e., from a single
+ * matrix-matrix product \f$ C^T X \f$ and the (precomputed) squared column
+ * norms of \f$ C \f$. The term \f$ \| x \|^2 \f$ does not change the
+ * arg min and is therefore omitted. Since the expansion is prone to
+ * cancellation, distances to the (usually unique) candidate columns are
+ * recomputed directly.
+ *
+ * In case of ties, the first such column is returned.
+ *
+ * @param inMatrix The centroids \f$ C \f$ (one per column)
+ * @param inColSquaredNorms The squared 2-norms of the columns of \c inMatrix.
+ *     Only used for the 2-norm.
+ * @param inVectors The points \f$ X \f$ (one per column), with as many rows
+ *     as \c inMatrix
+ * @param inMetric A built-in metric other than \c kUserDefinedMetric
+ * @param outColumns Array of length <tt>inVectors.cols()</tt> that receives
+ *     the indices of the closest columns
+ * @param outDistances Array of length <tt>inVectors.cols()</tt> that receives
+ *     the distances to the closest columns
+ */
+template <class Derived, class NormsDerived, class OtherDerived>
+void
+closestColumnsAndDistances(
+    const Eigen::MatrixBase<Derived>& inMatrix,
+    const Eigen::MatrixBase<NormsDerived>& inColSquaredNorms,
+    const Eigen::MatrixBase<OtherDerived>& inVectors,
+    DistanceMetric inMetric,
+    dbal::eigen_integration::Index* outColumns,
+    double* outDistances) {
+
+    using namespace dbal::eigen_integration;
+
+    if (inMatrix.rows() != inVectors.rows())
+        throw std::invalid_argument("Dimensions of matrix and vector do not "
+            "match.");
+    if (inMatrix.cols() == 0)
+        throw std::invalid_argument("Matrix must have at least one column.");
+
+    switch (inMetric) {
+        case kDistNorm2:
+        case kSquaredDistNorm2: {
+            if (inColSquaredNorms.size() != inMatrix.cols())
+                throw std::logic_error("Internal error: Column norms do not "
+                    "match matrix in closestColumnsAndDistances().");
+
+            // The only BLAS-3 operation: All columns of X at once
+            Matrix shiftedDists = -2 * (inMatrix.transpose() * inVectors);
+            shiftedDists.colwise() += inColSquaredNorms;
+            double maxColSquaredNorm = inColSquaredNorms.maxCoeff();
+
+            for (Index j = 0; j < inVectors.cols(); ++j) {
+                double minShiftedDist = shiftedDists.col(j).minCoeff();
+
+                // Rounding errors in the expansion are bounded by (a small
+                // multiple of) this tolerance. All columns within it of the
+                // minimum are candidates and are compared exactly, which also
+                // keeps the tie-breaking of the generic code path.
+                double tolerance = 4 * inMatrix.rows()
+                    * std::numeric_limits<double>::epsilon()
+                    * (inVectors.col(j).squaredNorm() + maxColSquaredNorm);
+
+                Index closest = 0;
+                double dist = std::numeric_limits<double>::infinity();
+                for (Index i = 0; i < inMatrix.cols(); ++i) {
+                    if (shiftedDists(i, j) > minShiftedDist + tolerance)
+                        continue;
+
+                    double currentDist
+                        = (inMatrix.col(i) - inVectors.col(j)).squaredNorm();
+                    if (currentDist < dist) {
+                        closest = i;
+                        dist = currentDist;
+                    }
+                }
+                outColumns[j] = closest;
+                outDistances[j]
+                    = inMetric == kDistNorm2 ? std::sqrt(dist) : dist;
+            }
+        } break;
+        case kDistNorm1:
+        case kSquaredDistNorm1: {
+            for (Index j = 0; j < inVectors.cols(); ++j) {
+                Index closest;
+                double dist = (inMatrix.colwise() - inVectors.col(j))
+                    .cwiseAbs().colwise().sum().minCoeff(&closest);
+
+                outColumns[j] = closest;
+                outDistances[j]
+                    = inMetric == kDistNorm1 ? dist : dist * dist;
+            }
+        } break;
+        default:
+            throw std::logic_error("Unknown metric passed to "
+                "closestColumnsAndDistances().");
+    }
+}
+
+/**
+ * @brief Find the closest column of a matrix w.r.t. an arbitrary metric
+ *
+ * The metric is called once per column. In case of ties, the first such
+ * column is returned.
+ */
+template <class Derived, class OtherDerived>
 std::tuple<dbal::eigen_integration::Index, double>
-closestColumnAndDistance(const Eigen::MatrixBase<Derived>& inMatrix,
-    const Eigen::MatrixBase<OtherDerived>& inVector, FunctionHandle& inMetric);
+closestColumnAndDistance(
+    const Eigen::MatrixBase<Derived>& inMatrix,
+    const Eigen::MatrixBase<OtherDerived>& inVector,
+    FunctionHandle& inMetric) {
+
+    using namespace dbal::eigen_integration;
+
+    Index closestColumn = 0;
+    double minDist = std::numeric_limits<double>::infinity();
+
+    for (Index i = 0; i < inMatrix.cols(); ++i) {
+        double currentDist
+            = inMetric(inMatrix.col(i), inVector).template getAs<double>();
+        if (currentDist < minDist) {
+            closestColumn = i;
+            minDist = currentDist;
+        }
+    }
+
+    return std::tuple<Index, double>(closestColumn, minDist);
+}
 
 } // namespace linalg
 
@@ -28,6 +28,19 @@ FunctionHandle::funcID() const {
     return mFuncInfo->oid;
 }
 
+/**
+ * @brief Return the address of the C function that implements this function
+ *
+ * The lookup (including the permission check) is done only once per query, as
+ * it is cached in the FunctionInformation. Callers may compare the result
+ * against known entry points in order to bypass the function manager.
+ */
+inline
+PGFunction
+FunctionHandle::funcPtr() {
+    return mFuncInfo->getFuncMgrInfo()->fn_addr;
+}
+
 inline
 void
 FunctionHandle::setFunctionCallOptions(uint32_t inFlags) {
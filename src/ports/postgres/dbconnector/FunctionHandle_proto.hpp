@@ -27,6 +27,7 @@ public:
     FunctionHandle(SystemInformation* inSysInfo, Oid inFuncID);
 
     Oid funcID() const;
+    PGFunction funcPtr();
     void setFunctionCallOptions(uint32_t inFlags);
     uint32_t getFunctionCallOptions() const;
     AnyType invoke(AnyType& args);